@@ -4,6 +4,9 @@
 #include <linux/kernel.h>
 
 #define MSI_DRIVER_NAME "msi-ec"
+#define MSI_EC_SIM_NAME "msi-ec-sim"
+#define MSI_EC_SIM_FIRMWARE "msi-ec-sim.bin"
+#define MSI_EC_RAM_SIZE 256
 #define MSI_EC_FN_WIN_ADDRESS 0xe8
 #define MSI_EC_FN_WIN_BIT 4
 #define MSI_EC_FN_KEY_LEFT 1
@@ -15,6 +18,10 @@
 #define MSI_EC_BATTERY_MODE_MAX_CHARGE 0xe4
 #define MSI_EC_BATTERY_MODE_MEDIUM_CHARGE 0xd0
 #define MSI_EC_BATTERY_MODE_MIN_CHARGE 0xbc
+#define MSI_EC_BATTERY_MODE_ENABLE_BIT 7 /* the low bits are the stop threshold */
+#define MSI_EC_BATTERY_MODE_THRESHOLD_MASK 0x7f
+#define MSI_EC_BATTERY_THRESHOLD_MIN 10
+#define MSI_EC_BATTERY_THRESHOLD_MAX 100
 #define MSI_EC_COOLER_BOOST_ADDRESS 0x98
 #define MSI_EC_COOLER_BOOST_BIT 7
 #define MSI_EC_SHIFT_MODE_ADDRESS 0xf2
@@ -32,8 +39,17 @@
 #define MSI_EC_CPU_REALTIME_FAN_SPEED_ADDRESS 0x71
 #define MSI_EC_CPU_REALTIME_FAN_SPEED_BASE_MIN 0x19
 #define MSI_EC_CPU_REALTIME_FAN_SPEED_BASE_MAX 0x37
+#define MSI_EC_CPU_FAN_CURVE_TEMPERATURE_ADDRESS 0x6a
+#define MSI_EC_CPU_FAN_CURVE_SPEED_ADDRESS 0x72
 #define MSI_EC_GPU_REALTIME_TEMPERATURE_ADDRESS 0x80
 #define MSI_EC_GPU_REALTIME_FAN_SPEED_ADDRESS 0x89
+#define MSI_EC_GPU_FAN_CURVE_TEMPERATURE_ADDRESS 0x82
+#define MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS 0x8a
+#define MSI_EC_FAN_CURVE_LENGTH 7 /* the last point is unused by MSI Center */
+#define MSI_EC_CPU_REALTIME_FAN_RPM_ADDRESS 0xc8 /* u16, little endian */
+#define MSI_EC_GPU_REALTIME_FAN_RPM_ADDRESS 0xca /* u16, little endian */
+#define MSI_EC_GRAPHICS_SWITCH_ADDRESS 0xd1 /* models with a dGPU only */
+#define MSI_EC_GRAPHICS_SWITCH_MASK 0x3
 #define MSI_EC_FAN_MODE_ADDRESS 0xd4
 #define MSI_EC_FAN_MODE_SILENT_BIT 4
 #define MSI_EC_FAN_MODE_BASIC_BIT 6 /* Modern 15: unused by MSI Center; useless due to unknown BASIC_FAN_SPEED_ADDRESS  */
@@ -52,6 +68,17 @@
 #define MSI_EC_WEBCAM_BIT 1
 #define MSI_EC_WEBCAM_HARD_ADDRESS 0x2f
 #define MSI_EC_WEBCAM_HARD_BIT 1 /* hotkey has no effect if this address disables the cam */
+#define MSI_EC_FN_LOCK_ADDRESS 0xd9
+#define MSI_EC_FN_LOCK_BIT 1 /* read-only, toggled by the firmware */
+#define MSI_EC_KBD_LOCK_ADDRESS 0x2c
+#define MSI_EC_KBD_LOCK_MASK 0x0c /* two bits, either one locks */
+
+#define MSI_EC_CPU_POWER_ADDRESS 0x79
+#define MSI_EC_GPU_POWER_ADDRESS 0x91
+#define MSI_EC_PRESET_SHIFT_MODE_ADDRESS 0xd2
+#define MSI_EC_BATTERY_SAVING_ADDRESS 0xeb
+#define MSI_EC_BATTERY_SAVING_FLAGS_MASK 0x0f /* all set by super_battery */
+#define MSI_EC_BATTERY_NAME "BAT1" /* power_supply of the internal battery */
 
 #define MSI_EC_KBD_BL_ADDRESS 0xd3
 #define MSI_EC_KBD_BL_STATE_MASK 0x3
@@ -91,4 +118,14 @@ static u8 MSI_EC_PRESET_VALUE_TABLE[4][6] = {
 #define MSI_EC_PRESET_COLUMN_SILENT_FLAG 4
 #define MSI_EC_PRESET_COLUMN_BATTERY_SAVING 5
 
+/* Settings blob (see the settings attribute) */
+#define MSI_EC_SETTINGS_MAGIC "MSEC"
+#define MSI_EC_SETTINGS_VERSION 1
+
+/* ACPI EC host interface (ACPI spec, 12.2 and 12.3) */
+#define MSI_EC_CMD_READ 0x80
+#define MSI_EC_CMD_BURST_ENABLE 0x82
+#define MSI_EC_CMD_BURST_DISABLE 0x83
+#define MSI_EC_BURST_ACK 0x90
+
 #endif // __MSI_EC_CONSTANTS__
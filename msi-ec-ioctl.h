@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+#ifndef __MSI_EC_IOCTL__
+#define __MSI_EC_IOCTL__
+
+/*
+ * Userspace interface of the /dev/msi-ec character device.
+ *
+ * Performance leases: every open file descriptor may hold one lease, a floor
+ * for the shift mode, the fan mode and cooler boost. The driver applies the
+ * maximum of all active leases and restores the previous state once the last
+ * lease is dropped, either explicitly or by closing the descriptor (which
+ * includes the holder exiting or crashing).
+ *
+ * Batches: a batch is an array of EC operations executed in order. It is
+ * submitted either synchronously with MSI_EC_IOC_BATCH or asynchronously as
+ * an io_uring IORING_OP_URING_CMD with cmd_op MSI_EC_URING_CMD_BATCH and a
+ * struct msi_ec_batch in the command area of the SQE. Asynchronous batches
+ * of one file run in submission order, and their completion reports the
+ * number of operations executed. Every operation reports its own result.
+ * Operations that modify the EC need a descriptor opened for writing; raw
+ * writes additionally need CAP_SYS_ADMIN.
+ *
+ * Policy hook: with policy_interval_ms set, the driver periodically passes a
+ * struct msi_ec_policy_sample to msi_ec_policy_decide(), which returns a
+ * decision built with MSI_EC_POLICY_DECISION(). The built-in hook never
+ * decides anything; BPF programs attached with fmod_ret replace its return
+ * value. The decision is a floor merged with the leases.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Shift mode floors, in ascending order of performance */
+#define MSI_EC_LEASE_SHIFT_NONE 0
+#define MSI_EC_LEASE_SHIFT_ECO 1
+#define MSI_EC_LEASE_SHIFT_BALANCED 2
+#define MSI_EC_LEASE_SHIFT_OVERCLOCK 3
+
+/* Fan mode floors, in ascending order of performance */
+#define MSI_EC_LEASE_FAN_NONE 0
+#define MSI_EC_LEASE_FAN_AUTO 1
+#define MSI_EC_LEASE_FAN_ADVANCED 2
+
+#define MSI_EC_LEASE_COOLER_BOOST (1 << 0)
+
+struct msi_ec_lease {
+	__u8 shift_mode;
+	__u8 fan_mode;
+	__u8 flags;
+	__u8 reserved; /* must be zero */
+};
+
+struct msi_ec_lease_state {
+	struct msi_ec_lease floor; /* maximum of all active leases */
+	__u32 count; /* number of active leases */
+};
+
+#define MSI_EC_OP_READ 1 /* value = EC[addr] */
+#define MSI_EC_OP_WRITE 2 /* EC[addr] = value */
+#define MSI_EC_OP_UPDATE_BITS 3 /* EC[addr] = (EC[addr] & ~mask) | (value & mask) */
+#define MSI_EC_OP_PRESET 4 /* apply preset number value (as in preset) */
+
+struct msi_ec_op {
+	__u8 type;
+	__u8 addr;
+	__u8 value;
+	__u8 mask;
+	__s32 result; /* set by the driver: 0 or a negative errno */
+};
+
+#define MSI_EC_BATCH_MAX 256
+#define MSI_EC_BATCH_STOP_ON_ERROR (1 << 0) /* later ops get -ECANCELED */
+
+/* Fits the 16 byte command area of a regular SQE */
+struct msi_ec_batch {
+	__u64 ops; /* pointer to an array of struct msi_ec_op */
+	__u32 count;
+	__u32 flags;
+};
+
+struct msi_ec_policy_sample {
+	__u64 timestamp_ns; /* CLOCK_MONOTONIC */
+	__u8 cpu_temperature; /* celsius */
+	__u8 gpu_temperature; /* celsius, 0 without a dGPU */
+	__u8 cpu_fan_speed; /* percent */
+	__u8 ac_connected;
+	__u16 cpu_fan_rpm; /* raw EC value, as in snapshot */
+	__u16 gpu_fan_rpm; /* raw EC value, 0 without a dGPU */
+	__u8 shift_mode; /* MSI_EC_LEASE_SHIFT_* level of the current mode */
+	__u8 fan_mode; /* MSI_EC_LEASE_FAN_* level of the current mode */
+	__u8 cooler_boost;
+	__u8 reserved;
+	__u32 decisions; /* decisions applied so far */
+};
+
+/*
+ * Return values of msi_ec_policy_decide(). A decision is a floor like a
+ * lease: it can raise the shift mode, the fan mode and cooler boost, but
+ * never select a mode below the leases or the user's own settings.
+ * Anything else, negative values included, is counted as rejected and
+ * leaves the floor of the previous decision in place.
+ */
+#define MSI_EC_POLICY_NONE 0
+#define MSI_EC_POLICY_DECISION(shift_mode, fan_mode, flags) \
+	((1 << 24) | ((flags) << 16) | ((fan_mode) << 8) | (shift_mode))
+
+#define MSI_EC_IOC_MAGIC 0xec
+
+/* Sets or replaces the lease of this file descriptor */
+#define MSI_EC_IOC_SET_LEASE _IOW(MSI_EC_IOC_MAGIC, 1, struct msi_ec_lease)
+/* Drops the lease of this file descriptor */
+#define MSI_EC_IOC_CLEAR_LEASE _IO(MSI_EC_IOC_MAGIC, 2)
+/* Reports the combined floor of all leases */
+#define MSI_EC_IOC_GET_LEASES _IOR(MSI_EC_IOC_MAGIC, 3, struct msi_ec_lease_state)
+/* Runs a batch synchronously; returns the number of operations executed */
+#define MSI_EC_IOC_BATCH _IOW(MSI_EC_IOC_MAGIC, 4, struct msi_ec_batch)
+
+/* io_uring command opcode */
+#define MSI_EC_URING_CMD_BATCH MSI_EC_IOC_BATCH
+
+#endif // __MSI_EC_IOCTL__
@@ -15,8 +15,32 @@
  *   fan_mode          FAN performance modes
  *   fw_version        Firmware version
  *   fw_release_date   Firmware release date
+ *   snapshot          All telemetry and mode states from a single pass
+ *   ec_stats          EC transactions issued by this driver
+ *   settings          All tunable EC state as a binary blob (save/restore)
+ *   config            Runtime configuration (register map, intervals, groups)
  *   cpu/..            CPU related options
- *   gpu/..            GPU related options
+ *   gpu/..            GPU related options (only with a dGPU)
+ *   feedforward/..    Fan pre-spin on CPU load ramps
+ *   energy/..         Battery energy used per preset and shift mode
+ *   policy/..         Decisions of the BPF policy hook
+ *   flight_recorder/.. Recent thermal history, dumped on panic (pstore)
+ *   fan_guard/..      Fan stall and thermal runaway detection with fallback
+ *   fan_calibration/.. Percent to RPM table measured by a fan sweep
+ *
+ * State transitions and write failures are journaled in debugfs
+ * (<device>/journal).
+ *
+ * The /dev/<device> character device (/dev/msi-ec for the laptop's EC)
+ * hands out performance leases and runs batches of EC operations (see
+ * msi-ec-ioctl.h).
+ *
+ * Every device has its own state. Besides the EC of the laptop, the
+ * sim_ecs module parameter binds simulated ECs (msi-ec-sim.N) that keep
+ * their EC RAM in memory.
+ *
+ * With the sample_interval_ms module parameter set, a sampler keeps the
+ * snapshot registers cached and notifies pollers of snapshot on changes.
  *
  * This driver also registers available led class devices for
  * mute, micmute and keyboard_backlight leds
@@ -27,727 +51,6567 @@
  */
 
 #include "constants.h"
+#include "msi-ec-ioctl.h"
 
 #include <acpi/battery.h>
 #include <linux/acpi.h>
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
+#include <linux/error-injection.h>
+#include <linux/firmware.h>
+#include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/kernel_stat.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/lockdep.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <linux/panic_notifier.h>
+#include <linux/pci.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/power_supply.h>
 #include <linux/proc_fs.h>
+#include <linux/reboot.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/tick.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vgaarb.h>
+#include <linux/workqueue.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
 
 #define streq(x, y) (strcmp(x, y) == 0 || strcmp(x, y "\n") == 0)
 
-static int ec_read_seq(u8 addr, u8 *buf, u8 len)
-{
-	int result;
-	u8 i;
-	for (i = 0; i < len; i++) {
-		result = ec_read(addr + i, buf + i);
-		if (result < 0)
-			return result;
-	}
-	return 0;
-}
+// ============================================================ //
+// Device state
+// ============================================================ //
 
-static int ec_write_bit(u8 addr, u8 index, bool set)
-{
-	u8 data;
-	int result;
+struct msi_ec_dev;
 
-	result = ec_read(addr, &data);
-	if (result < 0)
-		return result;
-	if(set)
-		data |= (1UL << index);
-	else
-		data &= ~(1UL << index);
+/*
+ * How a device reaches its EC: through the ACPI EC driver, or in memory for
+ * the simulated ECs (see "EC backends"). setup runs once when the device
+ * binds; without transaction, the burst access path is not available.
+ */
+struct msi_ec_ops {
+	const char *name;
+	int (*setup)(struct msi_ec_dev *ec); /* optional */
+	int (*read)(struct msi_ec_dev *ec, u8 addr, u8 *data);
+	int (*write)(struct msi_ec_dev *ec, u8 addr, u8 data);
+	int (*transaction)(struct msi_ec_dev *ec, u8 command, const u8 *wdata,
+			   unsigned int wdata_len, u8 *rdata,
+			   unsigned int rdata_len);
+};
 
-	return ec_write(addr, data);
-}
+/* Counters for every EC transaction issued by this driver */
+struct ec_stats {
+	atomic64_t reads;
+	atomic64_t writes;
+	atomic64_t errors;
+	atomic64_t busy_ns;
+	atomic64_t cache_hits;
+	atomic64_t lock_waits;
+	atomic64_t blocked;
+	atomic64_t deferred;
+	atomic64_t external_changes;
+};
 
-static bool is_bit_set(u8 index, u8 byte)
+/*
+ * Duty cycle budget: a token bucket of EC busy time, refilled at
+ * ec_budget_percent of the wall time and holding up to one second worth of
+ * it. Every transaction of this driver is charged; once the bucket is empty,
+ * the background workers (sampler, energy, policy, flight recorder) skip
+ * their rounds, while writes requested by users, leases and batches still go
+ * through. The ACPI battery, thermal and AC methods share the EC and keep
+ * the rest of its time. Every device has a bucket of its own.
+ */
+static unsigned int ec_budget_percent;
+
+struct ec_budget {
+	spinlock_t lock;
+	s64 tokens_ns;
+	u64 stamp_ns;
+};
+
+/*
+ * Runtime configuration, replaced as a whole through the config attribute.
+ * Readers see either the old or the new copy: they take it with
+ * rcu_dereference() or, when they sleep, with config_get(). Writers publish
+ * new copies under the device's config_lock.
+ */
+struct msi_ec_config {
+	unsigned int cache_ms; /* cache lifetime, 0 = two sampling periods */
+	unsigned long features; /* enabled optional groups (config_features) */
+	u8 fan_speed_min; /* raw CPU fan speed at 0 % */
+	u8 fan_speed_max; /* raw CPU fan speed at 100 % */
+	u8 preset_regs[ARRAY_SIZE(MSI_EC_PRESET_MEMORY_TABLE)];
+	u8 preset_values[ARRAY_SIZE(MSI_EC_PRESET_VALUE_TABLE)]
+			[ARRAY_SIZE(MSI_EC_PRESET_MEMORY_TABLE)];
+	struct rcu_head rcu;
+};
+
+/*
+ * Last known value of every register the driver has read or written. Readers
+ * are served from it for two sampling periods (or the configured cache_ms),
+ * so it is only used while the sampler keeps it fresh. The registers watched
+ * for external changes are kept fresh by the watcher as well.
+ */
+struct ec_cache {
+	spinlock_t lock;
+	u8 regs[MSI_EC_RAM_SIZE];
+	unsigned long stamp[MSI_EC_RAM_SIZE];
+	DECLARE_BITMAP(valid, MSI_EC_RAM_SIZE);
+	DECLARE_BITMAP(watched, MSI_EC_RAM_SIZE);
+};
+
+/*
+ * What the watcher last read from the watched ranges, updated with what the
+ * driver wrote there since. Unlike the cache it doesn't take in the driver's
+ * reads, which would absorb an external change before the watcher sees it.
+ */
+struct ec_watch_shadow {
+	spinlock_t lock;
+	u8 regs[MSI_EC_RAM_SIZE];
+	DECLARE_BITMAP(valid, MSI_EC_RAM_SIZE);
+};
+
+/* Access paths, see ec_paths */
+enum {
+	EC_PATH_READ,
+	EC_PATH_BURST,
+	EC_PATHS,
+};
+
+/* Benchmark results of an access path, under paths_lock */
+struct ec_path_bench {
+	int result; /* 0, an errno, or -EILSEQ for wrong data */
+	bool tested;
+	u64 single_ns; /* per byte */
+	u64 block_ns; /* per byte */
+};
+
+/*
+ * The periodic workers, in the order of config_intervals. A worker runs
+ * every interval_ms (0 = stopped); ready is set once its state is set up,
+ * and lock orders interval changes against starting and stopping it.
+ */
+enum {
+	WORKER_SAMPLER,
+	WORKER_ENERGY,
+	WORKER_POLICY,
+	WORKER_FLIGHT_RECORDER,
+	WORKER_FAN_GUARD,
+	WORKER_WATCH,
+	WORKERS,
+};
+
+struct ec_worker {
+	struct msi_ec_dev *ec;
+	struct mutex lock;
+	struct delayed_work work;
+	unsigned int interval_ms;
+	bool ready;
+};
+
+struct ec_fans;
+struct ec_journal;
+struct ec_sampler;
+struct ec_arbiter;
+struct ec_ff;
+struct ec_energy;
+struct ec_fr;
+struct ec_guard;
+struct ec_cal;
+
+/*
+ * State of one bound device. Several devices may be bound at once: the EC
+ * of the laptop and any number of simulated ECs, each with its own cache,
+ * workers, leases, /dev node and journal. The state is freed once the
+ * device is unbound and the last file of its /dev node is closed; the EC is
+ * not accessed after the unbind.
+ */
+struct msi_ec_dev {
+	struct platform_device *pdev;
+	const struct msi_ec_ops *ops;
+	struct list_head node; /* in msi_ec_devs */
+	/* Set by the backend; the GPU registers are ignored without a dGPU */
+	bool has_dgpu;
+	struct kref ref; /* the binding and every open file of miscdev */
+
+	struct ec_stats stats;
+	struct ec_budget budget;
+
+	/*
+	 * From the PM prepare callback until complete, the EC is not accessed
+	 * at all: any EC traffic wakes the platform from suspend-to-idle.
+	 * Accesses in that window fail with -EBUSY and are counted as blocked,
+	 * accesses after the unbind fail with -ENODEV. The semaphore lets
+	 * prepare and the unbind wait for accesses already in flight.
+	 */
+	struct rw_semaphore pm_sem;
+	bool suspended;
+	bool unbound;
+
+	struct msi_ec_config __rcu *cfg;
+	struct mutex config_lock;
+
+	/*
+	 * Read-modify-write cycles are serialized by a lock per register, so
+	 * updates of different bits of one register cannot be lost while
+	 * independent registers are still updated in parallel. Reads are not
+	 * locked; the backends serialize single transactions on their own.
+	 *
+	 * Operations spanning several registers take multi_lock first and
+	 * then the register locks in ascending address order (see
+	 * ec_lock_regs()).
+	 */
+	struct mutex reg_locks[MSI_EC_RAM_SIZE];
+	struct mutex multi_lock;
+
+	struct ec_cache cache;
+	struct ec_watch_shadow watch_shadow;
+
+	struct mutex paths_lock;
+	struct ec_path_bench paths[EC_PATHS];
+	const struct ec_path *path_single;
+	const struct ec_path *path_block;
+
+	u8 sim_regs[MSI_EC_RAM_SIZE]; /* EC RAM of a simulated EC */
+
+	struct ec_worker workers[WORKERS];
+	DECLARE_BITMAP(pm_paused, WORKERS); /* workers stopped by prepare */
+	bool pm_ff_paused;
+	struct notifier_block watch_nb;
+
+	struct {
+		atomic64_t runs;
+		atomic64_t decisions;
+		atomic64_t rejected;
+	} policy_stats;
+
+	struct mutex cal_lock;
+	struct delayed_work cal_work;
+	unsigned int cal_max_temperature;
+
+	struct miscdevice miscdev;
+	struct workqueue_struct *batch_wq;
+	struct dentry *debugfs;
+
+	struct led_classdev micmute_led;
+	struct led_classdev mute_led;
+	struct led_classdev kbd_led;
+	struct led_classdev fnlock_led;
+
+	/* State of the sections of the same names */
+	struct ec_fans *fans;
+	struct ec_journal *journal;
+	struct ec_sampler *sampler;
+	struct ec_arbiter *arbiter;
+	struct ec_ff *ff;
+	struct ec_energy *energy;
+	struct ec_fr *fr;
+	struct ec_guard *guard;
+	struct ec_cal *cal;
+};
+
+/* Bound devices, for the module parameters that apply to all of them */
+static LIST_HEAD(msi_ec_devs);
+static DEFINE_MUTEX(msi_ec_devs_lock);
+
+static void msi_ec_free(struct kref *ref);
+
+static struct msi_ec_dev *worker_ec(struct work_struct *work)
 {
-	return (byte >> index) & 1UL;
+	return container_of(to_delayed_work(work), struct ec_worker, work)->ec;
 }
 
 // ============================================================ //
-// Sysfs platform device attributes (root)
+// dGPU detection
 // ============================================================ //
 
-static ssize_t webcam_show(struct device *device, struct device_attribute *attr,
-			   char *buf)
+/* -1: detect, 0: no dGPU, 1: dGPU present */
+static int dgpu = -1;
+module_param(dgpu, int, 0444);
+MODULE_PARM_DESC(dgpu, "Expose the GPU registers (-1 = detect, 0 = no, 1 = yes)");
+
+/*
+ * The bus position doesn't tell the GPUs apart: AMD APUs and recent Intel
+ * parts put the iGPU behind an internal bridge, like a dGPU behind a root
+ * port. MSI laptops with a dGPU are hybrids, so it is taken as present
+ * when there is a display controller besides the boot VGA device (or a
+ * second one when the VGA arbiter doesn't know the boot device). A dGPU
+ * that is the only GPU needs dgpu=1.
+ */
+static unsigned int pci_class_count_except(unsigned int class,
+					   struct pci_dev *except)
 {
-	u8 rdata;
-	int result;
+	struct pci_dev *pdev = NULL;
+	unsigned int count = 0;
 
-	result = ec_read(MSI_EC_WEBCAM_ADDRESS, &rdata);
-	if (result < 0)
-		return result;
+	while ((pdev = pci_get_class(class, pdev)))
+		if (pdev != except)
+			count++;
 
-	if(is_bit_set(MSI_EC_WEBCAM_BIT, rdata))
-		return sprintf(buf, "%s\n", "on");
-	else
-		return sprintf(buf, "%s\n", "off");
+	return count;
 }
 
-static ssize_t webcam_store(struct device *dev, struct device_attribute *attr,
-			    const char *buf, size_t count)
+static bool detect_dgpu(void)
 {
-	int result = -EINVAL;
-
-	if (streq(buf, "on"))
-		result = ec_write_bit(MSI_EC_WEBCAM_ADDRESS,
-				      MSI_EC_WEBCAM_BIT,
-				      TRUE);
+	struct pci_dev *boot = vga_default_device();
+	unsigned int others;
 
-	if (streq(buf, "off"))
-		result = ec_write_bit(MSI_EC_WEBCAM_ADDRESS,
-				      MSI_EC_WEBCAM_BIT,
-				      FALSE);
+	if (dgpu >= 0)
+		return dgpu;
 
-	if (result < 0)
-		return result;
+	others = pci_class_count_except(PCI_CLASS_DISPLAY_VGA << 8, boot) +
+		 pci_class_count_except(PCI_CLASS_DISPLAY_3D << 8, boot);
 
-	return count;
+	return others > (boot ? 0 : 1);
 }
 
-static ssize_t fn_key_show(struct device *device, struct device_attribute *attr,
-			   char *buf)
-{
-	u8 rdata;
-	int result;
+// ============================================================ //
+// EC backends
+// ============================================================ //
 
-	result = ec_read(MSI_EC_FN_WIN_ADDRESS, &rdata);
-	if (result < 0)
-		return result;
+static int ec_acpi_read(struct msi_ec_dev *ec, u8 addr, u8 *data)
+{
+	return ec_read(addr, data);
+}
 
-	if(is_bit_set(MSI_EC_FN_WIN_BIT, rdata) == MSI_EC_FN_KEY_LEFT) {
-		return sprintf(buf, "%s\n", "left");
-	}
-	else {
-		return sprintf(buf, "%s\n", "right");
-	}
+static int ec_acpi_write(struct msi_ec_dev *ec, u8 addr, u8 data)
+{
+	return ec_write(addr, data);
 }
 
-static ssize_t fn_key_store(struct device *dev, struct device_attribute *attr,
-			    const char *buf, size_t count)
+static int ec_acpi_transaction(struct msi_ec_dev *ec, u8 command,
+			       const u8 *wdata, unsigned int wdata_len,
+			       u8 *rdata, unsigned int rdata_len)
 {
-	int result = -EINVAL;
+	return ec_transaction(command, wdata, wdata_len, rdata, rdata_len);
+}
 
-	if (streq(buf, "left"))
-		result = ec_write_bit(MSI_EC_FN_WIN_ADDRESS,
-				      MSI_EC_FN_WIN_BIT,
-				      MSI_EC_FN_KEY_LEFT);
+static int ec_acpi_setup(struct msi_ec_dev *ec)
+{
+	ec->has_dgpu = detect_dgpu();
+	pr_info("msi-ec: %s\n", ec->has_dgpu ? "dGPU found" : "no dGPU found");
+	return 0;
+}
 
-	if (streq(buf, "right"))
-		result = ec_write_bit(MSI_EC_FN_WIN_ADDRESS,
-				      MSI_EC_FN_WIN_BIT,
-				      MSI_EC_FN_KEY_RIGHT);
+/* Every transaction holds the ACPI EC driver's lock and the global lock */
+static const struct msi_ec_ops ec_acpi_ops = {
+	.name = "acpi",
+	.setup = ec_acpi_setup,
+	.read = ec_acpi_read,
+	.write = ec_acpi_write,
+	.transaction = ec_acpi_transaction,
+};
 
-	if (result < 0)
-		return result;
+/*
+ * Simulated ECs keep their RAM in sim_regs, seeded from the firmware file
+ * MSI_EC_SIM_FIRMWARE (a dump of the whole EC RAM, like
+ * qemu/modern-15-a11m.bin) or all zeros without it. They let many devices
+ * bind in one kernel to measure the driver's own overhead; every
+ * transaction takes sim_latency_us, like the EC of a laptop would.
+ */
+static unsigned int sim_latency_us;
+module_param(sim_latency_us, uint, 0644);
+MODULE_PARM_DESC(sim_latency_us,
+		 "Duration of every transaction of the simulated ECs in microseconds");
 
-	return count;
-}
+/* msi-ec-sim.0 up to msi-ec-sim.<sim_dgpus - 1> have a dGPU, the rest not */
+static unsigned int sim_dgpus;
+module_param(sim_dgpus, uint, 0444);
+MODULE_PARM_DESC(sim_dgpus, "Number of simulated ECs with a dGPU");
 
-static ssize_t win_key_show(struct device *device,
-			    struct device_attribute *attr, char *buf)
+static void ec_sim_delay(void)
 {
-	u8 rdata;
-	int result;
-
-	result = ec_read(MSI_EC_FN_WIN_ADDRESS, &rdata);
-	if (result < 0)
-		return result;
+	unsigned int latency = READ_ONCE(sim_latency_us);
 
-	if(is_bit_set(MSI_EC_FN_WIN_BIT, rdata) == MSI_EC_WIN_KEY_LEFT) {
-		return sprintf(buf, "%s\n", "left");
-	}
-	else {
-		return sprintf(buf, "%s\n", "right");
-	}
+	if (latency)
+		fsleep(latency);
 }
 
-static ssize_t win_key_store(struct device *dev, struct device_attribute *attr,
-			     const char *buf, size_t count)
+static int ec_sim_setup(struct msi_ec_dev *ec)
 {
-	int result = -EINVAL;
+	const struct firmware *image;
 
-	if (streq(buf, "left"))
-		result = ec_write_bit(MSI_EC_FN_WIN_ADDRESS,
-				      MSI_EC_FN_WIN_BIT,
-				      MSI_EC_WIN_KEY_LEFT);
+	ec->has_dgpu = ec->pdev->id >= 0 &&
+		       (unsigned int)ec->pdev->id < sim_dgpus;
 
-	if (streq(buf, "right"))
-		result = ec_write_bit(MSI_EC_FN_WIN_ADDRESS,
-				      MSI_EC_FN_WIN_BIT,
-				      MSI_EC_WIN_KEY_RIGHT);
+	if (firmware_request_nowarn(&image, MSI_EC_SIM_FIRMWARE,
+				    &ec->pdev->dev) < 0)
+		return 0;
 
-	if (result < 0)
-		return result;
+	if (image->size == MSI_EC_RAM_SIZE)
+		memcpy(ec->sim_regs, image->data, MSI_EC_RAM_SIZE);
+	else
+		pr_warn("msi-ec: %s: %s is not %d bytes, ignored\n",
+			dev_name(&ec->pdev->dev), MSI_EC_SIM_FIRMWARE,
+			MSI_EC_RAM_SIZE);
+	release_firmware(image);
+	return 0;
+}
 
-	return count;
+static int ec_sim_read(struct msi_ec_dev *ec, u8 addr, u8 *data)
+{
+	ec_sim_delay();
+	*data = READ_ONCE(ec->sim_regs[addr]);
+	return 0;
 }
 
-static ssize_t battery_charge_mode_show(struct device *device,
-				 	struct device_attribute *attr, char *buf)
+static int ec_sim_write(struct msi_ec_dev *ec, u8 addr, u8 data)
 {
-	u8 rdata;
-	int result;
+	ec_sim_delay();
+	WRITE_ONCE(ec->sim_regs[addr], data);
+	return 0;
+}
 
-	result = ec_read(MSI_EC_BATTERY_MODE_ADDRESS, &rdata);
-	if (result < 0)
-		return result;
+/* The commands of the burst access path */
+static int ec_sim_transaction(struct msi_ec_dev *ec, u8 command,
+			      const u8 *wdata, unsigned int wdata_len,
+			      u8 *rdata, unsigned int rdata_len)
+{
+	ec_sim_delay();
 
-	switch (rdata) {
-	case MSI_EC_BATTERY_MODE_MAX_CHARGE:
-		return sprintf(buf, "%s\n", "max");
-	case MSI_EC_BATTERY_MODE_MEDIUM_CHARGE:
-		return sprintf(buf, "%s\n", "medium");
-	case MSI_EC_BATTERY_MODE_MIN_CHARGE:
-		return sprintf(buf, "%s\n", "min");
+	switch (command) {
+	case MSI_EC_CMD_BURST_ENABLE:
+		if (rdata_len)
+			rdata[0] = MSI_EC_BURST_ACK;
+		return 0;
+	case MSI_EC_CMD_BURST_DISABLE:
+		return 0;
+	case MSI_EC_CMD_READ:
+		if (wdata_len != 1 || rdata_len != 1)
+			return -EINVAL;
+		rdata[0] = READ_ONCE(ec->sim_regs[wdata[0]]);
+		return 0;
 	default:
-		return sprintf(buf, "%s (%i)\n", "unknown", rdata);
+		return -EOPNOTSUPP;
 	}
 }
 
-static ssize_t battery_charge_mode_store(struct device *dev,
-				  	 struct device_attribute *attr,
-				  	 const char *buf, size_t count)
-{
-	int result = -EINVAL;
+static const struct msi_ec_ops ec_sim_ops = {
+	.name = "sim",
+	.setup = ec_sim_setup,
+	.read = ec_sim_read,
+	.write = ec_sim_write,
+	.transaction = ec_sim_transaction,
+};
 
-	if (streq(buf, "max"))
-		result = ec_write(MSI_EC_BATTERY_MODE_ADDRESS,
-				  MSI_EC_BATTERY_MODE_MAX_CHARGE);
+// ============================================================ //
+// EC access (accounted)
+// ============================================================ //
 
-	if (streq(buf, "medium"))
-		result = ec_write(MSI_EC_BATTERY_MODE_ADDRESS,
-				  MSI_EC_BATTERY_MODE_MEDIUM_CHARGE);
+static s64 ec_budget_burst(unsigned int percent)
+{
+	return (s64)percent * (NSEC_PER_SEC / 100);
+}
 
-	if (streq(buf, "min"))
-		result = ec_write(MSI_EC_BATTERY_MODE_ADDRESS,
-				  MSI_EC_BATTERY_MODE_MIN_CHARGE);
+/* Refills the bucket up to now; called with the budget lock held */
+static void ec_budget_refill(struct ec_budget *budget, unsigned int percent,
+			     u64 now)
+{
+	u64 elapsed = min_t(u64, now - budget->stamp_ns, NSEC_PER_SEC);
 
-	if (result < 0)
-		return result;
+	budget->stamp_ns = now;
+	budget->tokens_ns = min(budget->tokens_ns +
+				(s64)div_u64(elapsed * percent, 100),
+				ec_budget_burst(percent));
+}
 
-	return count;
+/* Fills the bucket; a new budget starts with a full one */
+static void ec_budget_reset(struct msi_ec_dev *ec)
+{
+	spin_lock(&ec->budget.lock);
+	ec->budget.tokens_ns = ec_budget_burst(READ_ONCE(ec_budget_percent));
+	ec->budget.stamp_ns = ktime_get_ns();
+	spin_unlock(&ec->budget.lock);
 }
 
-static ssize_t cooler_boost_show(struct device *device,
-				 struct device_attribute *attr, char *buf)
+static void ec_budget_charge(struct msi_ec_dev *ec, u64 busy_ns)
 {
-	u8 rdata;
-	int result;
+	unsigned int percent = READ_ONCE(ec_budget_percent);
 
-	result = ec_read(MSI_EC_COOLER_BOOST_ADDRESS, &rdata);
-	if (result < 0)
-		return result;
+	if (!percent)
+		return;
 
-	if(is_bit_set(MSI_EC_COOLER_BOOST_BIT, rdata))
-		return sprintf(buf, "%s\n", "on");
-	else
-		return sprintf(buf, "%s\n", "off");
+	spin_lock(&ec->budget.lock);
+	ec_budget_refill(&ec->budget, percent, ktime_get_ns());
+	/* Debt is bounded, so background work resumes within two seconds */
+	ec->budget.tokens_ns = max(ec->budget.tokens_ns - (s64)busy_ns,
+				   -ec_budget_burst(percent));
+	spin_unlock(&ec->budget.lock);
 }
 
-static ssize_t cooler_boost_store(struct device *dev,
-				  struct device_attribute *attr,
-				  const char *buf, size_t count)
+/* Whether a background worker has to skip its round; counted as deferred */
+static bool ec_budget_defer(struct msi_ec_dev *ec)
 {
-	int result = -EINVAL;
+	unsigned int percent = READ_ONCE(ec_budget_percent);
+	bool dry;
 
-	if (streq(buf, "on"))
-		result = ec_write_bit(MSI_EC_COOLER_BOOST_ADDRESS,
-				      MSI_EC_COOLER_BOOST_BIT,
-				      TRUE);
+	if (!percent)
+		return FALSE;
 
-	if (streq(buf, "off"))
-		result = ec_write_bit(MSI_EC_COOLER_BOOST_ADDRESS,
-				      MSI_EC_COOLER_BOOST_BIT,
-				      FALSE);
+	spin_lock(&ec->budget.lock);
+	ec_budget_refill(&ec->budget, percent, ktime_get_ns());
+	dry = ec->budget.tokens_ns <= 0;
+	spin_unlock(&ec->budget.lock);
 
-	if (result < 0)
-		return result;
+	if (dry)
+		atomic64_inc(&ec->stats.deferred);
+	return dry;
+}
 
-	return count;
+/* Share of the bucket in use, in percent; above 100 while in debt */
+static int ec_budget_used(struct msi_ec_dev *ec)
+{
+	unsigned int percent = READ_ONCE(ec_budget_percent);
+	s64 used;
+
+	if (!percent)
+		return 0;
+
+	spin_lock(&ec->budget.lock);
+	ec_budget_refill(&ec->budget, percent, ktime_get_ns());
+	used = ec_budget_burst(percent) - ec->budget.tokens_ns;
+	spin_unlock(&ec->budget.lock);
+
+	return div64_s64(100 * used, ec_budget_burst(percent));
 }
 
-static ssize_t shift_mode_show(struct device *device,
-			       struct device_attribute *attr, char *buf)
+static int ec_budget_percent_set(const char *val,
+				 const struct kernel_param *kp)
 {
-	u8 rdata;
+	struct msi_ec_dev *ec;
+	unsigned int percent;
 	int result;
 
-	result = ec_read(MSI_EC_SHIFT_MODE_ADDRESS, &rdata);
+	result = kstrtouint(val, 10, &percent);
 	if (result < 0)
 		return result;
+	if (percent > 100)
+		return -EINVAL;
 
-	switch (rdata) {
-	case MSI_EC_SHIFT_MODE_OVERCLOCK:
-		return sprintf(buf, "%s\n", "overclock");
-	case MSI_EC_SHIFT_MODE_BALANCED:
-		return sprintf(buf, "%s\n", "balanced");
-	case MSI_EC_SHIFT_MODE_ECO:
-		return sprintf(buf, "%s\n", "eco");
-	case MSI_EC_SHIFT_MODE_OFF:
-		return sprintf(buf, "%s\n", "off");
-	default:
-		return sprintf(buf, "%s (%i)\n", "unknown", rdata);
-	}
-}
+	mutex_lock(&msi_ec_devs_lock);
+	WRITE_ONCE(ec_budget_percent, percent);
+	list_for_each_entry(ec, &msi_ec_devs, node)
+		ec_budget_reset(ec);
+	mutex_unlock(&msi_ec_devs_lock);
 
-static ssize_t shift_mode_store(struct device *dev,
-				struct device_attribute *attr, const char *buf,
-				size_t count)
-{
-	int result = -EINVAL;
+	return 0;
+}
 
-	if (streq(buf, "overclock"))
-		result = ec_write(MSI_EC_SHIFT_MODE_ADDRESS,
-				  MSI_EC_SHIFT_MODE_OVERCLOCK);
+static const struct kernel_param_ops ec_budget_percent_ops = {
+	.set = ec_budget_percent_set,
+	.get = param_get_uint,
+};
 
-	if (streq(buf, "balanced"))
-		result = ec_write(MSI_EC_SHIFT_MODE_ADDRESS,
-				  MSI_EC_SHIFT_MODE_BALANCED);
+module_param_cb(ec_budget_percent, &ec_budget_percent_ops, &ec_budget_percent,
+		0644);
+MODULE_PARM_DESC(ec_budget_percent,
+		 "Share of wall time the background workers may keep the EC busy (0 = unlimited)");
 
-	if (streq(buf, "eco"))
-		result = ec_write(MSI_EC_SHIFT_MODE_ADDRESS,
-				  MSI_EC_SHIFT_MODE_ECO);
+static void config_get(struct msi_ec_dev *ec, struct msi_ec_config *cfg)
+{
+	rcu_read_lock();
+	*cfg = *rcu_dereference(ec->cfg);
+	rcu_read_unlock();
+}
 
-	if (streq(buf, "off"))
-		result = ec_write(MSI_EC_SHIFT_MODE_ADDRESS,
-				  MSI_EC_SHIFT_MODE_OFF);
+static void cache_store(struct msi_ec_dev *ec, u8 addr, u8 value)
+{
+	spin_lock(&ec->cache.lock);
+	ec->cache.regs[addr] = value;
+	ec->cache.stamp[addr] = jiffies;
+	set_bit(addr, ec->cache.valid);
+	spin_unlock(&ec->cache.lock);
+}
 
-	if (result < 0)
-		return result;
+static void watch_shadow_store(struct msi_ec_dev *ec, u8 addr, u8 value)
+{
+	spin_lock(&ec->watch_shadow.lock);
+	if (test_bit(addr, ec->watch_shadow.valid))
+		ec->watch_shadow.regs[addr] = value;
+	spin_unlock(&ec->watch_shadow.lock);
+}
 
-	return count;
+static bool cache_lookup(struct msi_ec_dev *ec, u8 addr, u8 *value)
+{
+	unsigned int interval;
+	unsigned int lifetime;
+	bool hit;
+
+	interval = READ_ONCE(ec->workers[WORKER_SAMPLER].interval_ms);
+	if (test_bit(addr, ec->cache.watched))
+		interval = max(interval,
+			       READ_ONCE(ec->workers[WORKER_WATCH].interval_ms));
+	if (!interval)
+		return FALSE;
+
+	rcu_read_lock();
+	lifetime = rcu_dereference(ec->cfg)->cache_ms;
+	rcu_read_unlock();
+	if (!lifetime)
+		lifetime = 2 * interval;
+
+	spin_lock(&ec->cache.lock);
+	hit = test_bit(addr, ec->cache.valid) &&
+	      time_before(jiffies, ec->cache.stamp[addr] +
+					   msecs_to_jiffies(lifetime));
+	if (hit)
+		*value = ec->cache.regs[addr];
+	spin_unlock(&ec->cache.lock);
+
+	return hit;
 }
 
-static ssize_t fan_mode_show(struct device *device,
-			     struct device_attribute *attr, char *buf)
+static void ec_account(struct msi_ec_dev *ec, atomic64_t *counter,
+		       unsigned int count, ktime_t start, int result)
 {
-	u8 rdata;
-	int result;
+	s64 busy_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
 
-	result = ec_read(MSI_EC_FAN_MODE_ADDRESS, &rdata);
+	atomic64_add(count, counter);
+	atomic64_add(busy_ns, &ec->stats.busy_ns);
+	ec_budget_charge(ec, busy_ns);
 	if (result < 0)
-		return result;
+		atomic64_inc(&ec->stats.errors);
+}
 
-	if (is_bit_set(MSI_EC_FAN_MODE_SILENT_BIT, rdata))  {
-		return sprintf(buf, "%s\n", "silent");
-	}
-	else if (is_bit_set(MSI_EC_FAN_MODE_ADVANCED_BIT, rdata))  {
-		return sprintf(buf, "%s\n", "advanced");
-	}
-	else if (is_bit_set(MSI_EC_FAN_MODE_BASIC_BIT, rdata)) {
-		return sprintf(buf, "%s\n", "basic");
-	}
-	else {
-		return sprintf(buf, "%s\n", "auto");
+static int ec_access_begin(struct msi_ec_dev *ec)
+{
+	int result = -EBUSY;
+
+	if (down_read_trylock(&ec->pm_sem)) {
+		if (READ_ONCE(ec->unbound))
+			result = -ENODEV;
+		else if (!READ_ONCE(ec->suspended))
+			return 0;
+		up_read(&ec->pm_sem);
 	}
+
+	if (result == -EBUSY)
+		atomic64_inc(&ec->stats.blocked);
+	return result;
 }
 
-static ssize_t fan_mode_store(struct device *dev, struct device_attribute *attr,
-			      const char *buf, size_t count)
+static void ec_access_end(struct msi_ec_dev *ec)
 {
-	int result = -EINVAL;
-	bool is_auto = streq(buf, "auto");
-	bool is_silent = streq(buf, "silent");
-	bool is_basic = streq(buf, "basic");
-	bool is_adv = streq(buf, "advanced");
+	up_read(&ec->pm_sem);
+}
 
-	if (!is_auto && !is_basic && !is_adv && !is_silent)
-		return result;
+/*
+ * Access paths. Single reads and block reads each go through the path that
+ * was fastest while returning the same data as the backend's read in the
+ * benchmark at probe (see ec_paths_benchmark()); the backend's read is used
+ * until then. Writes always go through the backend's write. On the ACPI
+ * backend, every path goes through ec_transaction(), which holds the ACPI
+ * EC driver's lock and the ACPI global lock.
+ *
+ * The burst path enters burst mode once per block and leaves it at the
+ * end. The ACPI EC driver's lock is only held for one transaction at a
+ * time, so AML may still run between the bytes of a block, and its field
+ * accesses wider than a byte end burst mode early. The benchmark measures
+ * block reads the way they run here, with those interruptions included.
+ */
+#define EC_BENCH_ROUNDS 8
 
-	result = ec_write_bit(MSI_EC_FAN_MODE_ADDRESS,
-			      MSI_EC_FAN_MODE_BASIC_BIT,
-			      is_basic);
+static int ec_backend_read(struct msi_ec_dev *ec, u8 addr, u8 *data)
+{
+	return ec->ops->read(ec, addr, data);
+}
 
-	if (result < 0)
-		return result;
+static int ec_backend_read_block(struct msi_ec_dev *ec, u8 addr, u8 *buf,
+				 u8 len)
+{
+	int result = 0;
+	u8 i;
 
-	result = ec_write_bit(MSI_EC_FAN_MODE_ADDRESS,
-			      MSI_EC_FAN_MODE_ADVANCED_BIT,
-			      is_adv);
+	for (i = 0; i < len && result >= 0; i++)
+		result = ec->ops->read(ec, addr + i, buf + i);
+	return result;
+}
 
-	if (result < 0)
-		return result;
+static int ec_burst_read_block(struct msi_ec_dev *ec, u8 addr, u8 *buf,
+			       u8 len)
+{
+	int result;
+	u8 ack;
+	u8 i;
 
-	result = ec_write_bit(MSI_EC_FAN_MODE_ADDRESS,
-			      MSI_EC_FAN_MODE_SILENT_BIT,
-			      is_silent);
+	if (!ec->ops->transaction)
+		return -EOPNOTSUPP;
 
+	result = ec->ops->transaction(ec, MSI_EC_CMD_BURST_ENABLE, NULL, 0,
+				      &ack, 1);
 	if (result < 0)
 		return result;
 
-	return count;
-}
+	/* An EC that didn't acknowledge may still have entered burst mode */
+	if (ack != MSI_EC_BURST_ACK)
+		result = -EOPNOTSUPP;
 
-static ssize_t preset_show(struct device *device,
-			     struct device_attribute *attr, char *buf)
-{
-	int c;
-	int v;
-	int result;
-	u8 rdata;
-	bool match;
+	for (i = 0; i < len && result >= 0; i++) {
+		u8 reg = addr + i;
 
-	for (v = 0; v < ARRAY_SIZE(MSI_EC_PRESET_VALUE_TABLE); v++) {
-		match = TRUE;
-		for (c = 0; c < ARRAY_SIZE(MSI_EC_PRESET_MEMORY_TABLE); c++) {
-			u8 addr = MSI_EC_PRESET_MEMORY_TABLE[c];
-			u8 value = MSI_EC_PRESET_VALUE_TABLE[v][c];
+		result = ec->ops->transaction(ec, MSI_EC_CMD_READ, &reg, 1,
+					      buf + i, 1);
+	}
 
-			result = ec_read(addr, &rdata);
+	ec->ops->transaction(ec, MSI_EC_CMD_BURST_DISABLE, NULL, 0, NULL, 0);
+	return result;
+}
 
-			if (result < 0) {
-				pr_err("msi-ec: preset_store: failed to read from address %#02x "
-				       "while checking preset %i (error code %i)",
-				       addr, v, result);
-				match = FALSE;
-				break;
-			}
+struct ec_path {
+	const char *name;
+	/* NULL: block reads only */
+	int (*read)(struct msi_ec_dev *ec, u8 addr, u8 *data);
+	int (*read_block)(struct msi_ec_dev *ec, u8 addr, u8 *buf, u8 len);
+};
 
-			// Ignore keyboard brightness; not actually relevant
-			if (c == MSI_EC_PRESET_COLUMN_KBD_BL)
-				continue;
-			else if (c == MSI_EC_PRESET_COLUMN_SILENT_FLAG) {
-				if(value == is_bit_set(MSI_EC_FAN_MODE_SILENT_BIT, rdata))
-					continue;
+static const struct ec_path ec_paths[EC_PATHS] = {
+	[EC_PATH_READ] = { "ec_read", ec_backend_read, ec_backend_read_block },
+	[EC_PATH_BURST] = { "burst", NULL, ec_burst_read_block },
+};
 
-				match = FALSE;
-				break;
-			}
-			else if (value != rdata) {
-				match = FALSE;
-				break;
-			}
-		}
+static int ec_path_read_bytes(struct msi_ec_dev *ec,
+			      const struct ec_path *path, u8 addr, u8 *buf,
+			      u8 len)
+{
+	int result = 0;
+	u8 i;
 
-		if (match) {
-			switch (v) {
-			case MSI_EC_PRESET_SUPER_BATTERY:
-				return sprintf(buf, "%s\n", "super_battery");
-			case MSI_EC_PRESET_SILENT:
-				return sprintf(buf, "%s\n", "silent");
-			case MSI_EC_PRESET_BALANCED:
-				return sprintf(buf, "%s\n", "balanced");
-			case MSI_EC_PRESET_HIGH_PERFORMANCE:
-				return sprintf(buf, "%s\n", "high_performance");
-			}
-		}
+	for (i = 0; i < len && result >= 0; i++)
+		result = path->read(ec, addr + i, buf + i);
+	return result;
+}
+
+/* Returns the nanoseconds per byte, or a negative errno */
+static s64 ec_path_measure(struct msi_ec_dev *ec, const struct ec_path *path,
+			   const u8 *expected, u8 len, bool block)
+{
+	u8 buf[MSI_EC_FW_VERSION_LENGTH];
+	ktime_t start = ktime_get();
+	int result;
+	int round;
+
+	for (round = 0; round < EC_BENCH_ROUNDS; round++) {
+		if (block)
+			result = path->read_block(ec, MSI_EC_FW_VERSION_ADDRESS,
+						  buf, len);
+		else
+			result = ec_path_read_bytes(ec, path,
+						    MSI_EC_FW_VERSION_ADDRESS,
+						    buf, len);
+		if (result < 0)
+			return result;
+		if (memcmp(buf, expected, len) != 0)
+			return -EILSEQ;
 	}
 
-	return sprintf(buf, "%s\n", "custom");
+	return div_u64(ktime_to_ns(ktime_sub(ktime_get(), start)),
+		       EC_BENCH_ROUNDS * len);
 }
 
-static ssize_t preset_store(struct device *dev, struct device_attribute *attr,
-			      const char *buf, size_t count)
+/*
+ * Times the firmware version block, which never changes, through every
+ * path and selects the fastest correct one for single and for block
+ * reads. The reads are accounted like any other.
+ */
+static void ec_paths_benchmark(struct msi_ec_dev *ec)
 {
-	int result = -EINVAL;
-	int index;
-	int c;
-
-	if (streq(buf, "super_battery"))
-		index = MSI_EC_PRESET_SUPER_BATTERY;
-	else if (streq(buf, "silent"))
-		index = MSI_EC_PRESET_SILENT;
-	else if (streq(buf, "balanced"))
-		index = MSI_EC_PRESET_BALANCED;
-	else if (streq(buf, "high_performance"))
-		index = MSI_EC_PRESET_HIGH_PERFORMANCE;
-	else
-		return result;
+	const u8 len = MSI_EC_FW_VERSION_LENGTH;
+	u8 expected[MSI_EC_FW_VERSION_LENGTH];
+	struct ec_path_bench *bench;
+	const struct ec_path *path;
+	int single = -1;
+	int block = -1;
+	unsigned int reads = len;
+	ktime_t start;
+	s64 ns;
+	int result;
+	int i;
 
-	for (c = 0; c < ARRAY_SIZE(MSI_EC_PRESET_MEMORY_TABLE); c++) {
-		u8 addr = MSI_EC_PRESET_MEMORY_TABLE[c];
-		u8 value = MSI_EC_PRESET_VALUE_TABLE[index][c];
+	if (ec_access_begin(ec) < 0)
+		return;
 
-		if(c == MSI_EC_PRESET_COLUMN_SILENT_FLAG) {
-			result = ec_write_bit(addr,
-					      MSI_EC_FAN_MODE_SILENT_BIT,
-					      value);
+	mutex_lock(&ec->paths_lock);
+	start = ktime_get();
+	result = ec_backend_read_block(ec, MSI_EC_FW_VERSION_ADDRESS, expected,
+				       len);
+	if (result < 0)
+		goto out;
+
+	for (i = 0; i < EC_PATHS; i++) {
+		path = &ec_paths[i];
+		bench = &ec->paths[i];
+		bench->tested = TRUE;
+
+		ns = 0;
+		if (path->read) {
+			ns = ec_path_measure(ec, path, expected, len, FALSE);
+			bench->single_ns = max_t(s64, ns, 0);
+			reads += EC_BENCH_ROUNDS * len;
 		}
-		else {
-			result = ec_write(addr, value);
+		if (ns >= 0) {
+			ns = ec_path_measure(ec, path, expected, len, TRUE);
+			bench->block_ns = max_t(s64, ns, 0);
+			reads += EC_BENCH_ROUNDS * len;
 		}
-
-		if(result < 0)
-			pr_err("msi-ec: preset_store: failed to write to address %#02x "
-				       "while setting preset %i (error code %i)",
-				       addr, index, result);
+		bench->result = min_t(s64, ns, 0);
+		if (bench->result < 0)
+			continue;
+
+		if (path->read && (single < 0 || bench->single_ns <
+						 ec->paths[single].single_ns))
+			single = i;
+		if (block < 0 || bench->block_ns < ec->paths[block].block_ns)
+			block = i;
 	}
 
-	/* ---- Validate fan modes ---- */
-	if(index != MSI_EC_PRESET_HIGH_PERFORMANCE) {
-		// Disable basic/adv fan mode flags when not using high performance preset
-		 ec_write_bit(MSI_EC_FAN_MODE_ADDRESS,
-			      MSI_EC_FAN_MODE_ADVANCED_BIT,
-			      FALSE);
+	WRITE_ONCE(ec->path_single,
+		   &ec_paths[single < 0 ? EC_PATH_READ : single]);
+	WRITE_ONCE(ec->path_block, &ec_paths[block < 0 ? EC_PATH_READ : block]);
+	pr_info("msi-ec: %s: access paths: %s for single reads, %s for block reads\n",
+		dev_name(&ec->pdev->dev), READ_ONCE(ec->path_single)->name,
+		READ_ONCE(ec->path_block)->name);
+
+out:
+	ec_account(ec, &ec->stats.reads, reads, start, result);
+	mutex_unlock(&ec->paths_lock);
+	ec_access_end(ec);
+}
 
-		 ec_write_bit(MSI_EC_FAN_MODE_ADDRESS,
-			      MSI_EC_FAN_MODE_BASIC_BIT,
-			      FALSE);
+static int ec_paths_show(struct seq_file *m, void *v)
+{
+	struct msi_ec_dev *ec = m->private;
+	const struct ec_path_bench *bench;
+	int i;
+
+	mutex_lock(&ec->paths_lock);
+	seq_puts(m, "path     single_ns block_ns status\n");
+	for (i = 0; i < EC_PATHS; i++) {
+		bench = &ec->paths[i];
+		seq_printf(m, "%-8s ", ec_paths[i].name);
+		if (!bench->tested) {
+			seq_puts(m, "        -        - untested\n");
+			continue;
+		}
+		if (ec_paths[i].read)
+			seq_printf(m, "%9llu ", bench->single_ns);
+		else
+			seq_puts(m, "        - ");
+		seq_printf(m, "%8llu ", bench->block_ns);
+		if (bench->result == -EILSEQ)
+			seq_puts(m, "mismatch\n");
+		else if (bench->result < 0)
+			seq_printf(m, "error %d\n", bench->result);
+		else
+			seq_puts(m, "ok\n");
 	}
+	seq_printf(m, "single %s\nblock %s\n", READ_ONCE(ec->path_single)->name,
+		   READ_ONCE(ec->path_block)->name);
+	mutex_unlock(&ec->paths_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ec_paths);
 
-	return count;
+static int msi_ec_read(struct msi_ec_dev *ec, u8 addr, u8 *data)
+{
+	ktime_t start;
+	int result;
+
+	result = ec_access_begin(ec);
+	if (result < 0)
+		return result;
+
+	start = ktime_get();
+	result = READ_ONCE(ec->path_single)->read(ec, addr, data);
+	ec_account(ec, &ec->stats.reads, 1, start, result);
+	ec_access_end(ec);
+
+	if (result >= 0)
+		cache_store(ec, addr, *data);
+	return result;
 }
 
-static ssize_t fw_version_show(struct device *device,
-			       struct device_attribute *attr, char *buf)
+static int msi_ec_write(struct msi_ec_dev *ec, u8 addr, u8 data)
 {
-	u8 rdata[MSI_EC_FW_VERSION_LENGTH + 1];
+	ktime_t start;
 	int result;
 
-	memset(rdata, 0, MSI_EC_FW_VERSION_LENGTH + 1);
-	result = ec_read_seq(MSI_EC_FW_VERSION_ADDRESS, rdata,
-			     MSI_EC_FW_VERSION_LENGTH);
+	result = ec_access_begin(ec);
 	if (result < 0)
 		return result;
 
-	return sprintf(buf, "%s\n", rdata);
+	start = ktime_get();
+	result = ec->ops->write(ec, addr, data);
+	ec_account(ec, &ec->stats.writes, 1, start, result);
+	ec_access_end(ec);
+
+	if (result >= 0) {
+		cache_store(ec, addr, data);
+		watch_shadow_store(ec, addr, data);
+	}
+	return result;
 }
 
-static ssize_t fw_release_date_show(struct device *device,
-				    struct device_attribute *attr, char *buf)
+/* Like msi_ec_read(ec), but may return a value refreshed by the sampler */
+static int ec_read_cached(struct msi_ec_dev *ec, u8 addr, u8 *data)
 {
-	u8 rdate[MSI_EC_FW_DATE_LENGTH + 1];
-	u8 rtime[MSI_EC_FW_TIME_LENGTH + 1];
+	if (cache_lookup(ec, addr, data)) {
+		atomic64_inc(&ec->stats.cache_hits);
+		return 0;
+	}
+
+	return msi_ec_read(ec, addr, data);
+}
+
+static int ec_read_seq(struct msi_ec_dev *ec, u8 addr, u8 *buf, u8 len)
+{
+	ktime_t start;
 	int result;
-	int year, month, day, hour, minute, second;
+	u8 i;
 
-	memset(rdate, 0, MSI_EC_FW_DATE_LENGTH + 1);
-	result = ec_read_seq(MSI_EC_FW_DATE_ADDRESS, rdate,
-			     MSI_EC_FW_DATE_LENGTH);
+	result = ec_access_begin(ec);
 	if (result < 0)
 		return result;
-	sscanf(rdate, "%02d%02d%04d", &month, &day, &year);
 
-	memset(rtime, 0, MSI_EC_FW_TIME_LENGTH + 1);
-	result = ec_read_seq(MSI_EC_FW_TIME_ADDRESS, rtime,
-			     MSI_EC_FW_TIME_LENGTH);
+	start = ktime_get();
+	result = READ_ONCE(ec->path_block)->read_block(ec, addr, buf, len);
+	ec_account(ec, &ec->stats.reads, len, start, result);
+	ec_access_end(ec);
+
 	if (result < 0)
 		return result;
-	sscanf(rtime, "%02d:%02d:%02d", &hour, &minute, &second);
+	for (i = 0; i < len; i++)
+		cache_store(ec, addr + i, buf[i]);
+	return 0;
+}
 
-	return sprintf(buf, "%04d/%02d/%02d %02d:%02d:%02d\n", year, month, day,
-		       hour, minute, second);
+static void ec_locks_init(struct msi_ec_dev *ec)
+{
+	int i;
+
+	/* All register locks share one lockdep class */
+	for (i = 0; i < MSI_EC_RAM_SIZE; i++)
+		mutex_init(&ec->reg_locks[i]);
+	mutex_init(&ec->multi_lock);
 }
 
-static ssize_t ac_connected_show(struct device *device,
-			     	 struct device_attribute *attr, char *buf)
+static void ec_lock(struct msi_ec_dev *ec, u8 addr)
 {
-	u8 rdata;
+	if (mutex_trylock(&ec->reg_locks[addr]))
+		return;
+
+	atomic64_inc(&ec->stats.lock_waits);
+	mutex_lock(&ec->reg_locks[addr]);
+}
+
+static void ec_unlock(struct msi_ec_dev *ec, u8 addr)
+{
+	mutex_unlock(&ec->reg_locks[addr]);
+}
+
+/* Locks every register set in the bitmap regs (MSI_EC_RAM_SIZE bits) */
+static void ec_lock_regs(struct msi_ec_dev *ec, const unsigned long *regs)
+{
+	unsigned int addr;
+
+	mutex_lock(&ec->multi_lock);
+	for_each_set_bit(addr, regs, MSI_EC_RAM_SIZE)
+		mutex_lock_nest_lock(&ec->reg_locks[addr], &ec->multi_lock);
+}
+
+static void ec_unlock_regs(struct msi_ec_dev *ec, const unsigned long *regs)
+{
+	unsigned int addr;
+
+	for_each_set_bit(addr, regs, MSI_EC_RAM_SIZE)
+		mutex_unlock(&ec->reg_locks[addr]);
+	mutex_unlock(&ec->multi_lock);
+}
+
+/* Replaces the bits in mask; the register lock must be held */
+static int __ec_update_bits(struct msi_ec_dev *ec, u8 addr, u8 mask, u8 value)
+{
+	u8 data;
+	u8 updated;
 	int result;
 
-	result = ec_read(MSI_EC_POWER_ADDRESS, &rdata);
+	lockdep_assert_held(&ec->reg_locks[addr]);
+
+	result = msi_ec_read(ec, addr, &data);
 	if (result < 0)
 		return result;
 
-	return sprintf(buf, "%i\n", is_bit_set(MSI_EC_POWER_AC_CONNECTED_BIT, rdata));
+	updated = (data & ~mask) | (value & mask);
+	if (updated == data)
+		return 0;
+
+	return msi_ec_write(ec, addr, updated);
 }
 
-static ssize_t lid_open_show(struct device *device,
-			     struct device_attribute *attr, char *buf)
+static int ec_update_bits(struct msi_ec_dev *ec, u8 addr, u8 mask, u8 value)
 {
-	u8 rdata;
 	int result;
 
-	result = ec_read(MSI_EC_POWER_ADDRESS, &rdata);
-	if (result < 0)
-		return result;
+	ec_lock(ec, addr);
+	result = __ec_update_bits(ec, addr, mask, value);
+	ec_unlock(ec, addr);
 
-	return sprintf(buf, "%i\n", is_bit_set(MSI_EC_POWER_LID_OPEN_BIT, rdata));
+	return result;
 }
 
-static DEVICE_ATTR_RW(webcam);
-static DEVICE_ATTR_RW(fn_key);
-static DEVICE_ATTR_RW(win_key);
-static DEVICE_ATTR_RW(battery_charge_mode);
-static DEVICE_ATTR_RW(cooler_boost);
-static DEVICE_ATTR_RW(shift_mode);
-static DEVICE_ATTR_RW(fan_mode);
-static DEVICE_ATTR_RW(preset);
-static DEVICE_ATTR_RO(fw_version);
-static DEVICE_ATTR_RO(fw_release_date);
-static DEVICE_ATTR_RO(ac_connected);
-static DEVICE_ATTR_RO(lid_open);
+static int ec_write_bit(struct msi_ec_dev *ec, u8 addr, u8 index, bool set)
+{
+	return ec_update_bits(ec, addr, BIT(index), set ? BIT(index) : 0);
+}
 
-static struct attribute *msi_root_attrs[] = {
-	&dev_attr_webcam.attr,		&dev_attr_fn_key.attr,
-	&dev_attr_win_key.attr,		&dev_attr_battery_charge_mode.attr,
-	&dev_attr_cooler_boost.attr,	&dev_attr_shift_mode.attr,
-	&dev_attr_fan_mode.attr,		&dev_attr_fw_version.attr,
-	&dev_attr_ac_connected.attr,	&dev_attr_lid_open.attr,
-	&dev_attr_fw_release_date.attr,	&dev_attr_preset.attr,
-	NULL
-};
+/* Whole-register write, ordered against read-modify-write cycles */
+static int ec_write_byte(struct msi_ec_dev *ec, u8 addr, u8 data)
+{
+	int result;
 
-static const struct attribute_group msi_root_group = {
-	.attrs = msi_root_attrs,
-};
+	ec_lock(ec, addr);
+	result = msi_ec_write(ec, addr, data);
+	ec_unlock(ec, addr);
+
+	return result;
+}
+
+static bool is_bit_set(u8 index, u8 byte)
+{
+	return (byte >> index) & 1UL;
+}
 
 // ============================================================ //
-// Sysfs platform device attributes (cpu)
+// Register decoding
 // ============================================================ //
 
-static ssize_t cpu_realtime_temperature_show(struct device *device,
-					     struct device_attribute *attr,
-					     char *buf)
+static const char *shift_mode_name(u8 value)
 {
-	u8 rdata;
-	int result;
+	switch (value) {
+	case MSI_EC_SHIFT_MODE_OVERCLOCK:
+		return "overclock";
+	case MSI_EC_SHIFT_MODE_BALANCED:
+		return "balanced";
+	case MSI_EC_SHIFT_MODE_ECO:
+		return "eco";
+	case MSI_EC_SHIFT_MODE_OFF:
+		return "off";
+	default:
+		return NULL;
+	}
+}
 
-	result = ec_read(MSI_EC_CPU_REALTIME_TEMPERATURE_ADDRESS, &rdata);
-	if (result < 0)
-		return result;
+static const char *fan_mode_name(u8 value)
+{
+	if (is_bit_set(MSI_EC_FAN_MODE_SILENT_BIT, value))
+		return "silent";
+	else if (is_bit_set(MSI_EC_FAN_MODE_ADVANCED_BIT, value))
+		return "advanced";
+	else if (is_bit_set(MSI_EC_FAN_MODE_BASIC_BIT, value))
+		return "basic";
+	else
+		return "auto";
+}
 
-	return sprintf(buf, "%i\n", rdata);
+/*
+ * Match the values of the preset registers of cfg (one per column) against
+ * the known presets. Returns the preset index or -1 for a custom
+ * configuration.
+ */
+static int preset_match(const struct msi_ec_config *cfg, const u8 *values)
+{
+	int c;
+	int v;
+
+	for (v = 0; v < ARRAY_SIZE(cfg->preset_values); v++) {
+		for (c = 0; c < ARRAY_SIZE(cfg->preset_regs); c++) {
+			u8 value = cfg->preset_values[v][c];
+
+			// Ignore keyboard brightness; not actually relevant
+			if (c == MSI_EC_PRESET_COLUMN_KBD_BL)
+				continue;
+			else if (c == MSI_EC_PRESET_COLUMN_SILENT_FLAG) {
+				if (value != is_bit_set(MSI_EC_FAN_MODE_SILENT_BIT,
+							values[c]))
+					break;
+			}
+			else if (value != values[c])
+				break;
+		}
+
+		if (c == ARRAY_SIZE(cfg->preset_regs))
+			return v;
+	}
+
+	return -1;
 }
 
-static ssize_t cpu_realtime_fan_speed_show(struct device *device,
-					   struct device_attribute *attr,
-					   char *buf)
+static const char *preset_name(int index)
 {
+	switch (index) {
+	case MSI_EC_PRESET_SUPER_BATTERY:
+		return "super_battery";
+	case MSI_EC_PRESET_SILENT:
+		return "silent";
+	case MSI_EC_PRESET_BALANCED:
+		return "balanced";
+	case MSI_EC_PRESET_HIGH_PERFORMANCE:
+		return "high_performance";
+	default:
+		return "custom";
+	}
+}
+
+/* Returns the fan speed in percent, or -EINVAL if outside the known range */
+static int cpu_fan_speed_percent(struct msi_ec_dev *ec, u8 value)
+{
+	const struct msi_ec_config *cfg;
+	int result = -EINVAL;
+
+	rcu_read_lock();
+	cfg = rcu_dereference(ec->cfg);
+	if (value >= cfg->fan_speed_min && value <= cfg->fan_speed_max)
+		result = 100 * (value - cfg->fan_speed_min) /
+			 (cfg->fan_speed_max - cfg->fan_speed_min);
+	rcu_read_unlock();
+
+	return result;
+}
+
+/*
+ * Steady-state RPM of the fans at every fan curve level, measured by the fan
+ * calibration (or written back from a saved table). Once valid, fan speeds
+ * are reported from the RPM through this table instead of the raw speed
+ * registers.
+ */
+#define FAN_CAL_LEVELS 16
+#define FAN_CAL_STEP 10 /* percent per level, 0 - 150 */
+
+enum {
+	FAN_CPU,
+	FAN_GPU,
+	FAN_COUNT,
+};
+
+static const u8 fan_rpm_addrs[FAN_COUNT] = {
+	[FAN_CPU] = MSI_EC_CPU_REALTIME_FAN_RPM_ADDRESS,
+	[FAN_GPU] = MSI_EC_GPU_REALTIME_FAN_RPM_ADDRESS,
+};
+
+struct ec_fans {
+	spinlock_t lock;
+	bool valid;
+	u16 rpm[FAN_COUNT][FAN_CAL_LEVELS]; /* non-decreasing */
+	/* Set while a calibration drives the fans; the guard stands aside */
+	bool cal_running;
+};
+
+static int fan_rpm_read(struct msi_ec_dev *ec, int fan, u16 *rpm)
+{
+	u8 rdata[2];
+	int result;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(rdata); i++) {
+		result = ec_read_cached(ec, fan_rpm_addrs[fan] + i, &rdata[i]);
+		if (result < 0)
+			return result;
+	}
+
+	*rpm = rdata[0] | (rdata[1] << 8);
+	return 0;
+}
+
+/* Interpolates the level of rpm; -ENODATA without a calibration */
+static int fan_table_percent(struct msi_ec_dev *ec, int fan, u16 rpm)
+{
+	const u16 *levels = ec->fans->rpm[fan];
+	int result = (FAN_CAL_LEVELS - 1) * FAN_CAL_STEP;
+	int i;
+
+	spin_lock(&ec->fans->lock);
+	if (!ec->fans->valid) {
+		result = -ENODATA;
+	} else if (rpm <= levels[0]) {
+		result = 0;
+	} else {
+		for (i = 1; i < FAN_CAL_LEVELS; i++) {
+			if (rpm > levels[i])
+				continue;
+			result = (i - 1) * FAN_CAL_STEP +
+				 FAN_CAL_STEP * (rpm - levels[i - 1]) /
+				 (levels[i] - levels[i - 1]);
+			break;
+		}
+	}
+	spin_unlock(&ec->fans->lock);
+
+	return result;
+}
+
+/* CPU fan speed in percent from its raw speed register and RPM */
+static int cpu_fan_speed(struct msi_ec_dev *ec, u8 raw, u16 rpm)
+{
+	int result = fan_table_percent(ec, FAN_CPU, rpm);
+
+	return result == -ENODATA ? cpu_fan_speed_percent(ec, raw) : result;
+}
+
+/* GPU fan speed in percent; the raw register without a calibration */
+static int gpu_fan_speed(struct msi_ec_dev *ec, u8 raw, u16 rpm)
+{
+	int result = fan_table_percent(ec, FAN_GPU, rpm);
+
+	return result == -ENODATA ? raw : result;
+}
+
+// ============================================================ //
+// Journal
+// ============================================================ //
+
+/*
+ * The journal records state transitions with their time and source: the
+ * changes the driver makes (and their failures) and the changes the sampler
+ * observes in the EC, like AC, lid and firmware hotkeys. Only transitions are
+ * recorded; writing a value that is already set adds nothing.
+ *
+ * Writers reserve a sequence number and publish their slot by storing it
+ * last, so adding an entry never blocks. Readers validate a slot against the
+ * sequence number they expect and skip entries that were overwritten. The
+ * journal is read through debugfs (<device>/journal), where every open file
+ * has its own cursor and reads block until new entries arrive.
+ */
+
+#define JOURNAL_SIZE 1024
+
+enum journal_type {
+	JOURNAL_PRESET,
+	JOURNAL_SHIFT_MODE,
+	JOURNAL_FAN_MODE,
+	JOURNAL_COOLER_BOOST,
+	JOURNAL_WEBCAM,
+	JOURNAL_BATTERY_MODE,
+	JOURNAL_BATTERY_SAVING,
+	JOURNAL_MUTE_LED,
+	JOURNAL_MICMUTE_LED,
+	JOURNAL_KBD_BACKLIGHT,
+	JOURNAL_AC,
+	JOURNAL_LID,
+	JOURNAL_TYPES,
+	JOURNAL_ERROR = JOURNAL_TYPES, /* failed write, not a state */
+};
+
+static const char *const journal_type_names[] = {
+	[JOURNAL_PRESET] = "preset",
+	[JOURNAL_SHIFT_MODE] = "shift_mode",
+	[JOURNAL_FAN_MODE] = "fan_mode",
+	[JOURNAL_COOLER_BOOST] = "cooler_boost",
+	[JOURNAL_WEBCAM] = "webcam",
+	[JOURNAL_BATTERY_MODE] = "battery_mode",
+	[JOURNAL_BATTERY_SAVING] = "battery_saving",
+	[JOURNAL_MUTE_LED] = "mute_led",
+	[JOURNAL_MICMUTE_LED] = "micmute_led",
+	[JOURNAL_KBD_BACKLIGHT] = "kbd_backlight",
+	[JOURNAL_AC] = "ac",
+	[JOURNAL_LID] = "lid",
+	[JOURNAL_ERROR] = "write_error",
+};
+
+enum journal_source {
+	JOURNAL_SYSFS,
+	JOURNAL_LEASE,
+	JOURNAL_FEEDFORWARD,
+	JOURNAL_POLICY,
+	JOURNAL_BATCH,
+	JOURNAL_LED,
+	JOURNAL_CALIBRATION,
+	JOURNAL_GUARD,
+	JOURNAL_EC, /* observed, not made by the driver */
+};
+
+static const char *const journal_source_names[] = {
+	[JOURNAL_SYSFS] = "sysfs",
+	[JOURNAL_LEASE] = "lease",
+	[JOURNAL_FEEDFORWARD] = "feedforward",
+	[JOURNAL_POLICY] = "policy",
+	[JOURNAL_BATCH] = "batch",
+	[JOURNAL_LED] = "led",
+	[JOURNAL_CALIBRATION] = "calibration",
+	[JOURNAL_GUARD] = "guard",
+	[JOURNAL_EC] = "ec",
+};
+
+/* The task behind a change; pid 0 for kernel threads */
+struct journal_who {
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+};
+
+struct journal_entry {
+	unsigned long seq; /* 0 while the entry is written */
+	u64 time_ns;
+	struct journal_who who;
+	u8 type;
+	u8 source;
+	u8 addr; /* JOURNAL_ERROR only */
+	int old; /* -1 if unknown */
+	int new;
+	int error;
+};
+
+struct ec_journal {
+	struct journal_entry entries[JOURNAL_SIZE];
+	atomic_long_t seq;
+	wait_queue_head_t wait;
+	/* Set at the unbind: no more entries will come, readers get EOF */
+	bool dead;
+	/* Last recorded value of every state, -1 if unknown */
+	atomic_t state[JOURNAL_TYPES];
+	/* When the driver last set every state */
+	atomic64_t state_ns[JOURNAL_TYPES];
+};
+
+static void journal_setup(struct ec_journal *journal)
+{
+	int i;
+
+	init_waitqueue_head(&journal->wait);
+	for (i = 0; i < JOURNAL_TYPES; i++)
+		atomic_set(&journal->state[i], -1);
+}
+
+static void journal_who_current(struct journal_who *who)
+{
+	memset(who, 0, sizeof(*who));
+	if (current->flags & PF_KTHREAD)
+		return;
+	who->pid = task_tgid_nr(current);
+	get_task_comm(who->comm, current);
+}
+
+static void journal_add(struct msi_ec_dev *ec, u8 type, u8 source, u8 addr,
+			int old, int new, int error,
+			const struct journal_who *who)
+{
+	unsigned long seq = atomic_long_inc_return(&ec->journal->seq);
+	struct journal_entry *entry =
+		&ec->journal->entries[(seq - 1) % JOURNAL_SIZE];
+	struct journal_who self;
+
+	if (!who) {
+		journal_who_current(&self);
+		who = &self;
+	}
+
+	WRITE_ONCE(entry->seq, 0);
+	smp_wmb();
+	entry->time_ns = ktime_get_ns();
+	entry->who = *who;
+	entry->type = type;
+	entry->source = source;
+	entry->addr = addr;
+	entry->old = old;
+	entry->new = new;
+	entry->error = error;
+	smp_store_release(&entry->seq, seq);
+
+	if (wq_has_sleeper(&ec->journal->wait))
+		wake_up_interruptible(&ec->journal->wait);
+}
+
+/* Records a new state value if it differs from the last recorded one */
+static void journal_note(struct msi_ec_dev *ec, u8 type, u8 source, int value,
+			 const struct journal_who *who)
+{
+	int old;
+
+	if (source != JOURNAL_EC)
+		atomic64_set(&ec->journal->state_ns[type], ktime_get_ns());
+
+	old = atomic_xchg(&ec->journal->state[type], value);
+	if (old != value)
+		journal_add(ec, type, source, 0, old, value, 0, who);
+}
+
+/*
+ * Records a state read from the EC at time since. Values read before the
+ * driver last set the state may predate that change and are ignored.
+ */
+static void journal_observe(struct msi_ec_dev *ec, u8 type, int value,
+			    u64 since)
+{
+	if (atomic64_read(&ec->journal->state_ns[type]) >= since)
+		return;
+
+	journal_note(ec, type, JOURNAL_EC, value, NULL);
+}
+
+/* Maps a register to the state it holds, if it holds one */
+static int journal_reg_state(u8 addr, u8 data, int *value)
+{
+	switch (addr) {
+	case MSI_EC_SHIFT_MODE_ADDRESS:
+		*value = data;
+		return JOURNAL_SHIFT_MODE;
+	case MSI_EC_FAN_MODE_ADDRESS:
+		*value = data & (BIT(MSI_EC_FAN_MODE_SILENT_BIT) |
+				 BIT(MSI_EC_FAN_MODE_BASIC_BIT) |
+				 BIT(MSI_EC_FAN_MODE_ADVANCED_BIT));
+		return JOURNAL_FAN_MODE;
+	case MSI_EC_COOLER_BOOST_ADDRESS:
+		*value = is_bit_set(MSI_EC_COOLER_BOOST_BIT, data);
+		return JOURNAL_COOLER_BOOST;
+	case MSI_EC_WEBCAM_ADDRESS:
+		*value = is_bit_set(MSI_EC_WEBCAM_BIT, data);
+		return JOURNAL_WEBCAM;
+	case MSI_EC_BATTERY_MODE_ADDRESS:
+		*value = data;
+		return JOURNAL_BATTERY_MODE;
+	case MSI_EC_BATTERY_SAVING_ADDRESS:
+		*value = data & MSI_EC_BATTERY_SAVING_FLAGS_MASK;
+		return JOURNAL_BATTERY_SAVING;
+	case MSI_EC_KBD_LED_MUTE_ADDRESS:
+		*value = is_bit_set(MSI_EC_KBD_LED_MUTE_BIT, data);
+		return JOURNAL_MUTE_LED;
+	case MSI_EC_KBD_LED_MICMUTE_ADDRESS:
+		*value = is_bit_set(MSI_EC_KBD_LED_MICMUTE_BIT, data);
+		return JOURNAL_MICMUTE_LED;
+	case MSI_EC_KBD_BL_ADDRESS:
+		*value = data & MSI_EC_KBD_BL_STATE_MASK;
+		return JOURNAL_KBD_BACKLIGHT;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Records the outcome of a write to addr: the failure, or the state the
+ * register holds now (the write left it in the register cache).
+ */
+static void journal_write_as(struct msi_ec_dev *ec, u8 source, u8 addr,
+			     int result, const struct journal_who *who)
+{
+	int type, value;
+	u8 data;
+
+	if (result < 0) {
+		journal_add(ec, JOURNAL_ERROR, source, addr, -1, -1, result,
+			    who);
+		return;
+	}
+
+	spin_lock(&ec->cache.lock);
+	data = ec->cache.regs[addr];
+	spin_unlock(&ec->cache.lock);
+
+	type = journal_reg_state(addr, data, &value);
+	if (type >= 0)
+		journal_note(ec, type, source, value, who);
+}
+
+static void journal_write(struct msi_ec_dev *ec, u8 source, u8 addr, int result)
+{
+	journal_write_as(ec, source, addr, result, NULL);
+}
+
+/* Common tail of the sysfs stores writing a single register */
+static ssize_t journal_store_result(struct msi_ec_dev *ec, u8 addr, int result,
+				    size_t count)
+{
+	/* -EINVAL: the value was not recognized and nothing was written */
+	if (result != -EINVAL)
+		journal_write(ec, JOURNAL_SYSFS, addr, result);
+
+	if (result < 0)
+		return result;
+	return count;
+}
+
+static int journal_format_value(char *buf, size_t size, u8 type, int value)
+{
+	const char *name = NULL;
+
+	if (value < 0)
+		return scnprintf(buf, size, "?");
+
+	switch (type) {
+	case JOURNAL_PRESET:
+		name = preset_name(value);
+		break;
+	case JOURNAL_SHIFT_MODE:
+		name = shift_mode_name(value);
+		break;
+	case JOURNAL_FAN_MODE:
+		name = fan_mode_name(value);
+		break;
+	case JOURNAL_BATTERY_MODE:
+	case JOURNAL_BATTERY_SAVING:
+	case JOURNAL_KBD_BACKLIGHT:
+		break;
+	default:
+		name = value ? "on" : "off";
+		break;
+	}
+
+	if (name)
+		return scnprintf(buf, size, "%s", name);
+	return scnprintf(buf, size, "%#x", value);
+}
+
+/*
+ * One line per entry:
+ * "seq seconds type old->new source pid comm" or, for failed writes,
+ * "seq seconds write_error address error source pid comm".
+ */
+static int journal_format(char *buf, size_t size,
+			  const struct journal_entry *entry)
+{
+	char old[20], new[20];
+	u32 rem;
+	u64 sec = div_u64_rem(entry->time_ns, NSEC_PER_SEC, &rem);
+
+	if (entry->type == JOURNAL_ERROR) {
+		scnprintf(old, sizeof(old), "%#04x", entry->addr);
+		scnprintf(new, sizeof(new), "%i", entry->error);
+	} else {
+		journal_format_value(old, sizeof(old), entry->type, entry->old);
+		journal_format_value(new, sizeof(new), entry->type, entry->new);
+	}
+
+	return scnprintf(buf, size, "%lu %llu.%06u %s %s%s%s %s %i %s\n",
+			 entry->seq, sec, (u32)(rem / NSEC_PER_USEC),
+			 journal_type_names[entry->type], old,
+			 entry->type == JOURNAL_ERROR ? " " : "->", new,
+			 journal_source_names[entry->source], entry->who.pid,
+			 entry->who.pid ? entry->who.comm : "-");
+}
+
+/*
+ * Copies the entry with sequence number seq. Returns 0, -EAGAIN if it is not
+ * published yet, or -ESTALE if it was overwritten.
+ */
+static int journal_copy(struct msi_ec_dev *ec, unsigned long seq,
+			struct journal_entry *entry)
+{
+	const struct journal_entry *slot =
+		&ec->journal->entries[(seq - 1) % JOURNAL_SIZE];
+	unsigned long found = smp_load_acquire(&slot->seq);
+
+	if (found != seq)
+		return found && found > seq ? -ESTALE : -EAGAIN;
+
+	*entry = *slot;
+	smp_rmb();
+	if (READ_ONCE(slot->seq) != seq)
+		return -ESTALE;
+
+	return 0;
+}
+
+/* The file position is the sequence number of the next entry to read */
+static ssize_t journal_read(struct file *file, char __user *ubuf, size_t count,
+			    loff_t *ppos)
+{
+	struct msi_ec_dev *ec = file->private_data;
+	struct journal_entry entry;
+	unsigned long head, seq;
+	char line[128];
+	ssize_t copied = 0;
+	int len;
+	int result;
+
+	for (;;) {
+		head = atomic_long_read(&ec->journal->seq);
+		seq = max_t(unsigned long, *ppos, 1);
+		/* Skip entries that were overwritten before they were read */
+		if (head >= JOURNAL_SIZE && seq <= head - JOURNAL_SIZE)
+			seq = head - JOURNAL_SIZE + 1;
+
+		if (seq > head) {
+			if (copied || READ_ONCE(ec->journal->dead))
+				break;
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			result = wait_event_interruptible(ec->journal->wait,
+				atomic_long_read(&ec->journal->seq) >= seq ||
+				READ_ONCE(ec->journal->dead));
+			if (result < 0)
+				return result;
+			continue;
+		}
+
+		result = journal_copy(ec, seq, &entry);
+		if (result == -EAGAIN) {
+			if (copied)
+				break;
+			cond_resched();
+			continue;
+		}
+		if (result == -ESTALE) {
+			*ppos = seq + 1;
+			continue;
+		}
+
+		len = journal_format(line, sizeof(line), &entry);
+		if (len > count - copied) {
+			if (!copied)
+				return -EINVAL;
+			break;
+		}
+		if (copy_to_user(ubuf + copied, line, len))
+			return copied ? copied : -EFAULT;
+		copied += len;
+		*ppos = seq + 1;
+	}
+
+	return copied;
+}
+
+static __poll_t journal_poll(struct file *file, poll_table *wait)
+{
+	struct msi_ec_dev *ec = file->private_data;
+	unsigned long seq = max_t(unsigned long, file->f_pos, 1);
+
+	poll_wait(file, &ec->journal->wait, wait);
+	if (atomic_long_read(&ec->journal->seq) >= seq)
+		return EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(ec->journal->dead))
+		return EPOLLHUP;
+	return 0;
+}
+
+static int journal_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return nonseekable_open(inode, file);
+}
+
+static const struct file_operations journal_fops = {
+	.owner = THIS_MODULE,
+	.open = journal_open,
+	.read = journal_read,
+	.poll = journal_poll,
+};
+
+static void journal_init(struct msi_ec_dev *ec)
+{
+	ec->debugfs = debugfs_create_dir(dev_name(&ec->pdev->dev), NULL);
+	debugfs_create_file("journal", 0400, ec->debugfs, ec, &journal_fops);
+	debugfs_create_file("access_paths", 0400, ec->debugfs, ec,
+			    &ec_paths_fops);
+}
+
+/*
+ * The removal waits for readers inside journal_read(), so blocked ones are
+ * woken up first to return what is left and then EOF.
+ */
+static void journal_exit(struct msi_ec_dev *ec)
+{
+	WRITE_ONCE(ec->journal->dead, TRUE);
+	wake_up_interruptible(&ec->journal->wait);
+	debugfs_remove_recursive(ec->debugfs);
+}
+
+// ============================================================ //
+// Sysfs platform device attributes (root)
+// ============================================================ //
+
+static ssize_t webcam_show(struct device *device, struct device_attribute *attr,
+			   char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_WEBCAM_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	if(is_bit_set(MSI_EC_WEBCAM_BIT, rdata))
+		return sprintf(buf, "%s\n", "on");
+	else
+		return sprintf(buf, "%s\n", "off");
+}
+
+static ssize_t webcam_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int result = -EINVAL;
+
+	if (streq(buf, "on"))
+		result = ec_write_bit(ec, MSI_EC_WEBCAM_ADDRESS,
+				      MSI_EC_WEBCAM_BIT,
+				      TRUE);
+
+	if (streq(buf, "off"))
+		result = ec_write_bit(ec, MSI_EC_WEBCAM_ADDRESS,
+				      MSI_EC_WEBCAM_BIT,
+				      FALSE);
+
+	return journal_store_result(ec, MSI_EC_WEBCAM_ADDRESS, result, count);
+}
+
+static ssize_t fn_key_show(struct device *device, struct device_attribute *attr,
+			   char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_FN_WIN_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	if(is_bit_set(MSI_EC_FN_WIN_BIT, rdata) == MSI_EC_FN_KEY_LEFT) {
+		return sprintf(buf, "%s\n", "left");
+	}
+	else {
+		return sprintf(buf, "%s\n", "right");
+	}
+}
+
+static ssize_t fn_key_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int result = -EINVAL;
+
+	if (streq(buf, "left"))
+		result = ec_write_bit(ec, MSI_EC_FN_WIN_ADDRESS,
+				      MSI_EC_FN_WIN_BIT,
+				      MSI_EC_FN_KEY_LEFT);
+
+	if (streq(buf, "right"))
+		result = ec_write_bit(ec, MSI_EC_FN_WIN_ADDRESS,
+				      MSI_EC_FN_WIN_BIT,
+				      MSI_EC_FN_KEY_RIGHT);
+
+	return journal_store_result(ec, MSI_EC_FN_WIN_ADDRESS, result, count);
+}
+
+static ssize_t win_key_show(struct device *device,
+			    struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
 	u8 rdata;
 	int result;
 
-	result = ec_read(MSI_EC_CPU_REALTIME_FAN_SPEED_ADDRESS, &rdata);
-	if (result < 0)
-		return result;
+	result = ec_read_cached(ec, MSI_EC_FN_WIN_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	if(is_bit_set(MSI_EC_FN_WIN_BIT, rdata) == MSI_EC_WIN_KEY_LEFT) {
+		return sprintf(buf, "%s\n", "left");
+	}
+	else {
+		return sprintf(buf, "%s\n", "right");
+	}
+}
+
+static ssize_t win_key_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int result = -EINVAL;
+
+	if (streq(buf, "left"))
+		result = ec_write_bit(ec, MSI_EC_FN_WIN_ADDRESS,
+				      MSI_EC_FN_WIN_BIT,
+				      MSI_EC_WIN_KEY_LEFT);
+
+	if (streq(buf, "right"))
+		result = ec_write_bit(ec, MSI_EC_FN_WIN_ADDRESS,
+				      MSI_EC_FN_WIN_BIT,
+				      MSI_EC_WIN_KEY_RIGHT);
+
+	return journal_store_result(ec, MSI_EC_FN_WIN_ADDRESS, result, count);
+}
+
+static ssize_t battery_charge_mode_show(struct device *device,
+				 	struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_BATTERY_MODE_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	switch (rdata) {
+	case MSI_EC_BATTERY_MODE_MAX_CHARGE:
+		return sprintf(buf, "%s\n", "max");
+	case MSI_EC_BATTERY_MODE_MEDIUM_CHARGE:
+		return sprintf(buf, "%s\n", "medium");
+	case MSI_EC_BATTERY_MODE_MIN_CHARGE:
+		return sprintf(buf, "%s\n", "min");
+	default:
+		/* Any other threshold, see battery_charge_threshold */
+		return sprintf(buf, "%s\n", "custom");
+	}
+}
+
+static ssize_t battery_charge_mode_store(struct device *dev,
+				  	 struct device_attribute *attr,
+				  	 const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int result = -EINVAL;
+
+	if (streq(buf, "max"))
+		result = ec_write_byte(ec, MSI_EC_BATTERY_MODE_ADDRESS,
+				       MSI_EC_BATTERY_MODE_MAX_CHARGE);
+
+	if (streq(buf, "medium"))
+		result = ec_write_byte(ec, MSI_EC_BATTERY_MODE_ADDRESS,
+				       MSI_EC_BATTERY_MODE_MEDIUM_CHARGE);
+
+	if (streq(buf, "min"))
+		result = ec_write_byte(ec, MSI_EC_BATTERY_MODE_ADDRESS,
+				       MSI_EC_BATTERY_MODE_MIN_CHARGE);
+
+	return journal_store_result(ec, MSI_EC_BATTERY_MODE_ADDRESS, result,
+				    count);
+}
+
+static ssize_t battery_charge_threshold_show(struct device *device,
+					     struct device_attribute *attr,
+					     char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_BATTERY_MODE_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	if (!is_bit_set(MSI_EC_BATTERY_MODE_ENABLE_BIT, rdata))
+		return sprintf(buf, "%s\n", "off");
+	return sprintf(buf, "%i\n", rdata & MSI_EC_BATTERY_MODE_THRESHOLD_MASK);
+}
+
+static ssize_t battery_charge_threshold_store(struct device *dev,
+					      struct device_attribute *attr,
+					      const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	unsigned int value;
+	int result;
+
+	/* Clears the enable bit only, the threshold is kept for re-enabling */
+	if (streq(buf, "off")) {
+		result = ec_write_bit(ec, MSI_EC_BATTERY_MODE_ADDRESS,
+				      MSI_EC_BATTERY_MODE_ENABLE_BIT, FALSE);
+		return journal_store_result(ec, MSI_EC_BATTERY_MODE_ADDRESS,
+					    result, count);
+	}
+
+	result = kstrtouint(buf, 10, &value);
+	if (result < 0)
+		return result;
+	if (value < MSI_EC_BATTERY_THRESHOLD_MIN ||
+	    value > MSI_EC_BATTERY_THRESHOLD_MAX)
+		return -EINVAL;
+
+	result = ec_write_byte(ec, MSI_EC_BATTERY_MODE_ADDRESS,
+			       BIT(MSI_EC_BATTERY_MODE_ENABLE_BIT) | value);
+	return journal_store_result(ec, MSI_EC_BATTERY_MODE_ADDRESS, result,
+				    count);
+}
+
+/*
+ * The battery saving flags are the low bits of 0xEB. Their individual
+ * effects are undocumented; super_battery sets all of them, the other
+ * presets none. Each flag is an attribute, flags combines them.
+ */
+static ssize_t battery_saving_flag_show(struct device *device,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	unsigned long bit = (unsigned long)to_ext_attr(attr)->var;
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_BATTERY_SAVING_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%s\n", is_bit_set(bit, rdata) ? "on" : "off");
+}
+
+static ssize_t battery_saving_flag_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	unsigned long bit = (unsigned long)to_ext_attr(attr)->var;
+	int result = -EINVAL;
+
+	if (streq(buf, "on"))
+		result = ec_write_bit(ec, MSI_EC_BATTERY_SAVING_ADDRESS, bit,
+				      TRUE);
+
+	if (streq(buf, "off"))
+		result = ec_write_bit(ec, MSI_EC_BATTERY_SAVING_ADDRESS, bit,
+				      FALSE);
+
+	return journal_store_result(ec, MSI_EC_BATTERY_SAVING_ADDRESS, result,
+				    count);
+}
+
+static ssize_t battery_saving_flags_show(struct device *device,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_BATTERY_SAVING_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "0x%x\n", rdata & MSI_EC_BATTERY_SAVING_FLAGS_MASK);
+}
+
+static ssize_t battery_saving_flags_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	u8 value;
+	int result;
+
+	result = kstrtou8(buf, 0, &value);
+	if (result < 0)
+		return result;
+	if (value & ~MSI_EC_BATTERY_SAVING_FLAGS_MASK)
+		return -EINVAL;
+
+	result = ec_update_bits(ec, MSI_EC_BATTERY_SAVING_ADDRESS,
+				MSI_EC_BATTERY_SAVING_FLAGS_MASK, value);
+	return journal_store_result(ec, MSI_EC_BATTERY_SAVING_ADDRESS, result,
+				    count);
+}
+
+static ssize_t cooler_boost_show(struct device *device,
+				 struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_COOLER_BOOST_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	if(is_bit_set(MSI_EC_COOLER_BOOST_BIT, rdata))
+		return sprintf(buf, "%s\n", "on");
+	else
+		return sprintf(buf, "%s\n", "off");
+}
+
+static ssize_t cooler_boost_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int result = -EINVAL;
+
+	if (streq(buf, "on"))
+		result = ec_write_bit(ec, MSI_EC_COOLER_BOOST_ADDRESS,
+				      MSI_EC_COOLER_BOOST_BIT,
+				      TRUE);
+
+	if (streq(buf, "off"))
+		result = ec_write_bit(ec, MSI_EC_COOLER_BOOST_ADDRESS,
+				      MSI_EC_COOLER_BOOST_BIT,
+				      FALSE);
+
+	return journal_store_result(ec, MSI_EC_COOLER_BOOST_ADDRESS, result,
+				    count);
+}
+
+static ssize_t shift_mode_show(struct device *device,
+			       struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_SHIFT_MODE_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	if (!shift_mode_name(rdata))
+		return sprintf(buf, "%s (%i)\n", "unknown", rdata);
+
+	return sprintf(buf, "%s\n", shift_mode_name(rdata));
+}
+
+static ssize_t shift_mode_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int result = -EINVAL;
+
+	if (streq(buf, "overclock"))
+		result = ec_write_byte(ec, MSI_EC_SHIFT_MODE_ADDRESS,
+				       MSI_EC_SHIFT_MODE_OVERCLOCK);
+
+	if (streq(buf, "balanced"))
+		result = ec_write_byte(ec, MSI_EC_SHIFT_MODE_ADDRESS,
+				       MSI_EC_SHIFT_MODE_BALANCED);
+
+	if (streq(buf, "eco"))
+		result = ec_write_byte(ec, MSI_EC_SHIFT_MODE_ADDRESS,
+				       MSI_EC_SHIFT_MODE_ECO);
+
+	if (streq(buf, "off"))
+		result = ec_write_byte(ec, MSI_EC_SHIFT_MODE_ADDRESS,
+				       MSI_EC_SHIFT_MODE_OFF);
+
+	return journal_store_result(ec, MSI_EC_SHIFT_MODE_ADDRESS, result,
+				    count);
+}
+
+static ssize_t fan_mode_show(struct device *device,
+			     struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_FAN_MODE_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%s\n", fan_mode_name(rdata));
+}
+
+static ssize_t fan_mode_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int result = -EINVAL;
+	bool is_auto = streq(buf, "auto");
+	bool is_silent = streq(buf, "silent");
+	bool is_basic = streq(buf, "basic");
+	bool is_adv = streq(buf, "advanced");
+
+	if (!is_auto && !is_basic && !is_adv && !is_silent)
+		return result;
+
+	/* All three flags change in a single read-modify-write cycle */
+	result = ec_update_bits(ec, MSI_EC_FAN_MODE_ADDRESS,
+				BIT(MSI_EC_FAN_MODE_BASIC_BIT) |
+				BIT(MSI_EC_FAN_MODE_ADVANCED_BIT) |
+				BIT(MSI_EC_FAN_MODE_SILENT_BIT),
+				(is_basic ? BIT(MSI_EC_FAN_MODE_BASIC_BIT) : 0) |
+				(is_adv ? BIT(MSI_EC_FAN_MODE_ADVANCED_BIT) : 0) |
+				(is_silent ? BIT(MSI_EC_FAN_MODE_SILENT_BIT) : 0));
+
+	return journal_store_result(ec, MSI_EC_FAN_MODE_ADDRESS, result, count);
+}
+
+static ssize_t preset_show(struct device *device,
+			     struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 values[ARRAY_SIZE(MSI_EC_PRESET_MEMORY_TABLE)];
+	struct msi_ec_config cfg;
+	int c;
+	int result;
+
+	config_get(ec, &cfg);
+	for (c = 0; c < ARRAY_SIZE(cfg.preset_regs); c++) {
+		u8 addr = cfg.preset_regs[c];
+
+		result = ec_read_cached(ec, addr, &values[c]);
+		if (result < 0) {
+			pr_err("msi-ec: preset_show: failed to read from address %#02x "
+			       "(error code %i)",
+			       addr, result);
+			return result;
+		}
+	}
+
+	return sprintf(buf, "%s\n", preset_name(preset_match(&cfg, values)));
+}
+
+/*
+ * Writes the registers of a preset and journals it on behalf of source (and
+ * who, or the current task); returns the last error, if any.
+ */
+static int preset_apply(struct msi_ec_dev *ec, int index, u8 source,
+			const struct journal_who *who)
+{
+	DECLARE_BITMAP(regs, MSI_EC_RAM_SIZE);
+	struct msi_ec_config cfg;
+	int status = 0;
+	int result;
+	int c;
+
+	/* The preset is applied as a whole against other writers */
+	config_get(ec, &cfg);
+	bitmap_zero(regs, MSI_EC_RAM_SIZE);
+	for (c = 0; c < ARRAY_SIZE(cfg.preset_regs); c++)
+		set_bit(cfg.preset_regs[c], regs);
+	set_bit(MSI_EC_FAN_MODE_ADDRESS, regs);
+	ec_lock_regs(ec, regs);
+
+	for (c = 0; c < ARRAY_SIZE(cfg.preset_regs); c++) {
+		u8 addr = cfg.preset_regs[c];
+		u8 value = cfg.preset_values[index][c];
+
+		if(c == MSI_EC_PRESET_COLUMN_SILENT_FLAG) {
+			result = __ec_update_bits(ec, addr,
+						  BIT(MSI_EC_FAN_MODE_SILENT_BIT),
+						  value ? BIT(MSI_EC_FAN_MODE_SILENT_BIT) : 0);
+		}
+		else {
+			result = msi_ec_write(ec, addr, value);
+		}
+
+		if(result < 0) {
+			pr_err("msi-ec: %s: failed to write to address %#02x "
+				       "while setting preset %i (error code %i)",
+				       __func__, addr, index, result);
+			journal_write_as(ec, source, addr, result, who);
+			status = result;
+		}
+	}
+
+	/* ---- Validate fan modes ---- */
+	if(index != MSI_EC_PRESET_HIGH_PERFORMANCE) {
+		// Disable basic/adv fan mode flags when not using high performance preset
+		result = __ec_update_bits(ec, MSI_EC_FAN_MODE_ADDRESS,
+					  BIT(MSI_EC_FAN_MODE_ADVANCED_BIT) |
+					  BIT(MSI_EC_FAN_MODE_BASIC_BIT),
+					  0);
+		if (result < 0) {
+			journal_write_as(ec, source, MSI_EC_FAN_MODE_ADDRESS,
+					 result, who);
+			status = result;
+		}
+	}
+
+	ec_unlock_regs(ec, regs);
+
+	if (status == 0)
+		journal_note(ec, JOURNAL_PRESET, source, index, who);
+	journal_write_as(ec, source, MSI_EC_FAN_MODE_ADDRESS, 0, who);
+	journal_write_as(ec, source, MSI_EC_KBD_BL_ADDRESS, 0, who);
+
+	return status;
+}
+
+static ssize_t preset_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int index;
+	int result;
+
+	if (streq(buf, "super_battery"))
+		index = MSI_EC_PRESET_SUPER_BATTERY;
+	else if (streq(buf, "silent"))
+		index = MSI_EC_PRESET_SILENT;
+	else if (streq(buf, "balanced"))
+		index = MSI_EC_PRESET_BALANCED;
+	else if (streq(buf, "high_performance"))
+		index = MSI_EC_PRESET_HIGH_PERFORMANCE;
+	else
+		return -EINVAL;
+
+	result = preset_apply(ec, index, JOURNAL_SYSFS, NULL);
+	if (result < 0)
+		return result;
+
+	return count;
+}
+
+static ssize_t fw_version_show(struct device *device,
+			       struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata[MSI_EC_FW_VERSION_LENGTH + 1];
+	int result;
+
+	memset(rdata, 0, MSI_EC_FW_VERSION_LENGTH + 1);
+	result = ec_read_seq(ec, MSI_EC_FW_VERSION_ADDRESS, rdata,
+			     MSI_EC_FW_VERSION_LENGTH);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%s\n", rdata);
+}
+
+static ssize_t fw_release_date_show(struct device *device,
+				    struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdate[MSI_EC_FW_DATE_LENGTH + 1];
+	u8 rtime[MSI_EC_FW_TIME_LENGTH + 1];
+	int result;
+	int year, month, day, hour, minute, second;
+
+	memset(rdate, 0, MSI_EC_FW_DATE_LENGTH + 1);
+	result = ec_read_seq(ec, MSI_EC_FW_DATE_ADDRESS, rdate,
+			     MSI_EC_FW_DATE_LENGTH);
+	if (result < 0)
+		return result;
+	sscanf(rdate, "%02d%02d%04d", &month, &day, &year);
+
+	memset(rtime, 0, MSI_EC_FW_TIME_LENGTH + 1);
+	result = ec_read_seq(ec, MSI_EC_FW_TIME_ADDRESS, rtime,
+			     MSI_EC_FW_TIME_LENGTH);
+	if (result < 0)
+		return result;
+	sscanf(rtime, "%02d:%02d:%02d", &hour, &minute, &second);
+
+	return sprintf(buf, "%04d/%02d/%02d %02d:%02d:%02d\n", year, month, day,
+		       hour, minute, second);
+}
+
+static ssize_t ac_connected_show(struct device *device,
+			     	 struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_POWER_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%i\n", is_bit_set(MSI_EC_POWER_AC_CONNECTED_BIT, rdata));
+}
+
+static ssize_t lid_open_show(struct device *device,
+			     struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_POWER_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%i\n", is_bit_set(MSI_EC_POWER_LID_OPEN_BIT, rdata));
+}
+
+static ssize_t fn_lock_show(struct device *device,
+			    struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_FN_LOCK_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%s\n",
+		       is_bit_set(MSI_EC_FN_LOCK_BIT, rdata) ? "on" : "off");
+}
+
+static ssize_t keyboard_lock_show(struct device *device,
+				  struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_KBD_LOCK_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%s\n",
+		       rdata & MSI_EC_KBD_LOCK_MASK ? "on" : "off");
+}
+
+/*
+ * Registers covered by the snapshot attribute. Adjacent registers are merged
+ * into ranges so a scrape walks the EC RAM once instead of once per file.
+ * GPU ranges are skipped on machines without a dGPU.
+ */
+static const struct {
+	u8 addr;
+	u8 len;
+	bool gpu;
+} snapshot_ranges[] = {
+	{ MSI_EC_POWER_ADDRESS, 1 },
+	{ MSI_EC_CPU_REALTIME_TEMPERATURE_ADDRESS, 0x12 }, /* 0x68 - 0x79 */
+	{ MSI_EC_GPU_REALTIME_TEMPERATURE_ADDRESS, 0x11, TRUE }, /* 0x80 - 0x90 */
+	{ MSI_EC_GPU_POWER_ADDRESS, 1 }, /* part of the presets */
+	{ MSI_EC_COOLER_BOOST_ADDRESS, 1 },
+	{ MSI_EC_CPU_REALTIME_FAN_RPM_ADDRESS, 2 },
+	{ MSI_EC_GPU_REALTIME_FAN_RPM_ADDRESS, 2, TRUE },
+	{ MSI_EC_GRAPHICS_SWITCH_ADDRESS, 1, TRUE },
+	{ MSI_EC_PRESET_SHIFT_MODE_ADDRESS, 3 }, /* 0xd2 - 0xd4 */
+	{ MSI_EC_BATTERY_MODE_ADDRESS, 1 },
+	{ MSI_EC_BATTERY_SAVING_ADDRESS, 1 },
+	{ MSI_EC_SHIFT_MODE_ADDRESS, 1 },
+};
+
+struct msi_ec_snapshot {
+	u8 regs[MSI_EC_RAM_SIZE];
+};
+
+static bool snapshot_covers(struct msi_ec_dev *ec, u8 addr)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(snapshot_ranges); i++) {
+		if (snapshot_ranges[i].gpu && !ec->has_dgpu)
+			continue;
+		if (addr >= snapshot_ranges[i].addr &&
+		    addr - snapshot_ranges[i].addr < snapshot_ranges[i].len)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static int snapshot_read_reg(struct msi_ec_dev *ec,
+			     struct msi_ec_snapshot *snap, u8 addr, bool cached)
+{
+	if (cached)
+		return ec_read_cached(ec, addr, &snap->regs[addr]);
+	return msi_ec_read(ec, addr, &snap->regs[addr]);
+}
+
+/*
+ * Fills the snapshot ranges, from the cache if allowed and fresh enough.
+ * Preset registers configured outside of the ranges are read as well.
+ */
+static int snapshot_read(struct msi_ec_dev *ec, struct msi_ec_snapshot *snap,
+			 bool cached)
+{
+	u8 regs[ARRAY_SIZE(MSI_EC_PRESET_MEMORY_TABLE)];
+	int result;
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(snapshot_ranges); i++) {
+		if (snapshot_ranges[i].gpu && !ec->has_dgpu)
+			continue;
+		if (!cached) {
+			result = ec_read_seq(ec, snapshot_ranges[i].addr,
+					     snap->regs + snapshot_ranges[i].addr,
+					     snapshot_ranges[i].len);
+			if (result < 0)
+				return result;
+			continue;
+		}
+		for (j = 0; j < snapshot_ranges[i].len; j++) {
+			result = snapshot_read_reg(ec, snap,
+						   snapshot_ranges[i].addr + j,
+						   cached);
+			if (result < 0)
+				return result;
+		}
+	}
+
+	rcu_read_lock();
+	memcpy(regs, rcu_dereference(ec->cfg)->preset_regs, sizeof(regs));
+	rcu_read_unlock();
+	for (i = 0; i < ARRAY_SIZE(regs); i++) {
+		if (snapshot_covers(ec, regs[i]))
+			continue;
+		result = snapshot_read_reg(ec, snap, regs[i], cached);
+		if (result < 0)
+			return result;
+	}
+
+	return 0;
+}
+
+static u16 snapshot_u16(const struct msi_ec_snapshot *snap, u8 addr)
+{
+	return snap->regs[addr] | (snap->regs[addr + 1] << 8);
+}
+
+static int snapshot_format_curve(char *buf, int len, const char *name,
+				 const u8 *values)
+{
+	int i;
+
+	len += sysfs_emit_at(buf, len, "%s ", name);
+	for (i = 0; i < MSI_EC_FAN_CURVE_LENGTH; i++)
+		len += sysfs_emit_at(buf, len, "%s%i", i ? "," : "", values[i]);
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+static ssize_t snapshot_format(struct msi_ec_dev *ec,
+			       const struct msi_ec_snapshot *snap, char *buf)
+{
+	const u8 *regs = snap->regs;
+	u8 values[ARRAY_SIZE(MSI_EC_PRESET_MEMORY_TABLE)];
+	struct msi_ec_config cfg;
+	const char *shift_mode;
+	int fan_speed;
+	int len = 0;
+	int c;
+
+	config_get(ec, &cfg);
+	for (c = 0; c < ARRAY_SIZE(cfg.preset_regs); c++)
+		values[c] = regs[cfg.preset_regs[c]];
+
+	len += sysfs_emit_at(buf, len, "cpu_temperature %i\n",
+			     regs[MSI_EC_CPU_REALTIME_TEMPERATURE_ADDRESS]);
+	fan_speed = cpu_fan_speed(ec,
+		regs[MSI_EC_CPU_REALTIME_FAN_SPEED_ADDRESS],
+		snapshot_u16(snap, MSI_EC_CPU_REALTIME_FAN_RPM_ADDRESS));
+	if (fan_speed >= 0)
+		len += sysfs_emit_at(buf, len, "cpu_fan_speed %i\n", fan_speed);
+	len += sysfs_emit_at(buf, len, "cpu_fan_rpm %i\n",
+			     snapshot_u16(snap, MSI_EC_CPU_REALTIME_FAN_RPM_ADDRESS));
+	if (ec->has_dgpu) {
+		len += sysfs_emit_at(buf, len, "gpu_temperature %i\n",
+				     regs[MSI_EC_GPU_REALTIME_TEMPERATURE_ADDRESS]);
+		len += sysfs_emit_at(buf, len, "gpu_fan_speed %i\n",
+				     gpu_fan_speed(ec,
+					regs[MSI_EC_GPU_REALTIME_FAN_SPEED_ADDRESS],
+					snapshot_u16(snap, MSI_EC_GPU_REALTIME_FAN_RPM_ADDRESS)));
+		len += sysfs_emit_at(buf, len, "gpu_fan_rpm %i\n",
+				     snapshot_u16(snap, MSI_EC_GPU_REALTIME_FAN_RPM_ADDRESS));
+		len += sysfs_emit_at(buf, len, "graphics_switch %i\n",
+				     regs[MSI_EC_GRAPHICS_SWITCH_ADDRESS] &
+				     MSI_EC_GRAPHICS_SWITCH_MASK);
+	}
+	len += sysfs_emit_at(buf, len, "ac_connected %i\n",
+			     is_bit_set(MSI_EC_POWER_AC_CONNECTED_BIT,
+					regs[MSI_EC_POWER_ADDRESS]));
+	len += sysfs_emit_at(buf, len, "lid_open %i\n",
+			     is_bit_set(MSI_EC_POWER_LID_OPEN_BIT,
+					regs[MSI_EC_POWER_ADDRESS]));
+	len += sysfs_emit_at(buf, len, "cooler_boost %i\n",
+			     is_bit_set(MSI_EC_COOLER_BOOST_BIT,
+					regs[MSI_EC_COOLER_BOOST_ADDRESS]));
+	shift_mode = shift_mode_name(regs[MSI_EC_SHIFT_MODE_ADDRESS]);
+	len += sysfs_emit_at(buf, len, "shift_mode %s\n",
+			     shift_mode ? shift_mode : "unknown");
+	len += sysfs_emit_at(buf, len, "fan_mode %s\n",
+			     fan_mode_name(regs[MSI_EC_FAN_MODE_ADDRESS]));
+	len += sysfs_emit_at(buf, len, "preset %s\n",
+			     preset_name(preset_match(&cfg, values)));
+	if (is_bit_set(MSI_EC_BATTERY_MODE_ENABLE_BIT,
+		       regs[MSI_EC_BATTERY_MODE_ADDRESS]))
+		len += sysfs_emit_at(buf, len, "battery_charge_threshold %i\n",
+				     regs[MSI_EC_BATTERY_MODE_ADDRESS] &
+				     MSI_EC_BATTERY_MODE_THRESHOLD_MASK);
+	len += sysfs_emit_at(buf, len, "battery_saving_flags %i\n",
+			     regs[MSI_EC_BATTERY_SAVING_ADDRESS] &
+			     MSI_EC_BATTERY_SAVING_FLAGS_MASK);
+	len = snapshot_format_curve(buf, len, "cpu_fan_curve_temperatures",
+				    regs + MSI_EC_CPU_FAN_CURVE_TEMPERATURE_ADDRESS);
+	len = snapshot_format_curve(buf, len, "cpu_fan_curve_speeds",
+				    regs + MSI_EC_CPU_FAN_CURVE_SPEED_ADDRESS);
+	if (ec->has_dgpu) {
+		len = snapshot_format_curve(buf, len, "gpu_fan_curve_temperatures",
+					    regs + MSI_EC_GPU_FAN_CURVE_TEMPERATURE_ADDRESS);
+		len = snapshot_format_curve(buf, len, "gpu_fan_curve_speeds",
+					    regs + MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS);
+	}
+
+	return len;
+}
+
+static ssize_t snapshot_show(struct device *device,
+			     struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	struct msi_ec_snapshot *snap;
+	ssize_t result;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+
+	result = snapshot_read(ec, snap, TRUE);
+	if (result >= 0)
+		result = snapshot_format(ec, snap, buf);
+
+	kfree(snap);
+	return result;
+}
+
+static ssize_t ec_stats_show(struct device *device,
+			     struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+
+	return sprintf(buf,
+		       "ec_reads %lld\n"
+		       "ec_writes %lld\n"
+		       "ec_errors %lld\n"
+		       "ec_busy_ns %lld\n"
+		       "cache_hits %lld\n"
+		       "lock_waits %lld\n"
+		       "blocked %lld\n"
+		       "budget_used_percent %i\n"
+		       "budget_deferred %lld\n"
+		       "external_changes %lld\n",
+		       atomic64_read(&ec->stats.reads),
+		       atomic64_read(&ec->stats.writes),
+		       atomic64_read(&ec->stats.errors),
+		       atomic64_read(&ec->stats.busy_ns),
+		       atomic64_read(&ec->stats.cache_hits),
+		       atomic64_read(&ec->stats.lock_waits),
+		       atomic64_read(&ec->stats.blocked),
+		       ec_budget_used(ec),
+		       atomic64_read(&ec->stats.deferred),
+		       atomic64_read(&ec->stats.external_changes));
+}
+
+/*
+ * Tunable EC state serialized by the settings attribute, in blob order. Only
+ * the bits in mask belong to a setting; the remaining bits of the register
+ * are left untouched on restore. Without a dGPU, the gpu fields are neither
+ * read nor written and hold 0 in the blob, which keeps its layout fixed.
+ */
+static const struct {
+	u8 addr;
+	u8 mask;
+	bool gpu;
+} settings_fields[] = {
+	{ MSI_EC_WEBCAM_ADDRESS, BIT(MSI_EC_WEBCAM_BIT) },
+	{ MSI_EC_WEBCAM_HARD_ADDRESS, BIT(MSI_EC_WEBCAM_HARD_BIT) },
+	{ MSI_EC_CPU_FAN_CURVE_TEMPERATURE_ADDRESS + 0, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_TEMPERATURE_ADDRESS + 1, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_TEMPERATURE_ADDRESS + 2, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_TEMPERATURE_ADDRESS + 3, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_TEMPERATURE_ADDRESS + 4, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_TEMPERATURE_ADDRESS + 5, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_TEMPERATURE_ADDRESS + 6, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_SPEED_ADDRESS + 0, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_SPEED_ADDRESS + 1, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_SPEED_ADDRESS + 2, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_SPEED_ADDRESS + 3, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_SPEED_ADDRESS + 4, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_SPEED_ADDRESS + 5, 0xff },
+	{ MSI_EC_CPU_FAN_CURVE_SPEED_ADDRESS + 6, 0xff },
+	{ MSI_EC_CPU_POWER_ADDRESS, 0xff },
+	{ MSI_EC_GPU_FAN_CURVE_TEMPERATURE_ADDRESS + 0, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_TEMPERATURE_ADDRESS + 1, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_TEMPERATURE_ADDRESS + 2, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_TEMPERATURE_ADDRESS + 3, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_TEMPERATURE_ADDRESS + 4, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_TEMPERATURE_ADDRESS + 5, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_TEMPERATURE_ADDRESS + 6, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS + 0, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS + 1, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS + 2, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS + 3, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS + 4, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS + 5, 0xff, TRUE },
+	{ MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS + 6, 0xff, TRUE },
+	{ MSI_EC_GPU_POWER_ADDRESS, 0xff, TRUE },
+	{ MSI_EC_COOLER_BOOST_ADDRESS, BIT(MSI_EC_COOLER_BOOST_BIT) },
+	{ MSI_EC_PRESET_SHIFT_MODE_ADDRESS, 0xff },
+	{ MSI_EC_KBD_BL_ADDRESS, 0xff },
+	{ MSI_EC_FAN_MODE_ADDRESS, BIT(MSI_EC_FAN_MODE_SILENT_BIT) |
+				   BIT(MSI_EC_FAN_MODE_BASIC_BIT) |
+				   BIT(MSI_EC_FAN_MODE_ADVANCED_BIT) },
+	{ MSI_EC_BATTERY_MODE_ADDRESS, 0xff },
+	{ MSI_EC_FN_WIN_ADDRESS, BIT(MSI_EC_FN_WIN_BIT) },
+	{ MSI_EC_BATTERY_SAVING_ADDRESS, 0xff },
+	{ MSI_EC_SHIFT_MODE_ADDRESS, 0xff },
+};
+
+/*
+ * Blob layout: header, one value per entry of settings_fields, then the
+ * CRC-32 (zlib polynomial, little endian) of everything before it.
+ */
+struct msi_ec_settings_header {
+	u8 magic[4];
+	u8 version;
+	u8 count;
+	u8 reserved[2];
+} __packed;
+
+#define MSI_EC_SETTINGS_SIZE                                               \
+	(sizeof(struct msi_ec_settings_header) + ARRAY_SIZE(settings_fields) + \
+	 sizeof(__le32))
+
+static __le32 settings_crc(const u8 *blob)
+{
+	return cpu_to_le32(~crc32_le(~0, blob, MSI_EC_SETTINGS_SIZE -
+						       sizeof(__le32)));
+}
+
+static ssize_t settings_read(struct file *filp, struct kobject *kobj,
+			     struct bin_attribute *attr, char *buf, loff_t off,
+			     size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(kobj_to_dev(kobj));
+	u8 blob[MSI_EC_SETTINGS_SIZE];
+	struct msi_ec_settings_header *header = (void *)blob;
+	u8 *values = blob + sizeof(*header);
+	__le32 crc;
+	int result;
+	int i, j, len;
+
+	memset(blob, 0, sizeof(blob));
+	memcpy(header->magic, MSI_EC_SETTINGS_MAGIC, sizeof(header->magic));
+	header->version = MSI_EC_SETTINGS_VERSION;
+	header->count = ARRAY_SIZE(settings_fields);
+
+	/* Fields of consecutive registers, like the fan curves, in one read */
+	for (i = 0; i < ARRAY_SIZE(settings_fields); i += len) {
+		len = 1;
+		while (i + len < ARRAY_SIZE(settings_fields) &&
+		       settings_fields[i + len].addr ==
+			       settings_fields[i].addr + len &&
+		       settings_fields[i + len].gpu == settings_fields[i].gpu)
+			len++;
+
+		if (settings_fields[i].gpu && !ec->has_dgpu)
+			continue;
+		result = ec_read_seq(ec, settings_fields[i].addr, &values[i],
+				     len);
+		if (result < 0)
+			return result;
+		for (j = i; j < i + len; j++)
+			values[j] &= settings_fields[j].mask;
+	}
+
+	crc = settings_crc(blob);
+	memcpy(blob + sizeof(blob) - sizeof(crc), &crc, sizeof(crc));
+
+	return memory_read_from_buffer(buf, count, &off, blob, sizeof(blob));
+}
+
+/*
+ * Writes only the registers whose masked value differs from the blob. All
+ * registers are locked for the duration, so the restore is not interleaved
+ * with other writers.
+ */
+static int settings_apply(struct msi_ec_dev *ec, const u8 *values)
+{
+	DECLARE_BITMAP(regs, MSI_EC_RAM_SIZE);
+	u8 addr;
+	int result = 0;
+	int i;
+
+	bitmap_zero(regs, MSI_EC_RAM_SIZE);
+	for (i = 0; i < ARRAY_SIZE(settings_fields); i++) {
+		if (!settings_fields[i].gpu || ec->has_dgpu)
+			set_bit(settings_fields[i].addr, regs);
+	}
+	ec_lock_regs(ec, regs);
+
+	for (i = 0; i < ARRAY_SIZE(settings_fields); i++) {
+		if (settings_fields[i].gpu && !ec->has_dgpu)
+			continue;
+		addr = settings_fields[i].addr;
+
+		result = __ec_update_bits(ec, addr, settings_fields[i].mask,
+					  values[i]);
+		journal_write(ec, JOURNAL_SYSFS, addr, result);
+		if (result < 0) {
+			pr_err("msi-ec: settings: failed to write to address %#02x "
+			       "(error code %i)",
+			       addr, result);
+			break;
+		}
+	}
+
+	ec_unlock_regs(ec, regs);
+
+	return result < 0 ? result : 0;
+}
+
+static ssize_t settings_write(struct file *filp, struct kobject *kobj,
+			      struct bin_attribute *attr, char *buf, loff_t off,
+			      size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(kobj_to_dev(kobj));
+	const struct msi_ec_settings_header *header = (void *)buf;
+	const u8 *values = (u8 *)buf + sizeof(*header);
+	__le32 crc;
+	int result;
+	int i;
+
+	if (off != 0 || count != MSI_EC_SETTINGS_SIZE)
+		return -EINVAL;
+
+	crc = settings_crc((u8 *)buf);
+
+	if (memcmp(header->magic, MSI_EC_SETTINGS_MAGIC,
+		   sizeof(header->magic)) ||
+	    header->version != MSI_EC_SETTINGS_VERSION ||
+	    header->count != ARRAY_SIZE(settings_fields) ||
+	    memcmp(buf + count - sizeof(crc), &crc, sizeof(crc)))
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(settings_fields); i++) {
+		if (values[i] & ~settings_fields[i].mask)
+			return -EINVAL;
+		if (settings_fields[i].gpu && !ec->has_dgpu && values[i])
+			return -EINVAL;
+	}
+
+	result = settings_apply(ec, values);
+	if (result < 0)
+		return result;
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(webcam);
+static DEVICE_ATTR_RW(fn_key);
+static DEVICE_ATTR_RW(win_key);
+static DEVICE_ATTR_RW(battery_charge_mode);
+static DEVICE_ATTR_RW(battery_charge_threshold);
+static DEVICE_ATTR_RW(cooler_boost);
+static DEVICE_ATTR_RW(shift_mode);
+static DEVICE_ATTR_RW(fan_mode);
+static DEVICE_ATTR_RW(preset);
+static DEVICE_ATTR_RO(fw_version);
+static DEVICE_ATTR_RO(fw_release_date);
+static DEVICE_ATTR_RO(ac_connected);
+static DEVICE_ATTR_RO(lid_open);
+static DEVICE_ATTR_RO(fn_lock);
+static DEVICE_ATTR_RO(keyboard_lock);
+static DEVICE_ATTR_RO(snapshot);
+static DEVICE_ATTR_RO(ec_stats);
+static BIN_ATTR_RW(settings, MSI_EC_SETTINGS_SIZE);
+
+static struct attribute *msi_root_attrs[] = {
+	&dev_attr_webcam.attr,		&dev_attr_fn_key.attr,
+	&dev_attr_win_key.attr,		&dev_attr_battery_charge_mode.attr,
+	&dev_attr_cooler_boost.attr,	&dev_attr_shift_mode.attr,
+	&dev_attr_fan_mode.attr,		&dev_attr_fw_version.attr,
+	&dev_attr_ac_connected.attr,	&dev_attr_lid_open.attr,
+	&dev_attr_fw_release_date.attr,	&dev_attr_preset.attr,
+	&dev_attr_snapshot.attr,	&dev_attr_ec_stats.attr,
+	&dev_attr_fn_lock.attr,		&dev_attr_keyboard_lock.attr,
+	&dev_attr_battery_charge_threshold.attr,
+	NULL
+};
+
+static struct bin_attribute *msi_root_bin_attrs[] = {
+	&bin_attr_settings,
+	NULL
+};
+
+static const struct attribute_group msi_root_group = {
+	.attrs = msi_root_attrs,
+	.bin_attrs = msi_root_bin_attrs,
+};
+
+#define BATTERY_SAVING_FLAG_ATTR(n)                                          \
+	static struct dev_ext_attribute dev_attr_battery_saving_flag##n = {  \
+		__ATTR(flag##n, 0644, battery_saving_flag_show,              \
+		       battery_saving_flag_store),                           \
+		(void *)n,                                                   \
+	}
+
+BATTERY_SAVING_FLAG_ATTR(0);
+BATTERY_SAVING_FLAG_ATTR(1);
+BATTERY_SAVING_FLAG_ATTR(2);
+BATTERY_SAVING_FLAG_ATTR(3);
+
+static struct device_attribute dev_attr_battery_saving_flags =
+	__ATTR(flags, 0644, battery_saving_flags_show,
+	       battery_saving_flags_store);
+
+static struct attribute *msi_battery_saving_attrs[] = {
+	&dev_attr_battery_saving_flag0.attr.attr,
+	&dev_attr_battery_saving_flag1.attr.attr,
+	&dev_attr_battery_saving_flag2.attr.attr,
+	&dev_attr_battery_saving_flag3.attr.attr,
+	&dev_attr_battery_saving_flags.attr,
+	NULL,
+};
+
+static const struct attribute_group msi_battery_saving_group = {
+	.name = "battery_saving",
+	.attrs = msi_battery_saving_attrs,
+};
+
+// ============================================================ //
+// Sysfs platform device attributes (cpu)
+// ============================================================ //
+
+static ssize_t cpu_realtime_temperature_show(struct device *device,
+					     struct device_attribute *attr,
+					     char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_CPU_REALTIME_TEMPERATURE_ADDRESS,
+				&rdata);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%i\n", rdata);
+}
+
+static ssize_t cpu_realtime_fan_speed_show(struct device *device,
+					   struct device_attribute *attr,
+					   char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u16 rpm = 0;
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_CPU_REALTIME_FAN_SPEED_ADDRESS,
+				&rdata);
+	if (result < 0)
+		return result;
+	if (READ_ONCE(ec->fans->valid)) {
+		result = fan_rpm_read(ec, FAN_CPU, &rpm);
+		if (result < 0)
+			return result;
+	}
+
+	result = cpu_fan_speed(ec, rdata, rpm);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%i\n", result);
+}
+
+
+
+static struct device_attribute dev_attr_cpu_realtime_temperature = {
+	.attr = {
+		.name = "realtime_temperature",
+		.mode = 0444,
+	},
+	.show = cpu_realtime_temperature_show,
+};
+
+static struct device_attribute dev_attr_cpu_realtime_fan_speed = {
+	.attr = {
+		.name = "realtime_fan_speed",
+		.mode = 0444,
+	},
+	.show = cpu_realtime_fan_speed_show,
+};
+
+static struct attribute *msi_cpu_attrs[] = {
+	&dev_attr_cpu_realtime_temperature.attr,
+	&dev_attr_cpu_realtime_fan_speed.attr,
+	NULL,
+};
+
+static const struct attribute_group msi_cpu_group = {
+	.name = "cpu",
+	.attrs = msi_cpu_attrs,
+};
+
+// ============================================================ //
+// Sysfs platform device attributes (gpu)
+// ============================================================ //
+
+static ssize_t gpu_realtime_temperature_show(struct device *device,
+					     struct device_attribute *attr,
+					     char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_GPU_REALTIME_TEMPERATURE_ADDRESS,
+				&rdata);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%i\n", rdata);
+}
+
+static ssize_t gpu_realtime_fan_speed_show(struct device *device,
+					   struct device_attribute *attr,
+					   char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u16 rpm = 0;
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_GPU_REALTIME_FAN_SPEED_ADDRESS,
+				&rdata);
+	if (result < 0)
+		return result;
+	if (READ_ONCE(ec->fans->valid)) {
+		result = fan_rpm_read(ec, FAN_GPU, &rpm);
+		if (result < 0)
+			return result;
+	}
+
+	return sprintf(buf, "%i\n", gpu_fan_speed(ec, rdata, rpm));
+}
+
+static ssize_t gpu_realtime_fan_rpm_show(struct device *device,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u16 rpm;
+	int result;
+
+	result = fan_rpm_read(ec, FAN_GPU, &rpm);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%i\n", rpm);
+}
+
+static ssize_t gpu_fan_curve_show(struct device *device,
+				  struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 temperature, speed;
+	int len = 0;
+	int i;
+	int result;
+
+	/* One "temperature speed" line per curve point */
+	for (i = 0; i < MSI_EC_FAN_CURVE_LENGTH; i++) {
+		result = ec_read_cached(ec,
+					MSI_EC_GPU_FAN_CURVE_TEMPERATURE_ADDRESS + i,
+					&temperature);
+		if (result < 0)
+			return result;
+		result = ec_read_cached(ec, MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS + i,
+					&speed);
+		if (result < 0)
+			return result;
+		len += sysfs_emit_at(buf, len, "%i %i\n", temperature, speed);
+	}
+
+	return len;
+}
+
+static ssize_t gpu_graphics_switch_show(struct device *device,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	u8 rdata;
+	int result;
+
+	result = ec_read_cached(ec, MSI_EC_GRAPHICS_SWITCH_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	return sprintf(buf, "%i\n", rdata & MSI_EC_GRAPHICS_SWITCH_MASK);
+}
+
+static ssize_t gpu_graphics_switch_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	u8 value;
+	int result;
+
+	result = kstrtou8(buf, 10, &value);
+	if (result < 0)
+		return result;
+
+	if (value & ~MSI_EC_GRAPHICS_SWITCH_MASK)
+		return -EINVAL;
+
+	result = ec_update_bits(ec, MSI_EC_GRAPHICS_SWITCH_ADDRESS,
+				MSI_EC_GRAPHICS_SWITCH_MASK, value);
+	return journal_store_result(ec, MSI_EC_GRAPHICS_SWITCH_ADDRESS, result,
+				    count);
+}
+
+static struct device_attribute dev_attr_gpu_realtime_temperature = {
+	.attr = {
+		.name = "realtime_temperature",
+		.mode = 0444,
+	},
+	.show = gpu_realtime_temperature_show,
+};
+
+static struct device_attribute dev_attr_gpu_realtime_fan_speed = {
+	.attr = {
+		.name = "realtime_fan_speed",
+		.mode = 0444,
+	},
+	.show = gpu_realtime_fan_speed_show,
+};
+
+static struct device_attribute dev_attr_gpu_realtime_fan_rpm = {
+	.attr = {
+		.name = "realtime_fan_rpm",
+		.mode = 0444,
+	},
+	.show = gpu_realtime_fan_rpm_show,
+};
+
+static struct device_attribute dev_attr_gpu_fan_curve = {
+	.attr = {
+		.name = "fan_curve",
+		.mode = 0444,
+	},
+	.show = gpu_fan_curve_show,
+};
+
+static struct device_attribute dev_attr_gpu_graphics_switch = {
+	.attr = {
+		.name = "graphics_switch",
+		.mode = 0644,
+	},
+	.show = gpu_graphics_switch_show,
+	.store = gpu_graphics_switch_store,
+};
+
+static struct attribute *msi_gpu_attrs[] = {
+	&dev_attr_gpu_realtime_temperature.attr,
+	&dev_attr_gpu_realtime_fan_speed.attr,
+	&dev_attr_gpu_realtime_fan_rpm.attr,
+	&dev_attr_gpu_fan_curve.attr,
+	&dev_attr_gpu_graphics_switch.attr,
+	NULL,
+};
+
+static const struct attribute_group msi_gpu_group = {
+	.name = "gpu",
+	.attrs = msi_gpu_attrs,
+};
+
+/* msi_gpu_group is only registered when a dGPU is present */
+static const struct attribute_group *msi_platform_groups[] = {
+	&msi_root_group,
+	&msi_battery_saving_group,
+	&msi_cpu_group,
+	NULL,
+};
+
+// ============================================================ //
+// Sampler
+// ============================================================ //
+
+/*
+ * While enabled, the sampler refreshes the snapshot registers (and with them
+ * the register cache) periodically and notifies pollers of the snapshot
+ * attribute whenever a value changed.
+ */
+
+struct ec_sampler {
+	struct msi_ec_snapshot last;
+	struct msi_ec_snapshot scratch;
+};
+
+/* Journals the states of a snapshot read at time since */
+static void journal_snapshot(struct msi_ec_dev *ec,
+			     const struct msi_ec_snapshot *snap, u64 since)
+{
+	static const u8 addrs[] = {
+		MSI_EC_SHIFT_MODE_ADDRESS, MSI_EC_FAN_MODE_ADDRESS,
+		MSI_EC_COOLER_BOOST_ADDRESS, MSI_EC_BATTERY_MODE_ADDRESS,
+		MSI_EC_BATTERY_SAVING_ADDRESS,
+		MSI_EC_KBD_BL_ADDRESS,
+	};
+	const u8 *regs = snap->regs;
+	u8 values[ARRAY_SIZE(MSI_EC_PRESET_MEMORY_TABLE)];
+	struct msi_ec_config cfg;
+	int type, value;
+	int preset;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(addrs); i++) {
+		type = journal_reg_state(addrs[i], regs[addrs[i]], &value);
+		journal_observe(ec, type, value, since);
+	}
+
+	journal_observe(ec, JOURNAL_AC,
+			is_bit_set(MSI_EC_POWER_AC_CONNECTED_BIT,
+				   regs[MSI_EC_POWER_ADDRESS]),
+			since);
+	journal_observe(ec, JOURNAL_LID,
+			is_bit_set(MSI_EC_POWER_LID_OPEN_BIT,
+				   regs[MSI_EC_POWER_ADDRESS]),
+			since);
+
+	config_get(ec, &cfg);
+	for (i = 0; i < ARRAY_SIZE(cfg.preset_regs); i++)
+		values[i] = regs[cfg.preset_regs[i]];
+	preset = preset_match(&cfg, values);
+	/* Custom configurations get the index after the known presets */
+	journal_observe(ec, JOURNAL_PRESET,
+			preset < 0 ? ARRAY_SIZE(MSI_EC_PRESET_VALUE_TABLE) :
+				     preset,
+			since);
+}
+
+static void sampler_work_fn(struct work_struct *work)
+{
+	struct msi_ec_dev *ec = worker_ec(work);
+	struct ec_worker *worker = &ec->workers[WORKER_SAMPLER];
+	struct ec_sampler *sampler = ec->sampler;
+	unsigned int interval = READ_ONCE(worker->interval_ms);
+	u64 start = ktime_get_ns();
+
+	if (!interval)
+		return;
+
+	memset(&sampler->scratch, 0, sizeof(sampler->scratch));
+	if (!ec_budget_defer(ec) &&
+	    snapshot_read(ec, &sampler->scratch, FALSE) == 0 &&
+	    memcmp(&sampler->scratch, &sampler->last, sizeof(sampler->last))) {
+		sampler->last = sampler->scratch;
+		journal_snapshot(ec, &sampler->last, start);
+		sysfs_notify(&ec->pdev->dev.kobj, NULL, "snapshot");
+	}
+
+	queue_delayed_work(system_freezable_wq, &worker->work,
+			   msecs_to_jiffies(interval));
+}
+
+static void sampler_start(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_SAMPLER];
+
+	mutex_lock(&worker->lock);
+	INIT_DELAYED_WORK(&worker->work, sampler_work_fn);
+	worker->ready = TRUE;
+	queue_delayed_work(system_freezable_wq, &worker->work, 0);
+	mutex_unlock(&worker->lock);
+}
+
+static void sampler_stop(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_SAMPLER];
+
+	mutex_lock(&worker->lock);
+	worker->ready = FALSE;
+	cancel_delayed_work_sync(&worker->work);
+	mutex_unlock(&worker->lock);
+}
+
+// ============================================================ //
+// Cache revalidation
+// ============================================================ //
+
+/*
+ * Other agents (ec_sys, AML methods, firmware hotkeys) write configuration
+ * registers behind the driver's back, leaving the cache stale. While
+ * watch_interval_ms is set, the watched ranges are re-read periodically and
+ * on ACPI events; a range that differs from the watcher's shadow (its last
+ * read, plus the driver's own writes) was changed externally. The read
+ * refetches it into the cache, and the change is counted and journaled.
+ * Pollers of the Fn-lock and keyboard lock state, which only the firmware
+ * changes, are woken up as well.
+ */
+
+static const struct {
+	u8 addr;
+	u8 len;
+} watch_ranges[] = {
+	{ MSI_EC_PRESET_SHIFT_MODE_ADDRESS, 6 }, /* 0xd2 - 0xd7 */
+	{ MSI_EC_FN_WIN_ADDRESS, 1 },
+	{ MSI_EC_BATTERY_SAVING_ADDRESS, 1 },
+	{ MSI_EC_COOLER_BOOST_ADDRESS, 1 },
+	{ MSI_EC_FN_LOCK_ADDRESS, 1 },
+	{ MSI_EC_KBD_LOCK_ADDRESS, 1 },
+};
+
+#define WATCH_RANGE_MAX 6
+
+/*
+ * Wakes pollers of the attributes backed by a register that changed. old is
+ * the shadow, not the cache: a read of fn_lock right after the hotkey would
+ * have put the new state in the cache and hidden the change.
+ */
+static void watch_notify(struct msi_ec_dev *ec, u8 addr, u8 old, u8 new)
+{
+	struct kobject *kobj = &ec->pdev->dev.kobj;
+
+	if (addr == MSI_EC_FN_LOCK_ADDRESS &&
+	    (old ^ new) & BIT(MSI_EC_FN_LOCK_BIT)) {
+		sysfs_notify(kobj, NULL, "fn_lock");
+		led_classdev_notify_brightness_hw_changed(
+			&ec->fnlock_led,
+			is_bit_set(MSI_EC_FN_LOCK_BIT, new));
+	}
+	if (addr == MSI_EC_KBD_LOCK_ADDRESS &&
+	    (old ^ new) & MSI_EC_KBD_LOCK_MASK)
+		sysfs_notify(kobj, NULL, "keyboard_lock");
+}
+
+/*
+ * Re-reads one range and compares it with the shadow. The registers are
+ * locked against the driver's writes meanwhile, so those never look
+ * external. Returns whether the range changed, or a negative error.
+ */
+static int watch_check_range(struct msi_ec_dev *ec, int index, u64 since)
+{
+	u8 addr = watch_ranges[index].addr;
+	u8 len = watch_ranges[index].len;
+	DECLARE_BITMAP(regs, MSI_EC_RAM_SIZE);
+	u8 shadow[WATCH_RANGE_MAX];
+	u8 fresh[WATCH_RANGE_MAX];
+	bool known = TRUE;
+	int type, value;
+	int result;
+	int i;
+
+	bitmap_zero(regs, MSI_EC_RAM_SIZE);
+	bitmap_set(regs, addr, len);
+	ec_lock_regs(ec, regs);
+
+	result = ec_read_seq(ec, addr, fresh, len);
+	if (result < 0) {
+		ec_unlock_regs(ec, regs);
+		return result;
+	}
+
+	spin_lock(&ec->watch_shadow.lock);
+	for (i = 0; i < len; i++) {
+		known = known && test_bit(addr + i, ec->watch_shadow.valid);
+		shadow[i] = ec->watch_shadow.regs[addr + i];
+		ec->watch_shadow.regs[addr + i] = fresh[i];
+	}
+	bitmap_set(ec->watch_shadow.valid, addr, len);
+	spin_unlock(&ec->watch_shadow.lock);
+	ec_unlock_regs(ec, regs);
+
+	/* Nothing to compare with before the first read */
+	if (!known || !memcmp(shadow, fresh, len))
+		return 0;
+
+	atomic64_inc(&ec->stats.external_changes);
+	for (i = 0; i < len; i++) {
+		if (shadow[i] == fresh[i])
+			continue;
+		type = journal_reg_state(addr + i, fresh[i], &value);
+		if (type >= 0)
+			journal_observe(ec, type, value, since);
+		watch_notify(ec, addr + i, shadow[i], fresh[i]);
+	}
+
+	return 1;
+}
+
+static void watch_work_fn(struct work_struct *work)
+{
+	struct msi_ec_dev *ec = worker_ec(work);
+	struct ec_worker *worker = &ec->workers[WORKER_WATCH];
+	unsigned int interval = READ_ONCE(worker->interval_ms);
+	u64 start = ktime_get_ns();
+	int i;
+
+	if (!interval)
+		return;
+
+	if (!ec_budget_defer(ec)) {
+		for (i = 0; i < ARRAY_SIZE(watch_ranges); i++) {
+			if (watch_check_range(ec, i, start) < 0)
+				break;
+		}
+	}
+
+	queue_delayed_work(system_freezable_wq, &worker->work,
+			   msecs_to_jiffies(interval));
+}
+
+/* AC, battery and hotkey events often come with EC writes of the firmware */
+static int watch_acpi_notify(struct notifier_block *nb, unsigned long event,
+			     void *data)
+{
+	struct msi_ec_dev *ec = container_of(nb, struct msi_ec_dev, watch_nb);
+	struct ec_worker *worker = &ec->workers[WORKER_WATCH];
+
+	/* Checked under the lock, or it could race with a suspend's prepare */
+	mutex_lock(&worker->lock);
+	if (worker->ready && worker->interval_ms)
+		mod_delayed_work(system_freezable_wq, &worker->work, 0);
+	mutex_unlock(&worker->lock);
+	return NOTIFY_DONE;
+}
+
+static void watch_start(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_WATCH];
+	int i;
+
+	spin_lock(&ec->cache.lock);
+	for (i = 0; i < ARRAY_SIZE(watch_ranges); i++)
+		bitmap_set(ec->cache.watched, watch_ranges[i].addr,
+			   watch_ranges[i].len);
+	spin_unlock(&ec->cache.lock);
+
+	mutex_lock(&worker->lock);
+	INIT_DELAYED_WORK(&worker->work, watch_work_fn);
+	WRITE_ONCE(worker->ready, TRUE);
+	queue_delayed_work(system_freezable_wq, &worker->work, 0);
+	mutex_unlock(&worker->lock);
+
+	ec->watch_nb.notifier_call = watch_acpi_notify;
+	register_acpi_notifier(&ec->watch_nb);
+}
+
+static void watch_stop(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_WATCH];
+
+	unregister_acpi_notifier(&ec->watch_nb);
+
+	mutex_lock(&worker->lock);
+	WRITE_ONCE(worker->ready, FALSE);
+	mutex_unlock(&worker->lock);
+	cancel_delayed_work_sync(&worker->work);
+
+	spin_lock(&ec->cache.lock);
+	bitmap_zero(ec->cache.watched, MSI_EC_RAM_SIZE);
+	spin_unlock(&ec->cache.lock);
+
+	/* Changes while stopped are not reported after a restart */
+	spin_lock(&ec->watch_shadow.lock);
+	bitmap_zero(ec->watch_shadow.valid, MSI_EC_RAM_SIZE);
+	spin_unlock(&ec->watch_shadow.lock);
+}
+
+// ============================================================ //
+// Performance leases
+// ============================================================ //
+
+/*
+ * Every open file of the /dev node may hold a lease, a performance floor. The
+ * arbiter applies the maximum of all floors on top of the state found when
+ * the first floor was requested (the baseline) and restores the baseline once
+ * no floor is left. Leases are dropped on close, so a crashed holder cannot
+ * leave the machine in overclock.
+ *
+ * A field that no longer holds what the arbiter wrote was changed by someone
+ * else (sysfs, a hotkey) while floors were active. That value becomes the
+ * new baseline of the field, so dropping the last floor keeps it.
+ */
+
+#define MSI_EC_FAN_MODE_MASK (BIT(MSI_EC_FAN_MODE_SILENT_BIT) | \
+			      BIT(MSI_EC_FAN_MODE_BASIC_BIT) | \
+			      BIT(MSI_EC_FAN_MODE_ADVANCED_BIT))
+
+struct perf_lease {
+	struct msi_ec_dev *ec;
+	struct list_head node;
+	struct msi_ec_lease floor;
+};
+
+struct ec_arbiter {
+	struct mutex lock;
+	struct list_head leases;
+	unsigned int lease_count;
+	bool closed; /* the device is unbinding, no more leases */
+
+	/* Floor contributed by the feedforward worker, merged like a lease */
+	struct msi_ec_lease feedforward;
+
+	/* Floor decided by the policy hook, merged like a lease */
+	struct msi_ec_lease policy;
+
+	/* Set by the fan guard: cooler boost and eco override every floor */
+	bool fallback;
+
+	struct {
+		bool valid;
+		u8 shift_mode;
+		u8 fan_mode;
+		bool cooler_boost;
+	} baseline;
+
+	/* What the EC holds as far as the arbiter knows, fan mode masked */
+	struct {
+		u8 shift_mode;
+		u8 fan_mode;
+		bool cooler_boost;
+	} written;
+};
+
+static const u8 shift_mode_values[] = {
+	[MSI_EC_LEASE_SHIFT_ECO] = MSI_EC_SHIFT_MODE_ECO,
+	[MSI_EC_LEASE_SHIFT_BALANCED] = MSI_EC_SHIFT_MODE_BALANCED,
+	[MSI_EC_LEASE_SHIFT_OVERCLOCK] = MSI_EC_SHIFT_MODE_OVERCLOCK,
+};
+
+static u8 shift_mode_level(u8 value)
+{
+	switch (value) {
+	case MSI_EC_SHIFT_MODE_ECO:
+		return MSI_EC_LEASE_SHIFT_ECO;
+	case MSI_EC_SHIFT_MODE_BALANCED:
+		return MSI_EC_LEASE_SHIFT_BALANCED;
+	case MSI_EC_SHIFT_MODE_OVERCLOCK:
+		return MSI_EC_LEASE_SHIFT_OVERCLOCK;
+	default:
+		return MSI_EC_LEASE_SHIFT_NONE;
+	}
+}
+
+/* Silent ranks below every floor */
+static u8 fan_mode_level(u8 value)
+{
+	if (is_bit_set(MSI_EC_FAN_MODE_SILENT_BIT, value))
+		return MSI_EC_LEASE_FAN_NONE;
+	if (is_bit_set(MSI_EC_FAN_MODE_ADVANCED_BIT, value))
+		return MSI_EC_LEASE_FAN_ADVANCED;
+	return MSI_EC_LEASE_FAN_AUTO;
+}
+
+static void floor_merge(struct msi_ec_lease *floor,
+			const struct msi_ec_lease *other)
+{
+	floor->shift_mode = max(floor->shift_mode, other->shift_mode);
+	floor->fan_mode = max(floor->fan_mode, other->fan_mode);
+	floor->flags |= other->flags;
+}
+
+static void arbiter_floor(struct msi_ec_dev *ec, struct msi_ec_lease *floor)
+{
+	struct perf_lease *lease;
+
+	lockdep_assert_held(&ec->arbiter->lock);
+
+	memset(floor, 0, sizeof(*floor));
+	list_for_each_entry(lease, &ec->arbiter->leases, node)
+		floor_merge(floor, &lease->floor);
+	floor_merge(floor, &ec->arbiter->feedforward);
+	floor_merge(floor, &ec->arbiter->policy);
+}
+
+static int arbiter_capture(struct msi_ec_dev *ec)
+{
+	u8 cooler_boost;
+	int result;
+
+	result = msi_ec_read(ec, MSI_EC_SHIFT_MODE_ADDRESS,
+			     &ec->arbiter->baseline.shift_mode);
+	if (result < 0)
+		return result;
+	result = msi_ec_read(ec, MSI_EC_FAN_MODE_ADDRESS,
+			     &ec->arbiter->baseline.fan_mode);
+	if (result < 0)
+		return result;
+	result = msi_ec_read(ec, MSI_EC_COOLER_BOOST_ADDRESS, &cooler_boost);
+	if (result < 0)
+		return result;
+
+	ec->arbiter->baseline.cooler_boost =
+		is_bit_set(MSI_EC_COOLER_BOOST_BIT, cooler_boost);
+	ec->arbiter->baseline.valid = TRUE;
+
+	ec->arbiter->written.shift_mode = ec->arbiter->baseline.shift_mode;
+	ec->arbiter->written.fan_mode =
+		ec->arbiter->baseline.fan_mode & MSI_EC_FAN_MODE_MASK;
+	ec->arbiter->written.cooler_boost = ec->arbiter->baseline.cooler_boost;
+	return 0;
+}
+
+/* Takes over fields changed behind the arbiter's back into the baseline */
+static int arbiter_adopt(struct msi_ec_dev *ec)
+{
+	u8 shift_mode, fan_mode, cooler_boost;
+	bool boost;
+	int result;
+
+	result = msi_ec_read(ec, MSI_EC_SHIFT_MODE_ADDRESS, &shift_mode);
+	if (result < 0)
+		return result;
+	result = msi_ec_read(ec, MSI_EC_FAN_MODE_ADDRESS, &fan_mode);
+	if (result < 0)
+		return result;
+	result = msi_ec_read(ec, MSI_EC_COOLER_BOOST_ADDRESS, &cooler_boost);
+	if (result < 0)
+		return result;
+
+	if (shift_mode != ec->arbiter->written.shift_mode) {
+		ec->arbiter->baseline.shift_mode = shift_mode;
+		ec->arbiter->written.shift_mode = shift_mode;
+	}
+	if ((fan_mode & MSI_EC_FAN_MODE_MASK) != ec->arbiter->written.fan_mode) {
+		ec->arbiter->baseline.fan_mode = fan_mode;
+		ec->arbiter->written.fan_mode = fan_mode & MSI_EC_FAN_MODE_MASK;
+	}
+	boost = is_bit_set(MSI_EC_COOLER_BOOST_BIT, cooler_boost);
+	if (boost != ec->arbiter->written.cooler_boost) {
+		ec->arbiter->baseline.cooler_boost = boost;
+		ec->arbiter->written.cooler_boost = boost;
+	}
+	return 0;
+}
+
+static int arbiter_write(struct msi_ec_dev *ec, u8 shift_mode, u8 fan_mode,
+			 bool cooler_boost, u8 source)
+{
+	int result;
+
+	result = ec_update_bits(ec, MSI_EC_SHIFT_MODE_ADDRESS, 0xff,
+				shift_mode);
+	journal_write(ec, source, MSI_EC_SHIFT_MODE_ADDRESS, result);
+	if (result < 0)
+		return result;
+	ec->arbiter->written.shift_mode = shift_mode;
+
+	result = ec_update_bits(ec, MSI_EC_FAN_MODE_ADDRESS,
+				MSI_EC_FAN_MODE_MASK, fan_mode);
+	journal_write(ec, source, MSI_EC_FAN_MODE_ADDRESS, result);
+	if (result < 0)
+		return result;
+	ec->arbiter->written.fan_mode = fan_mode & MSI_EC_FAN_MODE_MASK;
+
+	result = ec_write_bit(ec, MSI_EC_COOLER_BOOST_ADDRESS,
+			      MSI_EC_COOLER_BOOST_BIT, cooler_boost);
+	journal_write(ec, source, MSI_EC_COOLER_BOOST_ADDRESS, result);
+	if (result < 0)
+		return result;
+	ec->arbiter->written.cooler_boost = cooler_boost;
+	return 0;
+}
+
+/* Brings the EC in line with the current floors; source is journaled */
+static int arbiter_apply(struct msi_ec_dev *ec, u8 source)
+{
+	struct msi_ec_lease floor;
+	u8 shift_mode, fan_mode;
+	u8 level;
+	int result;
+
+	lockdep_assert_held(&ec->arbiter->lock);
+
+	arbiter_floor(ec, &floor);
+
+	if (ec->arbiter->baseline.valid) {
+		result = arbiter_adopt(ec);
+		if (result < 0)
+			return result;
+	}
+
+	if (!floor.shift_mode && !floor.fan_mode && !floor.flags &&
+	    !ec->arbiter->fallback) {
+		if (!ec->arbiter->baseline.valid)
+			return 0;
+		ec->arbiter->baseline.valid = FALSE;
+		return arbiter_write(ec, ec->arbiter->baseline.shift_mode,
+				     ec->arbiter->baseline.fan_mode,
+				     ec->arbiter->baseline.cooler_boost, source);
+	}
+
+	if (!ec->arbiter->baseline.valid) {
+		result = arbiter_capture(ec);
+		if (result < 0)
+			return result;
+	}
+
+	shift_mode = ec->arbiter->baseline.shift_mode;
+	if (floor.shift_mode > shift_mode_level(shift_mode))
+		shift_mode = shift_mode_values[floor.shift_mode];
+
+	fan_mode = ec->arbiter->baseline.fan_mode;
+	level = fan_mode_level(fan_mode);
+	if (floor.fan_mode > level)
+		fan_mode = floor.fan_mode == MSI_EC_LEASE_FAN_ADVANCED ?
+				   BIT(MSI_EC_FAN_MODE_ADVANCED_BIT) : 0;
+
+	if (ec->arbiter->fallback)
+		return arbiter_write(ec, MSI_EC_SHIFT_MODE_ECO, fan_mode, TRUE,
+				     source);
+
+	return arbiter_write(ec, shift_mode, fan_mode,
+			     ec->arbiter->baseline.cooler_boost ||
+			     (floor.flags & MSI_EC_LEASE_COOLER_BOOST),
+			     source);
+}
+
+static void lease_drop(struct perf_lease *lease)
+{
+	struct msi_ec_dev *ec = lease->ec;
+	int result;
+
+	mutex_lock(&ec->arbiter->lock);
+	if (!list_empty(&lease->node)) {
+		list_del_init(&lease->node);
+		ec->arbiter->lease_count--;
+		result = arbiter_apply(ec, JOURNAL_LEASE);
+		if (result < 0)
+			pr_err("msi-ec: leases: failed to restore the performance state "
+			       "(error code %i)",
+			       result);
+	}
+	mutex_unlock(&ec->arbiter->lock);
+}
+
+static int lease_open(struct inode *inode, struct file *file)
+{
+	struct msi_ec_dev *ec = container_of(file->private_data,
+					     struct msi_ec_dev, miscdev);
+	struct perf_lease *lease;
+
+	lease = kzalloc(sizeof(*lease), GFP_KERNEL);
+	if (!lease)
+		return -ENOMEM;
+
+	/* The file may outlive the binding; the state has to stay */
+	kref_get(&ec->ref);
+	lease->ec = ec;
+	INIT_LIST_HEAD(&lease->node);
+	file->private_data = lease;
+
+	return nonseekable_open(inode, file);
+}
+
+static int lease_release(struct inode *inode, struct file *file)
+{
+	struct perf_lease *lease = file->private_data;
+
+	lease_drop(lease);
+	kref_put(&lease->ec->ref, msi_ec_free);
+	kfree(lease);
+
+	return 0;
+}
+
+static long lease_set(struct perf_lease *lease, void __user *argp)
+{
+	struct msi_ec_dev *ec = lease->ec;
+	struct msi_ec_lease floor;
+	int result;
+
+	if (copy_from_user(&floor, argp, sizeof(floor)))
+		return -EFAULT;
+
+	if (floor.shift_mode > MSI_EC_LEASE_SHIFT_OVERCLOCK ||
+	    floor.fan_mode > MSI_EC_LEASE_FAN_ADVANCED ||
+	    floor.flags & ~MSI_EC_LEASE_COOLER_BOOST || floor.reserved)
+		return -EINVAL;
+
+	mutex_lock(&ec->arbiter->lock);
+	if (ec->arbiter->closed) {
+		mutex_unlock(&ec->arbiter->lock);
+		return -ENODEV;
+	}
+	lease->floor = floor;
+	if (list_empty(&lease->node)) {
+		list_add_tail(&lease->node, &ec->arbiter->leases);
+		ec->arbiter->lease_count++;
+	}
+	result = arbiter_apply(ec, JOURNAL_LEASE);
+	mutex_unlock(&ec->arbiter->lock);
+
+	return result;
+}
+
+static long lease_get(struct msi_ec_dev *ec, void __user *argp)
+{
+	struct msi_ec_lease_state state;
+
+	memset(&state, 0, sizeof(state));
+	mutex_lock(&ec->arbiter->lock);
+	arbiter_floor(ec, &state.floor);
+	state.count = ec->arbiter->lease_count;
+	mutex_unlock(&ec->arbiter->lock);
+
+	if (copy_to_user(argp, &state, sizeof(state)))
+		return -EFAULT;
+	return 0;
+}
+
+static void arbiter_init(struct msi_ec_dev *ec)
+{
+	mutex_init(&ec->arbiter->lock);
+	INIT_LIST_HEAD(&ec->arbiter->leases);
+}
+
+/*
+ * Drops the leases of files still open at the unbind and restores the
+ * baseline; the files themselves keep the state until they are closed.
+ */
+static void arbiter_exit(struct msi_ec_dev *ec)
+{
+	struct perf_lease *lease, *next;
+	int result;
+
+	mutex_lock(&ec->arbiter->lock);
+	ec->arbiter->closed = TRUE;
+	list_for_each_entry_safe(lease, next, &ec->arbiter->leases, node)
+		list_del_init(&lease->node);
+	ec->arbiter->lease_count = 0;
+	result = arbiter_apply(ec, JOURNAL_LEASE);
+	if (result < 0)
+		pr_err("msi-ec: leases: failed to restore the performance state "
+		       "(error code %i)",
+		       result);
+	mutex_unlock(&ec->arbiter->lock);
+}
+
+// ============================================================ //
+// Batched EC operations
+// ============================================================ //
+
+/*
+ * A batch runs the operations of struct msi_ec_op in order. Synchronous
+ * batches run in the caller's context. io_uring batches are queued on an
+ * ordered workqueue, so slow EC handshakes never block the submitter, and
+ * are completed in the submitter's task, where the results are copied back.
+ */
+
+#if IS_ENABLED(CONFIG_IO_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define MSI_EC_URING_CMD
+#endif
+
+struct ec_batch {
+	struct msi_ec_dev *ec;
+	struct msi_ec_op *ops;
+	u64 user_ops;
+	u32 count;
+	u32 flags;
+	int executed;
+	struct journal_who who; /* the submitter */
+#ifdef MSI_EC_URING_CMD
+	struct io_uring_cmd *ioucmd;
+	struct work_struct work;
+#endif
+};
+
+static int batch_check_op(struct file *file, const struct msi_ec_op *op)
+{
+	switch (op->type) {
+	case MSI_EC_OP_READ:
+		return 0;
+	case MSI_EC_OP_WRITE:
+	case MSI_EC_OP_UPDATE_BITS:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		break;
+	case MSI_EC_OP_PRESET:
+		if (op->value >= ARRAY_SIZE(MSI_EC_PRESET_VALUE_TABLE))
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	return 0;
+}
+
+static void batch_free(struct ec_batch *batch)
+{
+	kfree(batch->ops);
+	kfree(batch);
+}
+
+/* Copies and validates a batch; nothing runs unless every op is valid */
+static struct ec_batch *batch_prepare(struct file *file,
+				      const struct msi_ec_batch *request)
+{
+	struct perf_lease *lease = file->private_data;
+	struct ec_batch *batch;
+	int result;
+	u32 i;
+
+	if (!request->count || request->count > MSI_EC_BATCH_MAX ||
+	    request->flags & ~MSI_EC_BATCH_STOP_ON_ERROR)
+		return ERR_PTR(-EINVAL);
+
+	batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return ERR_PTR(-ENOMEM);
+
+	batch->ec = lease->ec;
+	batch->user_ops = request->ops;
+	batch->count = request->count;
+	batch->flags = request->flags;
+	journal_who_current(&batch->who);
+	batch->ops = memdup_user(u64_to_user_ptr(request->ops),
+				 request->count * sizeof(*batch->ops));
+	if (IS_ERR(batch->ops)) {
+		result = PTR_ERR(batch->ops);
+		kfree(batch);
+		return ERR_PTR(result);
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		result = batch_check_op(file, &batch->ops[i]);
+		if (result < 0) {
+			batch_free(batch);
+			return ERR_PTR(result);
+		}
+	}
+
+	return batch;
+}
+
+static int batch_run_op(struct ec_batch *batch, struct msi_ec_op *op)
+{
+	struct msi_ec_dev *ec = batch->ec;
+	int result;
+
+	switch (op->type) {
+	case MSI_EC_OP_READ:
+		return msi_ec_read(ec, op->addr, &op->value);
+	case MSI_EC_OP_WRITE:
+		result = ec_write_byte(ec, op->addr, op->value);
+		break;
+	case MSI_EC_OP_UPDATE_BITS:
+		result = ec_update_bits(ec, op->addr, op->mask, op->value);
+		break;
+	case MSI_EC_OP_PRESET:
+		return preset_apply(ec, op->value, JOURNAL_BATCH, &batch->who);
+	default:
+		return -EINVAL;
+	}
+
+	journal_write_as(ec, JOURNAL_BATCH, op->addr, result, &batch->who);
+	return result;
+}
+
+static void batch_run(struct ec_batch *batch)
+{
+	bool stopped = FALSE;
+	u32 i;
+
+	for (i = 0; i < batch->count; i++) {
+		struct msi_ec_op *op = &batch->ops[i];
+
+		if (stopped) {
+			op->result = -ECANCELED;
+			continue;
+		}
+
+		op->result = batch_run_op(batch, op);
+		batch->executed++;
+		if (op->result < 0 && batch->flags & MSI_EC_BATCH_STOP_ON_ERROR)
+			stopped = TRUE;
+	}
+}
+
+/* Copies the results back and frees the batch */
+static int batch_finish(struct ec_batch *batch)
+{
+	int result = batch->executed;
+
+	if (copy_to_user(u64_to_user_ptr(batch->user_ops), batch->ops,
+			 batch->count * sizeof(*batch->ops)))
+		result = -EFAULT;
+
+	batch_free(batch);
+	return result;
+}
+
+static long batch_ioctl(struct file *file, void __user *argp)
+{
+	struct msi_ec_batch request;
+	struct ec_batch *batch;
+
+	if (copy_from_user(&request, argp, sizeof(request)))
+		return -EFAULT;
+
+	batch = batch_prepare(file, &request);
+	if (IS_ERR(batch))
+		return PTR_ERR(batch);
+
+	batch_run(batch);
+	return batch_finish(batch);
+}
+
+#ifdef MSI_EC_URING_CMD
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define uring_cmd_payload(ioucmd) io_uring_sqe_cmd((ioucmd)->sqe)
+#else
+#define uring_cmd_payload(ioucmd) ((ioucmd)->cmd)
+#endif
+
+static struct ec_batch **batch_pdu(struct io_uring_cmd *ioucmd)
+{
+	return (struct ec_batch **)ioucmd->pdu;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+static void batch_uring_complete(struct io_uring_cmd *ioucmd,
+				 unsigned int issue_flags)
+{
+	io_uring_cmd_done(ioucmd, batch_finish(*batch_pdu(ioucmd)), 0,
+			  issue_flags);
+}
+#else
+static void batch_uring_complete(struct io_uring_cmd *ioucmd)
+{
+	io_uring_cmd_done(ioucmd, batch_finish(*batch_pdu(ioucmd)), 0);
+}
+#endif
+
+static void batch_work_fn(struct work_struct *work)
+{
+	struct ec_batch *batch = container_of(work, struct ec_batch, work);
+
+	batch_run(batch);
+	/* Copying the results back needs the submitter's address space */
+	io_uring_cmd_complete_in_task(batch->ioucmd, batch_uring_complete);
+}
+
+static int batch_uring_cmd(struct io_uring_cmd *ioucmd,
+			   unsigned int issue_flags)
+{
+	const struct msi_ec_batch *payload = uring_cmd_payload(ioucmd);
+	struct msi_ec_batch request;
+	struct ec_batch *batch;
+
+	if (ioucmd->cmd_op != MSI_EC_URING_CMD_BATCH)
+		return -ENOTTY;
+
+	/* The SQE belongs to userspace; read it once */
+	request.ops = READ_ONCE(payload->ops);
+	request.count = READ_ONCE(payload->count);
+	request.flags = READ_ONCE(payload->flags);
+
+	batch = batch_prepare(ioucmd->file, &request);
+	if (IS_ERR(batch))
+		return PTR_ERR(batch);
+
+	batch->ioucmd = ioucmd;
+	*batch_pdu(ioucmd) = batch;
+	INIT_WORK(&batch->work, batch_work_fn);
+	queue_work(batch->ec->batch_wq, &batch->work);
+
+	return -EIOCBQUEUED;
+}
+
+#endif
+
+// ============================================================ //
+// Character device
+// ============================================================ //
+
+static long msi_ec_ioctl(struct file *file, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct perf_lease *lease = file->private_data;
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case MSI_EC_IOC_SET_LEASE:
+		return lease_set(lease, argp);
+	case MSI_EC_IOC_CLEAR_LEASE:
+		lease_drop(lease);
+		return 0;
+	case MSI_EC_IOC_GET_LEASES:
+		return lease_get(lease->ec, argp);
+	case MSI_EC_IOC_BATCH:
+		return batch_ioctl(file, argp);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations msi_ec_fops = {
+	.owner = THIS_MODULE,
+	.open = lease_open,
+	.release = lease_release,
+	.unlocked_ioctl = msi_ec_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+#ifdef MSI_EC_URING_CMD
+	.uring_cmd = batch_uring_cmd,
+#endif
+};
+
+// ============================================================ //
+// Feedforward fan pre-spin
+// ============================================================ //
+
+/*
+ * The EC fan curve only reacts once the CPU temperature has risen. When
+ * enabled, the feedforward worker watches the aggregate CPU utilization and
+ * contributes a fan floor to the arbiter as soon as a sustained load ramp
+ * begins. The floor is released when the load ends, when the CPU temperature
+ * reaches the handoff temperature (the curve has caught up) or after
+ * hold_max_ms.
+ *
+ * In observe mode ramps are detected and counted without touching the EC
+ * floor, which gives a baseline for the throttle counters.
+ */
+
+enum ff_mode {
+	FF_MODE_OFF,
+	FF_MODE_OBSERVE,
+	FF_MODE_ON,
+};
+
+static const char *const ff_mode_names[] = {
+	[FF_MODE_OFF] = "off",
+	[FF_MODE_OBSERVE] = "observe",
+	[FF_MODE_ON] = "on",
+};
+
+enum ff_action {
+	FF_ACTION_COOLER_BOOST,
+	FF_ACTION_ADVANCED,
+};
+
+static const char *const ff_action_names[] = {
+	[FF_ACTION_COOLER_BOOST] = "cooler_boost",
+	[FF_ACTION_ADVANCED] = "advanced",
+};
+
+#define FF_HYSTERESIS 10 /* percent below threshold that ends a ramp */
+
+struct ec_ff {
+	struct msi_ec_dev *ec;
+	struct mutex lock;
+	struct delayed_work work;
+	unsigned int mode;
+	unsigned int action;
+	unsigned int threshold;
+	unsigned int sustain_ms;
+	unsigned int hold_max_ms;
+	unsigned int handoff_temperature;
+	unsigned int throttle_temperature;
+	unsigned int period_ms;
+
+	/* Worker state, touched by the worker and under lock when stopped */
+	struct {
+		u64 last_idle_us;
+		u64 last_wall_us;
+		u64 above_since_us;
+		u64 engaged_at_us;
+		bool active;
+		bool throttled;
+	} state;
+
+	unsigned int utilization;
+
+	struct {
+		atomic64_t ramps;
+		atomic64_t ramps_throttled;
+		atomic64_t releases_load;
+		atomic64_t releases_handoff;
+		atomic64_t releases_timeout;
+	} stats;
+};
+
+static u64 ff_cpu_idle_us(int cpu)
+{
+	u64 idle = get_cpu_idle_time_us(cpu, NULL);
+	u64 iowait = get_cpu_iowait_time_us(cpu, NULL);
+
+	/* Without NOHZ idle accounting, fall back to the tick based counters */
+	if (idle == -1ULL)
+		idle = div_u64(kcpustat_cpu(cpu).cpustat[CPUTIME_IDLE],
+			       NSEC_PER_USEC);
+	if (iowait == -1ULL)
+		iowait = div_u64(kcpustat_cpu(cpu).cpustat[CPUTIME_IOWAIT],
+				 NSEC_PER_USEC);
+
+	return idle + iowait;
+}
+
+/* Aggregate utilization in percent since the previous call */
+static unsigned int ff_sample_utilization(struct msi_ec_dev *ec, u64 now)
+{
+	u64 idle = 0, wall, busy;
+	unsigned int utilization = 0;
+	int cpu;
+
+	for_each_online_cpu(cpu)
+		idle += ff_cpu_idle_us(cpu);
+
+	if (ec->ff->state.last_wall_us && now > ec->ff->state.last_wall_us &&
+	    idle >= ec->ff->state.last_idle_us) {
+		wall = (now - ec->ff->state.last_wall_us) * num_online_cpus();
+		busy = wall - min(idle - ec->ff->state.last_idle_us, wall);
+		utilization = div64_u64(busy * 100, wall);
+	}
+
+	ec->ff->state.last_idle_us = idle;
+	ec->ff->state.last_wall_us = now;
+
+	return utilization;
+}
+
+static void ff_set_floor(struct msi_ec_dev *ec, bool engage)
+{
+	int result;
+
+	mutex_lock(&ec->arbiter->lock);
+	memset(&ec->arbiter->feedforward, 0, sizeof(ec->arbiter->feedforward));
+	if (engage && READ_ONCE(ec->ff->action) == FF_ACTION_ADVANCED)
+		ec->arbiter->feedforward.fan_mode = MSI_EC_LEASE_FAN_ADVANCED;
+	else if (engage)
+		ec->arbiter->feedforward.flags = MSI_EC_LEASE_COOLER_BOOST;
+	result = arbiter_apply(ec, JOURNAL_FEEDFORWARD);
+	mutex_unlock(&ec->arbiter->lock);
+
+	if (result < 0)
+		pr_err("msi-ec: feedforward: failed to update the fan floor "
+		       "(error code %i)",
+		       result);
+}
+
+static void ff_release(struct msi_ec_dev *ec, atomic64_t *reason)
+{
+	ec->ff->state.active = FALSE;
+	ec->ff->state.above_since_us = 0;
+	atomic64_inc(reason);
+	if (ec->ff->state.throttled)
+		atomic64_inc(&ec->ff->stats.ramps_throttled);
+	if (READ_ONCE(ec->ff->mode) == FF_MODE_ON)
+		ff_set_floor(ec, FALSE);
+}
+
+static void ff_work_fn(struct work_struct *work)
+{
+	struct msi_ec_dev *ec = container_of(to_delayed_work(work),
+					     struct ec_ff, work)->ec;
+	unsigned int mode = READ_ONCE(ec->ff->mode);
+	unsigned int threshold = READ_ONCE(ec->ff->threshold);
+	unsigned int utilization;
+	u64 now = ktime_to_us(ktime_get());
+	u8 temperature;
+
+	if (mode == FF_MODE_OFF)
+		return;
+
+	utilization = ff_sample_utilization(ec, now);
+	WRITE_ONCE(ec->ff->utilization, utilization);
+
+	if (!ec->ff->state.active) {
+		if (utilization < threshold) {
+			ec->ff->state.above_since_us = 0;
+		} else if (!ec->ff->state.above_since_us) {
+			ec->ff->state.above_since_us = now;
+		} else if (now - ec->ff->state.above_since_us >=
+			   READ_ONCE(ec->ff->sustain_ms) * USEC_PER_MSEC) {
+			ec->ff->state.active = TRUE;
+			ec->ff->state.throttled = FALSE;
+			ec->ff->state.engaged_at_us = now;
+			atomic64_inc(&ec->ff->stats.ramps);
+			if (mode == FF_MODE_ON)
+				ff_set_floor(ec, TRUE);
+		}
+	} else if (ec_read_cached(ec, MSI_EC_CPU_REALTIME_TEMPERATURE_ADDRESS,
+				  &temperature) >= 0) {
+		if (temperature >= READ_ONCE(ec->ff->throttle_temperature))
+			ec->ff->state.throttled = TRUE;
+
+		if (utilization + FF_HYSTERESIS < threshold)
+			ff_release(ec, &ec->ff->stats.releases_load);
+		else if (temperature >= READ_ONCE(ec->ff->handoff_temperature))
+			ff_release(ec, &ec->ff->stats.releases_handoff);
+		else if (now - ec->ff->state.engaged_at_us >=
+			 READ_ONCE(ec->ff->hold_max_ms) * USEC_PER_MSEC)
+			ff_release(ec, &ec->ff->stats.releases_timeout);
+	}
+
+	queue_delayed_work(system_freezable_wq, &ec->ff->work,
+			   msecs_to_jiffies(READ_ONCE(ec->ff->period_ms)));
+}
+
+static void ff_start(struct msi_ec_dev *ec)
+{
+	memset(&ec->ff->state, 0, sizeof(ec->ff->state));
+	queue_delayed_work(system_freezable_wq, &ec->ff->work, 0);
+}
+
+/* Stops the worker and drops its floor; called with the ff lock held */
+static void ff_stop(struct msi_ec_dev *ec)
+{
+	cancel_delayed_work_sync(&ec->ff->work);
+	if (ec->ff->state.active) {
+		ec->ff->state.active = FALSE;
+		ff_set_floor(ec, FALSE);
+	}
+	WRITE_ONCE(ec->ff->utilization, 0);
+}
+
+static void ff_init(struct msi_ec_dev *ec)
+{
+	struct ec_ff *ff = ec->ff;
+
+	ff->ec = ec;
+	mutex_init(&ff->lock);
+	INIT_DELAYED_WORK(&ff->work, ff_work_fn);
+	ff->mode = FF_MODE_OFF;
+	ff->action = FF_ACTION_COOLER_BOOST;
+	ff->threshold = 70;
+	ff->sustain_ms = 1000;
+	ff->hold_max_ms = 30000;
+	ff->handoff_temperature = 80;
+	ff->throttle_temperature = 95;
+	ff->period_ms = 250;
+}
+
+static void ff_exit(struct msi_ec_dev *ec)
+{
+	mutex_lock(&ec->ff->lock);
+	if (ec->ff->mode != FF_MODE_OFF)
+		ff_stop(ec);
+	WRITE_ONCE(ec->ff->mode, FF_MODE_OFF);
+	mutex_unlock(&ec->ff->lock);
+}
+
+static ssize_t ff_mode_show(struct device *device,
+			    struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+
+	return sprintf(buf, "%s\n", ff_mode_names[READ_ONCE(ec->ff->mode)]);
+}
+
+static ssize_t ff_mode_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int mode;
+
+	mode = sysfs_match_string(ff_mode_names, buf);
+	if (mode < 0)
+		return mode;
+
+	mutex_lock(&ec->ff->lock);
+	if (mode != ec->ff->mode) {
+		ff_stop(ec);
+		atomic64_set(&ec->ff->stats.ramps, 0);
+		atomic64_set(&ec->ff->stats.ramps_throttled, 0);
+		atomic64_set(&ec->ff->stats.releases_load, 0);
+		atomic64_set(&ec->ff->stats.releases_handoff, 0);
+		atomic64_set(&ec->ff->stats.releases_timeout, 0);
+		WRITE_ONCE(ec->ff->mode, mode);
+		if (mode != FF_MODE_OFF)
+			ff_start(ec);
+	}
+	mutex_unlock(&ec->ff->lock);
+
+	return count;
+}
+
+static ssize_t ff_action_show(struct device *device,
+			      struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+
+	return sprintf(buf, "%s\n", ff_action_names[READ_ONCE(ec->ff->action)]);
+}
+
+static ssize_t ff_action_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int action;
+
+	action = sysfs_match_string(ff_action_names, buf);
+	if (action < 0)
+		return action;
+
+	/* Takes effect with the next ramp */
+	WRITE_ONCE(ec->ff->action, action);
+
+	return count;
+}
+
+static ssize_t ff_stats_show(struct device *device,
+			     struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+
+	return sprintf(buf,
+		       "utilization %u\n"
+		       "active %i\n"
+		       "ramps %lld\n"
+		       "ramps_throttled %lld\n"
+		       "releases_load %lld\n"
+		       "releases_handoff %lld\n"
+		       "releases_timeout %lld\n",
+		       READ_ONCE(ec->ff->utilization),
+		       READ_ONCE(ec->ff->state.active),
+		       atomic64_read(&ec->ff->stats.ramps),
+		       atomic64_read(&ec->ff->stats.ramps_throttled),
+		       atomic64_read(&ec->ff->stats.releases_load),
+		       atomic64_read(&ec->ff->stats.releases_handoff),
+		       atomic64_read(&ec->ff->stats.releases_timeout));
+}
+
+/* Numeric tunables, read by the worker on every period */
+#define FF_TUNABLE(_name, _min, _max)					\
+static ssize_t ff_##_name##_show(struct device *device,		\
+				 struct device_attribute *attr,		\
+				 char *buf)				\
+{									\
+	struct msi_ec_dev *ec = dev_get_drvdata(device);		\
+									\
+	return sprintf(buf, "%u\n", READ_ONCE(ec->ff->_name));		\
+}									\
+									\
+static ssize_t ff_##_name##_store(struct device *dev,			\
+				  struct device_attribute *attr,	\
+				  const char *buf, size_t count)	\
+{									\
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);			\
+	unsigned int value;						\
+	int result;							\
+									\
+	result = kstrtouint(buf, 10, &value);				\
+	if (result < 0)							\
+		return result;						\
+	if (value < (_min) || value > (_max))				\
+		return -EINVAL;						\
+									\
+	WRITE_ONCE(ec->ff->_name, value);				\
+	return count;							\
+}									\
+									\
+static struct device_attribute dev_attr_ff_##_name =			\
+	__ATTR(_name, 0644, ff_##_name##_show, ff_##_name##_store)
+
+FF_TUNABLE(threshold, 1, 100);
+FF_TUNABLE(sustain_ms, 0, 60000);
+FF_TUNABLE(hold_max_ms, 1000, 600000);
+FF_TUNABLE(handoff_temperature, 30, 100);
+FF_TUNABLE(throttle_temperature, 50, 110);
+FF_TUNABLE(period_ms, 50, 10000);
+
+static struct device_attribute dev_attr_ff_mode =
+	__ATTR(mode, 0644, ff_mode_show, ff_mode_store);
+static struct device_attribute dev_attr_ff_action =
+	__ATTR(action, 0644, ff_action_show, ff_action_store);
+static struct device_attribute dev_attr_ff_stats =
+	__ATTR(stats, 0444, ff_stats_show, NULL);
+
+static struct attribute *msi_ff_attrs[] = {
+	&dev_attr_ff_mode.attr,
+	&dev_attr_ff_action.attr,
+	&dev_attr_ff_threshold.attr,
+	&dev_attr_ff_sustain_ms.attr,
+	&dev_attr_ff_hold_max_ms.attr,
+	&dev_attr_ff_handoff_temperature.attr,
+	&dev_attr_ff_throttle_temperature.attr,
+	&dev_attr_ff_period_ms.attr,
+	&dev_attr_ff_stats.attr,
+	NULL,
+};
+
+static const struct attribute_group msi_ff_group = {
+	.name = "feedforward",
+	.attrs = msi_ff_attrs,
+};
+
+// ============================================================ //
+// Energy accounting
+// ============================================================ //
+
+/*
+ * While the battery discharges, the energy worker integrates its power draw
+ * per active preset and per shift mode. Each sample attributes the power
+ * measured at the previous sample to the modes active at that time.
+ */
+
+enum {
+	ENERGY_SHIFT_OVERCLOCK,
+	ENERGY_SHIFT_BALANCED,
+	ENERGY_SHIFT_ECO,
+	ENERGY_SHIFT_OFF,
+	ENERGY_SHIFT_UNKNOWN,
+	ENERGY_SHIFT_COUNT,
+};
+
+static const char *const energy_shift_names[] = {
+	[ENERGY_SHIFT_OVERCLOCK] = "overclock",
+	[ENERGY_SHIFT_BALANCED] = "balanced",
+	[ENERGY_SHIFT_ECO] = "eco",
+	[ENERGY_SHIFT_OFF] = "off",
+	[ENERGY_SHIFT_UNKNOWN] = "unknown",
+};
+
+/* The known presets, followed by "custom" */
+#define ENERGY_PRESET_COUNT (ARRAY_SIZE(MSI_EC_PRESET_VALUE_TABLE) + 1)
+
+struct energy_bucket {
+	u64 energy_nj;
+	u64 time_ms;
+};
+
+/* The buckets are under the energy worker's lock */
+struct ec_energy {
+	struct energy_bucket presets[ENERGY_PRESET_COUNT];
+	struct energy_bucket shift_modes[ENERGY_SHIFT_COUNT];
+
+	/* Previous sample, only touched by the worker */
+	struct {
+		bool valid;
+		ktime_t time;
+		u32 power_uw;
+		int preset;
+		int shift_mode;
+	} last;
+};
+
+static int energy_shift_index(u8 value)
+{
+	switch (value) {
+	case MSI_EC_SHIFT_MODE_OVERCLOCK:
+		return ENERGY_SHIFT_OVERCLOCK;
+	case MSI_EC_SHIFT_MODE_BALANCED:
+		return ENERGY_SHIFT_BALANCED;
+	case MSI_EC_SHIFT_MODE_ECO:
+		return ENERGY_SHIFT_ECO;
+	case MSI_EC_SHIFT_MODE_OFF:
+		return ENERGY_SHIFT_OFF;
+	default:
+		return ENERGY_SHIFT_UNKNOWN;
+	}
+}
+
+/* Reads the discharge power in microwatts; fails unless discharging */
+static int energy_read_power(u32 *power_uw)
+{
+	union power_supply_propval status, power, current_now, voltage;
+	struct power_supply *battery;
+	int result;
+
+	battery = power_supply_get_by_name(MSI_EC_BATTERY_NAME);
+	if (!battery)
+		return -ENODEV;
+
+	result = power_supply_get_property(battery, POWER_SUPPLY_PROP_STATUS,
+					   &status);
+	if (result == 0 && status.intval != POWER_SUPPLY_STATUS_DISCHARGING)
+		result = -EAGAIN;
+	if (result < 0)
+		goto out;
+
+	/* Batteries without power_now report current and voltage */
+	result = power_supply_get_property(battery,
+					   POWER_SUPPLY_PROP_POWER_NOW, &power);
+	if (result == 0) {
+		*power_uw = abs(power.intval);
+		goto out;
+	}
+
+	result = power_supply_get_property(battery,
+					   POWER_SUPPLY_PROP_CURRENT_NOW,
+					   &current_now);
+	if (result == 0)
+		result = power_supply_get_property(battery,
+						   POWER_SUPPLY_PROP_VOLTAGE_NOW,
+						   &voltage);
+	if (result == 0)
+		*power_uw = div_u64((u64)abs(current_now.intval) *
+					    abs(voltage.intval),
+				    USEC_PER_SEC);
+
+out:
+	power_supply_put(battery);
+	return result;
+}
+
+static int energy_read_modes(struct msi_ec_dev *ec, int *preset,
+			     int *shift_mode)
+{
+	u8 values[ARRAY_SIZE(MSI_EC_PRESET_MEMORY_TABLE)];
+	struct msi_ec_config cfg;
+	u8 rdata;
+	int result;
+	int c;
+
+	config_get(ec, &cfg);
+	for (c = 0; c < ARRAY_SIZE(cfg.preset_regs); c++) {
+		result = ec_read_cached(ec, cfg.preset_regs[c], &values[c]);
+		if (result < 0)
+			return result;
+	}
+
+	result = ec_read_cached(ec, MSI_EC_SHIFT_MODE_ADDRESS, &rdata);
+	if (result < 0)
+		return result;
+
+	*preset = preset_match(&cfg, values);
+	if (*preset < 0)
+		*preset = ENERGY_PRESET_COUNT - 1;
+	*shift_mode = energy_shift_index(rdata);
+
+	return 0;
+}
+
+static void energy_account(struct energy_bucket *bucket, u32 power_uw,
+			   u64 time_ms)
+{
+	/* uW * ms = nJ */
+	bucket->energy_nj += (u64)power_uw * time_ms;
+	bucket->time_ms += time_ms;
+}
+
+static void energy_work_fn(struct work_struct *work)
+{
+	struct msi_ec_dev *ec = worker_ec(work);
+	struct ec_worker *worker = &ec->workers[WORKER_ENERGY];
+	struct ec_energy *energy = ec->energy;
+	unsigned int interval = READ_ONCE(worker->interval_ms);
+	ktime_t now = ktime_get();
+	u64 elapsed_ms;
+	u32 power_uw;
+	int preset, shift_mode;
+
+	if (!interval)
+		return;
+	/* The next round accounts for the skipped one */
+	if (ec_budget_defer(ec))
+		goto requeue;
+
+	if (energy->last.valid) {
+		elapsed_ms = ktime_to_ms(ktime_sub(now, energy->last.time));
+
+		/* A stalled worker would attribute a long gap to one sample */
+		if (elapsed_ms <= 4 * (u64)interval) {
+			mutex_lock(&worker->lock);
+			energy_account(&energy->presets[energy->last.preset],
+				       energy->last.power_uw, elapsed_ms);
+			energy_account(&energy->shift_modes[energy->last.shift_mode],
+				       energy->last.power_uw, elapsed_ms);
+			mutex_unlock(&worker->lock);
+		}
+	}
+
+	energy->last.valid = energy_read_power(&power_uw) == 0 &&
+			     energy_read_modes(ec, &preset, &shift_mode) == 0;
+	if (energy->last.valid) {
+		energy->last.time = now;
+		energy->last.power_uw = power_uw;
+		energy->last.preset = preset;
+		energy->last.shift_mode = shift_mode;
+	}
+
+requeue:
+	queue_delayed_work(system_freezable_wq, &worker->work,
+			   msecs_to_jiffies(interval));
+}
+
+static void energy_start(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_ENERGY];
+
+	mutex_lock(&worker->lock);
+	INIT_DELAYED_WORK(&worker->work, energy_work_fn);
+	ec->energy->last.valid = FALSE;
+	worker->ready = TRUE;
+	queue_delayed_work(system_freezable_wq, &worker->work, 0);
+	mutex_unlock(&worker->lock);
+}
+
+static void energy_stop(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_ENERGY];
+
+	mutex_lock(&worker->lock);
+	worker->ready = FALSE;
+	mutex_unlock(&worker->lock);
+	cancel_delayed_work_sync(&worker->work);
+}
+
+/* One "name seconds joules average_watts" line per bucket */
+static ssize_t energy_format(struct msi_ec_dev *ec, char *buf,
+			     const struct energy_bucket *buckets,
+			     const char *const *names, int count)
+{
+	u64 average_mw, watts;
+	u32 milliwatts;
+	int len = 0;
+	int i;
+
+	mutex_lock(&ec->workers[WORKER_ENERGY].lock);
+	for (i = 0; i < count; i++) {
+		average_mw = buckets[i].time_ms ?
+			div64_u64(buckets[i].energy_nj, buckets[i].time_ms * 1000) :
+			0;
+		watts = div_u64_rem(average_mw, 1000, &milliwatts);
+		len += sysfs_emit_at(buf, len, "%s %llu %llu %llu.%03u\n",
+				     names[i], div_u64(buckets[i].time_ms, 1000),
+				     div_u64(buckets[i].energy_nj, NSEC_PER_SEC),
+				     watts, milliwatts);
+	}
+	mutex_unlock(&ec->workers[WORKER_ENERGY].lock);
+
+	return len;
+}
+
+static ssize_t energy_presets_show(struct device *device,
+				   struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	const char *names[ENERGY_PRESET_COUNT];
+	int i;
+
+	for (i = 0; i < ENERGY_PRESET_COUNT; i++)
+		names[i] = preset_name(i < ENERGY_PRESET_COUNT - 1 ? i : -1);
+
+	return energy_format(ec, buf, ec->energy->presets, names,
+			     ENERGY_PRESET_COUNT);
+}
+
+static ssize_t energy_shift_modes_show(struct device *device,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+
+	return energy_format(ec, buf, ec->energy->shift_modes,
+			     energy_shift_names, ENERGY_SHIFT_COUNT);
+}
+
+static ssize_t energy_reset_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+
+	mutex_lock(&ec->workers[WORKER_ENERGY].lock);
+	memset(ec->energy->presets, 0, sizeof(ec->energy->presets));
+	memset(ec->energy->shift_modes, 0, sizeof(ec->energy->shift_modes));
+	mutex_unlock(&ec->workers[WORKER_ENERGY].lock);
+
+	return count;
+}
+
+static struct device_attribute dev_attr_energy_presets =
+	__ATTR(presets, 0444, energy_presets_show, NULL);
+static struct device_attribute dev_attr_energy_shift_modes =
+	__ATTR(shift_modes, 0444, energy_shift_modes_show, NULL);
+static struct device_attribute dev_attr_energy_reset =
+	__ATTR(reset, 0200, NULL, energy_reset_store);
+
+static struct attribute *msi_energy_attrs[] = {
+	&dev_attr_energy_presets.attr,
+	&dev_attr_energy_shift_modes.attr,
+	&dev_attr_energy_reset.attr,
+	NULL,
+};
+
+static const struct attribute_group msi_energy_group = {
+	.name = "energy",
+	.attrs = msi_energy_attrs,
+};
+
+// ============================================================ //
+// Policy hook
+// ============================================================ //
+
+/*
+ * With policy_interval_ms set, the policy worker builds a sample from the
+ * snapshot registers and asks msi_ec_policy_decide() for a decision. The
+ * built-in hook never decides anything. BPF programs attached with fmod_ret
+ * replace its return value, which gives custom control loops without a
+ * userspace round trip. The decision becomes another floor of the arbiter,
+ * so a policy cannot drop below the leases or the user's own settings, and
+ * is written only when it changes.
+ */
+
+int msi_ec_policy_decide(const struct msi_ec_policy_sample *sample);
+
+/* Stable attach point for fmod_ret programs, keep the signature unchanged */
+noinline int msi_ec_policy_decide(const struct msi_ec_policy_sample *sample)
+{
+	int decision = MSI_EC_POLICY_NONE;
+
+	/* Keeps the default result from being folded into the caller */
+	OPTIMIZER_HIDE_VAR(decision);
+	return decision;
+}
+ALLOW_ERROR_INJECTION(msi_ec_policy_decide, TRUE);
+
+static void policy_sample(struct msi_ec_dev *ec,
+			  const struct msi_ec_snapshot *snap,
+			  struct msi_ec_policy_sample *sample)
+{
+	const u8 *regs = snap->regs;
+	int fan_speed;
+
+	memset(sample, 0, sizeof(*sample));
+	sample->timestamp_ns = ktime_get_ns();
+	sample->cpu_temperature = regs[MSI_EC_CPU_REALTIME_TEMPERATURE_ADDRESS];
+	sample->cpu_fan_rpm = snapshot_u16(snap,
+					   MSI_EC_CPU_REALTIME_FAN_RPM_ADDRESS);
+	fan_speed = cpu_fan_speed(ec,
+				  regs[MSI_EC_CPU_REALTIME_FAN_SPEED_ADDRESS],
+				  sample->cpu_fan_rpm);
+	sample->cpu_fan_speed = max(fan_speed, 0);
+	if (ec->has_dgpu) {
+		sample->gpu_temperature =
+			regs[MSI_EC_GPU_REALTIME_TEMPERATURE_ADDRESS];
+		sample->gpu_fan_rpm = snapshot_u16(snap,
+				MSI_EC_GPU_REALTIME_FAN_RPM_ADDRESS);
+	}
+	sample->ac_connected = is_bit_set(MSI_EC_POWER_AC_CONNECTED_BIT,
+					  regs[MSI_EC_POWER_ADDRESS]);
+	sample->shift_mode = shift_mode_level(regs[MSI_EC_SHIFT_MODE_ADDRESS]);
+	sample->fan_mode = fan_mode_level(regs[MSI_EC_FAN_MODE_ADDRESS]);
+	sample->cooler_boost = is_bit_set(MSI_EC_COOLER_BOOST_BIT,
+					  regs[MSI_EC_COOLER_BOOST_ADDRESS]);
+	sample->decisions = atomic64_read(&ec->policy_stats.decisions);
+}
+
+/* Decodes a hook result; returns FALSE for results that are not decisions */
+static bool policy_decode(int decision, struct msi_ec_lease *floor)
+{
+	memset(floor, 0, sizeof(*floor));
+	if (decision == MSI_EC_POLICY_NONE)
+		return TRUE;
+	if (decision < 0 || (decision >> 24) != 1)
+		return FALSE;
+
+	floor->shift_mode = decision & 0xff;
+	floor->fan_mode = (decision >> 8) & 0xff;
+	floor->flags = (decision >> 16) & 0xff;
+
+	return floor->shift_mode <= MSI_EC_LEASE_SHIFT_OVERCLOCK &&
+	       floor->fan_mode <= MSI_EC_LEASE_FAN_ADVANCED &&
+	       !(floor->flags & ~MSI_EC_LEASE_COOLER_BOOST);
+}
+
+static void policy_set_floor(struct msi_ec_dev *ec,
+			     const struct msi_ec_lease *floor)
+{
+	int result = 0;
+
+	mutex_lock(&ec->arbiter->lock);
+	if (memcmp(&ec->arbiter->policy, floor, sizeof(*floor))) {
+		ec->arbiter->policy = *floor;
+		result = arbiter_apply(ec, JOURNAL_POLICY);
+	}
+	mutex_unlock(&ec->arbiter->lock);
+
+	if (result < 0)
+		pr_err("msi-ec: policy: failed to apply the decision "
+		       "(error code %i)",
+		       result);
+}
+
+static void policy_work_fn(struct work_struct *work)
+{
+	struct msi_ec_dev *ec = worker_ec(work);
+	struct ec_worker *worker = &ec->workers[WORKER_POLICY];
+	unsigned int interval = READ_ONCE(worker->interval_ms);
+	struct msi_ec_policy_sample sample;
+	struct msi_ec_snapshot *snap;
+	struct msi_ec_lease floor;
+	int decision;
+
+	if (!interval) {
+		memset(&floor, 0, sizeof(floor));
+		policy_set_floor(ec, &floor);
+		return;
+	}
+	/* The floor of the last decision stays in place */
+	if (ec_budget_defer(ec))
+		goto requeue;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (snap && snapshot_read(ec, snap, TRUE) == 0) {
+		policy_sample(ec, snap, &sample);
+		decision = msi_ec_policy_decide(&sample);
+		atomic64_inc(&ec->policy_stats.runs);
+
+		if (!policy_decode(decision, &floor)) {
+			atomic64_inc(&ec->policy_stats.rejected);
+			pr_warn_ratelimited("msi-ec: policy: invalid decision %#x\n",
+					    decision);
+		} else {
+			if (decision != MSI_EC_POLICY_NONE)
+				atomic64_inc(&ec->policy_stats.decisions);
+			policy_set_floor(ec, &floor);
+		}
+	}
+	kfree(snap);
+
+requeue:
+	queue_delayed_work(system_freezable_wq, &worker->work,
+			   msecs_to_jiffies(interval));
+}
+
+static void policy_start(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_POLICY];
+
+	mutex_lock(&worker->lock);
+	INIT_DELAYED_WORK(&worker->work, policy_work_fn);
+	worker->ready = TRUE;
+	queue_delayed_work(system_freezable_wq, &worker->work, 0);
+	mutex_unlock(&worker->lock);
+}
+
+static void policy_stop(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_POLICY];
+	struct msi_ec_lease floor;
+
+	mutex_lock(&worker->lock);
+	worker->ready = FALSE;
+	mutex_unlock(&worker->lock);
+	cancel_delayed_work_sync(&worker->work);
+
+	memset(&floor, 0, sizeof(floor));
+	policy_set_floor(ec, &floor);
+}
+
+static ssize_t policy_stats_show(struct device *device,
+				 struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	struct msi_ec_lease floor;
+
+	mutex_lock(&ec->arbiter->lock);
+	floor = ec->arbiter->policy;
+	mutex_unlock(&ec->arbiter->lock);
+
+	return sprintf(buf,
+		       "runs %lld\n"
+		       "decisions %lld\n"
+		       "rejected %lld\n"
+		       "shift_mode %u\n"
+		       "fan_mode %u\n"
+		       "cooler_boost %i\n",
+		       atomic64_read(&ec->policy_stats.runs),
+		       atomic64_read(&ec->policy_stats.decisions),
+		       atomic64_read(&ec->policy_stats.rejected),
+		       floor.shift_mode, floor.fan_mode,
+		       !!(floor.flags & MSI_EC_LEASE_COOLER_BOOST));
+}
+
+static struct device_attribute dev_attr_policy_stats =
+	__ATTR(stats, 0444, policy_stats_show, NULL);
+
+static struct attribute *msi_policy_attrs[] = {
+	&dev_attr_policy_stats.attr,
+	NULL,
+};
+
+static const struct attribute_group msi_policy_group = {
+	.name = "policy",
+	.attrs = msi_policy_attrs,
+};
+
+// ============================================================ //
+// Flight recorder
+// ============================================================ //
+
+/*
+ * With flight_recorder_interval_ms set, the recorder samples temperatures,
+ * fans and modes and keeps the last FR_RECORDS distinct states in a ring, so
+ * steady periods cost no space. The ring is printed to the kernel log on
+ * panic, on shutdown or reboot while hot, and when the temperature crosses
+ * critical_temperature. With ramoops configured, pstore keeps the log (and
+ * with it the record) across the reboot.
+ */
+
+#define FR_RECORDS 256
+/*
+ * Degrees below critical_temperature before a new crossing flushes again;
+ * a temperature hovering at the threshold would flood the log otherwise
+ */
+#define FR_HOT_HYSTERESIS 5
+
+#define FR_MODE_SHIFT_MASK 0x3
+#define FR_MODE_FAN_SHIFT 2
+#define FR_MODE_FAN_MASK 0x3
+#define FR_MODE_COOLER_BOOST BIT(4)
+#define FR_MODE_AC BIT(5)
+
+struct fr_record {
+	u64 time_ns;
+	u16 cpu_fan_rpm;
+	u8 cpu_temperature;
+	u8 gpu_temperature;
+	u8 cpu_fan_speed;
+	u8 modes;
+};
+
+struct ec_fr {
+	struct msi_ec_dev *ec;
+	spinlock_t ring_lock;
+	unsigned int critical_temperature;
+	bool hot;
+
+	struct fr_record ring[FR_RECORDS];
+	unsigned int head; /* next slot */
+	unsigned int count;
+
+	struct notifier_block panic_nb;
+	struct notifier_block reboot_nb;
+};
+
+static const char fr_shift_codes[] = "-EBO";
+static const char fr_fan_codes[] = "-AX";
+
+static bool fr_same(const struct fr_record *a, const struct fr_record *b)
+{
+	return a->cpu_fan_rpm == b->cpu_fan_rpm &&
+	       a->cpu_temperature == b->cpu_temperature &&
+	       a->gpu_temperature == b->gpu_temperature &&
+	       a->cpu_fan_speed == b->cpu_fan_speed && a->modes == b->modes;
+}
+
+static void fr_record_sample(struct msi_ec_dev *ec,
+			     const struct msi_ec_policy_sample *sample)
+{
+	struct fr_record record = {
+		.cpu_fan_rpm = sample->cpu_fan_rpm,
+		.cpu_temperature = sample->cpu_temperature,
+		.gpu_temperature = sample->gpu_temperature,
+		.cpu_fan_speed = sample->cpu_fan_speed,
+		.modes = (sample->shift_mode & FR_MODE_SHIFT_MASK) |
+			 ((sample->fan_mode & FR_MODE_FAN_MASK)
+			  << FR_MODE_FAN_SHIFT) |
+			 (sample->cooler_boost ? FR_MODE_COOLER_BOOST : 0) |
+			 (sample->ac_connected ? FR_MODE_AC : 0),
+	};
+	struct fr_record *last;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ec->fr->ring_lock, flags);
+	last = &ec->fr->ring[(ec->fr->head + FR_RECORDS - 1) % FR_RECORDS];
+	/* Only changes are recorded; the time of a record is its first sample */
+	if (!ec->fr->count || !fr_same(last, &record)) {
+		record.time_ns = ktime_get_mono_fast_ns();
+		ec->fr->ring[ec->fr->head] = record;
+		ec->fr->head = (ec->fr->head + 1) % FR_RECORDS;
+		ec->fr->count = min(ec->fr->count + 1, FR_RECORDS);
+	}
+	spin_unlock_irqrestore(&ec->fr->ring_lock, flags);
+}
+
+/* Formats a record relative to now, like "-12.500 c85 g70 f60 r4200 sB fA b1 a1" */
+static int fr_format(char *buf, size_t size, const struct fr_record *record,
+		     u64 now)
+{
+	u64 age_ms = div_u64(now - min(record->time_ns, now), NSEC_PER_MSEC);
+	u32 age_rem;
+	u64 age_s = div_u64_rem(age_ms, 1000, &age_rem);
+
+	return scnprintf(buf, size, "-%llu.%03u c%u g%u f%u r%u s%c f%c b%i a%i",
+			 age_s, age_rem, record->cpu_temperature,
+			 record->gpu_temperature, record->cpu_fan_speed,
+			 record->cpu_fan_rpm,
+			 fr_shift_codes[record->modes & FR_MODE_SHIFT_MASK],
+			 fr_fan_codes[min((record->modes >> FR_MODE_FAN_SHIFT) &
+					  FR_MODE_FAN_MASK, 2)],
+			 !!(record->modes & FR_MODE_COOLER_BOOST),
+			 !!(record->modes & FR_MODE_AC));
+}
+
+/*
+ * Prints the ring to the kernel log, oldest first. Also called from the panic
+ * notifier, where the ring lock may be held by a stopped CPU: the ring is then
+ * printed without it.
+ */
+static void fr_flush(struct msi_ec_dev *ec, const char *reason,
+		     bool panicking)
+{
+	char line[64];
+	unsigned long flags;
+	unsigned int i, count, start;
+	bool locked = TRUE;
+	u64 now = ktime_get_mono_fast_ns();
+
+	if (panicking)
+		locked = spin_trylock_irqsave(&ec->fr->ring_lock, flags);
+	else
+		spin_lock_irqsave(&ec->fr->ring_lock, flags);
+
+	count = ec->fr->count;
+	start = (ec->fr->head + FR_RECORDS - count) % FR_RECORDS;
+	if (count) {
+		pr_warn("msi-ec: %s: flight recorder (%s), %u records, oldest first\n",
+			dev_name(&ec->pdev->dev), reason, count);
+		for (i = 0; i < count; i++) {
+			fr_format(line, sizeof(line),
+				  &ec->fr->ring[(start + i) % FR_RECORDS], now);
+			pr_warn("msi-ec: fr %s\n", line);
+		}
+	}
+
+	if (locked)
+		spin_unlock_irqrestore(&ec->fr->ring_lock, flags);
+}
+
+static void fr_work_fn(struct work_struct *work)
+{
+	struct msi_ec_dev *ec = worker_ec(work);
+	struct ec_worker *worker = &ec->workers[WORKER_FLIGHT_RECORDER];
+	unsigned int interval = READ_ONCE(worker->interval_ms);
+	struct msi_ec_policy_sample sample;
+	struct msi_ec_snapshot *snap;
+	unsigned int critical, temperature;
+
+	if (!interval)
+		return;
+	if (ec_budget_defer(ec))
+		goto requeue;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (snap && snapshot_read(ec, snap, TRUE) == 0) {
+		policy_sample(ec, snap, &sample);
+		fr_record_sample(ec, &sample);
+
+		critical = READ_ONCE(ec->fr->critical_temperature);
+		temperature = max(sample.cpu_temperature,
+				  sample.gpu_temperature);
+		if (temperature >= critical && !ec->fr->hot) {
+			fr_flush(ec, "critical temperature", FALSE);
+			WRITE_ONCE(ec->fr->hot, TRUE);
+		} else if (temperature + FR_HOT_HYSTERESIS < critical) {
+			WRITE_ONCE(ec->fr->hot, FALSE);
+		}
+	}
+	kfree(snap);
+
+requeue:
+	queue_delayed_work(system_freezable_wq, &worker->work,
+			   msecs_to_jiffies(interval));
+}
+
+static int fr_panic_notify(struct notifier_block *nb, unsigned long event,
+			   void *data)
+{
+	struct ec_fr *fr = container_of(nb, struct ec_fr, panic_nb);
+
+	fr_flush(fr->ec, "panic", TRUE);
+	return NOTIFY_DONE;
+}
+
+/* Orderly and thermal shutdowns alike; only hot ones are of interest */
+static int fr_reboot_notify(struct notifier_block *nb, unsigned long event,
+			    void *data)
+{
+	struct ec_fr *fr = container_of(nb, struct ec_fr, reboot_nb);
+
+	if (READ_ONCE(fr->hot))
+		fr_flush(fr->ec, event == SYS_RESTART ? "restart" : "shutdown",
+			 FALSE);
+	return NOTIFY_DONE;
+}
+
+static void fr_init(struct msi_ec_dev *ec)
+{
+	struct ec_fr *fr = ec->fr;
+
+	fr->ec = ec;
+	spin_lock_init(&fr->ring_lock);
+	fr->critical_temperature = 95;
+	fr->panic_nb.notifier_call = fr_panic_notify;
+	fr->reboot_nb.notifier_call = fr_reboot_notify;
+}
+
+static void fr_start(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_FLIGHT_RECORDER];
+
+	atomic_notifier_chain_register(&panic_notifier_list, &ec->fr->panic_nb);
+	register_reboot_notifier(&ec->fr->reboot_nb);
+
+	mutex_lock(&worker->lock);
+	INIT_DELAYED_WORK(&worker->work, fr_work_fn);
+	worker->ready = TRUE;
+	queue_delayed_work(system_freezable_wq, &worker->work, 0);
+	mutex_unlock(&worker->lock);
+}
+
+static void fr_stop(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_FLIGHT_RECORDER];
+
+	mutex_lock(&worker->lock);
+	worker->ready = FALSE;
+	mutex_unlock(&worker->lock);
+	cancel_delayed_work_sync(&worker->work);
+
+	unregister_reboot_notifier(&ec->fr->reboot_nb);
+	atomic_notifier_chain_unregister(&panic_notifier_list,
+					 &ec->fr->panic_nb);
+}
+
+static ssize_t fr_records_show(struct device *device,
+			       struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	char line[64];
+	unsigned long flags;
+	unsigned int i, count, start;
+	u64 now = ktime_get_mono_fast_ns();
+	struct fr_record *records;
+	int len = 0;
+
+	records = kmalloc_array(FR_RECORDS, sizeof(*records), GFP_KERNEL);
+	if (!records)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&ec->fr->ring_lock, flags);
+	count = ec->fr->count;
+	start = (ec->fr->head + FR_RECORDS - count) % FR_RECORDS;
+	for (i = 0; i < count; i++)
+		records[i] = ec->fr->ring[(start + i) % FR_RECORDS];
+	spin_unlock_irqrestore(&ec->fr->ring_lock, flags);
+
+	for (i = 0; i < count; i++) {
+		fr_format(line, sizeof(line), &records[i], now);
+		len += sysfs_emit_at(buf, len, "%s\n", line);
+	}
+
+	kfree(records);
+	return len;
+}
+
+static ssize_t fr_critical_temperature_show(struct device *device,
+					    struct device_attribute *attr,
+					    char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+
+	return sprintf(buf, "%u\n", READ_ONCE(ec->fr->critical_temperature));
+}
+
+static ssize_t fr_critical_temperature_store(struct device *dev,
+					     struct device_attribute *attr,
+					     const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	unsigned int value;
+	int result;
+
+	result = kstrtouint(buf, 10, &value);
+	if (result < 0)
+		return result;
+	if (value < 50 || value > 110)
+		return -EINVAL;
+
+	WRITE_ONCE(ec->fr->critical_temperature, value);
+	return count;
+}
+
+static ssize_t fr_flush_store(struct device *dev,
+			      struct device_attribute *attr, const char *buf,
+			      size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+
+	fr_flush(ec, "requested", FALSE);
+	return count;
+}
+
+static struct device_attribute dev_attr_fr_records =
+	__ATTR(records, 0444, fr_records_show, NULL);
+static struct device_attribute dev_attr_fr_critical_temperature =
+	__ATTR(critical_temperature, 0644, fr_critical_temperature_show,
+	       fr_critical_temperature_store);
+static struct device_attribute dev_attr_fr_flush =
+	__ATTR(flush, 0200, NULL, fr_flush_store);
+
+static struct attribute *msi_fr_attrs[] = {
+	&dev_attr_fr_records.attr,
+	&dev_attr_fr_critical_temperature.attr,
+	&dev_attr_fr_flush.attr,
+	NULL,
+};
+
+static const struct attribute_group msi_fr_group = {
+	.name = "flight_recorder",
+	.attrs = msi_fr_attrs,
+};
+
+// ============================================================ //
+// Fan guard
+// ============================================================ //
+
+/*
+ * With fan_guard_interval_ms set, the guard keeps the last GUARD_WINDOW
+ * samples of every fan and looks for
+ *   fan_stall        0 RPM throughout while the temperature climbs past the
+ *                    first step of the fan curve
+ *   fan_stuck        a raw speed that never changes and stays below what the
+ *                    curve demands while the temperature climbs
+ *   thermal_runaway  the temperature climbing faster than runaway_rate past
+ *                    the top step of the curve
+ * An incident is counted, raises a change uevent and engages the fallback:
+ * cooler boost on and the eco shift mode, which overrides every floor of the
+ * arbiter. The fallback stays engaged until it is cleared, so a dying fan
+ * cannot go unnoticed as mere throttling.
+ *
+ * A fan calibration stops the fans on purpose, so the guard discards its
+ * samples while one runs; the calibration has its own temperature limit.
+ */
+
+#define GUARD_WINDOW 8
+#define GUARD_RISE 5 /* celsius over the window */
+
+enum guard_reason {
+	GUARD_NONE,
+	GUARD_STALL,
+	GUARD_STUCK,
+	GUARD_RUNAWAY,
+	GUARD_REASONS,
+};
+
+static const char *const guard_reason_names[] = {
+	[GUARD_NONE] = "none",
+	[GUARD_STALL] = "fan_stall",
+	[GUARD_STUCK] = "fan_stuck",
+	[GUARD_RUNAWAY] = "thermal_runaway",
+};
+
+static const struct {
+	const char *name;
+	u8 temperature;
+	u8 speed;
+	u8 curve_temperature;
+	u8 curve_speed;
+} guard_fans[FAN_COUNT] = {
+	[FAN_CPU] = { "cpu", MSI_EC_CPU_REALTIME_TEMPERATURE_ADDRESS,
+		      MSI_EC_CPU_REALTIME_FAN_SPEED_ADDRESS,
+		      MSI_EC_CPU_FAN_CURVE_TEMPERATURE_ADDRESS,
+		      MSI_EC_CPU_FAN_CURVE_SPEED_ADDRESS },
+	[FAN_GPU] = { "gpu", MSI_EC_GPU_REALTIME_TEMPERATURE_ADDRESS,
+		      MSI_EC_GPU_REALTIME_FAN_SPEED_ADDRESS,
+		      MSI_EC_GPU_FAN_CURVE_TEMPERATURE_ADDRESS,
+		      MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS },
+};
+
+struct guard_sample {
+	u64 time_ns;
+	u16 rpm;
+	u8 temperature;
+	u8 raw; /* as read from the speed register */
+	u8 percent;
+};
+
+struct ec_guard {
+	unsigned int runaway_rate; /* celsius per minute */
+
+	/* Only touched by the worker */
+	struct guard_sample history[FAN_COUNT][GUARD_WINDOW];
+	unsigned int head; /* next slot */
+	unsigned int count;
+
+	/* Engaged incident, under the arbiter lock */
+	struct {
+		u8 reason;
+		u8 fan;
+		u8 temperature;
+	} incident;
+
+	atomic64_t incidents[GUARD_REASONS];
+};
+
+/* Speed of the highest curve step at or below the temperature, in percent */
+static u8 guard_curve_speed(const u8 *regs, int fan, u8 temperature)
+{
+	u8 speed = 0;
+	int i;
+
+	/* The last point is unused by the firmware */
+	for (i = 0; i < MSI_EC_FAN_CURVE_LENGTH - 1; i++) {
+		if (temperature >= regs[guard_fans[fan].curve_temperature + i])
+			speed = regs[guard_fans[fan].curve_speed + i];
+	}
+	return speed;
+}
+
+static enum guard_reason guard_check(struct msi_ec_dev *ec,
+				     const struct msi_ec_snapshot *snap,
+				     int fan)
+{
+	const struct guard_sample *history = ec->guard->history[fan];
+	const struct guard_sample *oldest = &history[ec->guard->head];
+	const struct guard_sample *newest =
+		&history[(ec->guard->head + GUARD_WINDOW - 1) % GUARD_WINDOW];
+	const u8 *regs = snap->regs;
+	u8 first_step = regs[guard_fans[fan].curve_temperature];
+	u8 top_step = regs[guard_fans[fan].curve_temperature +
+			   MSI_EC_FAN_CURVE_LENGTH - 2];
+	int rise = newest->temperature - oldest->temperature;
+	u64 elapsed_ns = newest->time_ns - oldest->time_ns;
+	bool stalled = TRUE, stuck = TRUE;
+	int i;
+
+	if (rise < GUARD_RISE || !elapsed_ns)
+		return GUARD_NONE;
+
+	for (i = 0; i < GUARD_WINDOW; i++) {
+		stalled = stalled && history[i].rpm == 0;
+		stuck = stuck && history[i].raw == newest->raw;
+	}
+
+	if (stalled && newest->temperature >= first_step)
+		return GUARD_STALL;
+	/* Silent mode caps the speed below the curve on purpose */
+	if (stuck &&
+	    !is_bit_set(MSI_EC_FAN_MODE_SILENT_BIT,
+			regs[MSI_EC_FAN_MODE_ADDRESS]) &&
+	    newest->percent <
+		    guard_curve_speed(regs, fan, newest->temperature))
+		return GUARD_STUCK;
+	if (newest->temperature >= top_step &&
+	    div64_u64((u64)rise * 60 * NSEC_PER_SEC, elapsed_ns) >=
+		    READ_ONCE(ec->guard->runaway_rate))
+		return GUARD_RUNAWAY;
+
+	return GUARD_NONE;
+}
+
+static void guard_record(struct msi_ec_dev *ec,
+			 const struct msi_ec_snapshot *snap, int fan, u64 now)
+{
+	const u8 *regs = snap->regs;
+	struct guard_sample *sample = &ec->guard->history[fan][ec->guard->head];
+	int percent;
+
+	sample->time_ns = now;
+	sample->rpm = snapshot_u16(snap, fan_rpm_addrs[fan]);
+	sample->temperature = regs[guard_fans[fan].temperature];
+	sample->raw = regs[guard_fans[fan].speed];
+	if (fan == FAN_CPU)
+		percent = cpu_fan_speed(ec, sample->raw, sample->rpm);
+	else
+		percent = gpu_fan_speed(ec, sample->raw, sample->rpm);
+	sample->percent = clamp(percent, 0, 100);
+}
+
+/* Engages the fallback for an incident unless one is engaged already */
+static void guard_engage(struct msi_ec_dev *ec, enum guard_reason reason,
+			 int fan, u8 temperature)
+{
+	char event[32], fan_env[16], temperature_env[32];
+	char *envp[] = { event, fan_env, temperature_env, NULL };
+	int result;
+
+	mutex_lock(&ec->arbiter->lock);
+	if (ec->guard->incident.reason != GUARD_NONE) {
+		mutex_unlock(&ec->arbiter->lock);
+		return;
+	}
+	ec->guard->incident.reason = reason;
+	ec->guard->incident.fan = fan;
+	ec->guard->incident.temperature = temperature;
+	ec->arbiter->fallback = TRUE;
+	result = arbiter_apply(ec, JOURNAL_GUARD);
+	mutex_unlock(&ec->arbiter->lock);
+
+	atomic64_inc(&ec->guard->incidents[reason]);
+	pr_warn("msi-ec: %s: fan guard: %s on the %s fan at %u C, falling back to cooler boost and eco\n",
+		dev_name(&ec->pdev->dev), guard_reason_names[reason],
+		guard_fans[fan].name, temperature);
+	if (result < 0)
+		pr_err("msi-ec: fan guard: failed to engage the fallback "
+		       "(error code %i)",
+		       result);
+
+	snprintf(event, sizeof(event), "MSI_EC_EVENT=%s",
+		 guard_reason_names[reason]);
+	snprintf(fan_env, sizeof(fan_env), "MSI_EC_FAN=%s",
+		 guard_fans[fan].name);
+	snprintf(temperature_env, sizeof(temperature_env),
+		 "MSI_EC_TEMPERATURE=%u", temperature);
+	kobject_uevent_env(&ec->pdev->dev.kobj, KOBJ_CHANGE, envp);
+	sysfs_notify(&ec->pdev->dev.kobj, "fan_guard", "state");
+}
+
+static int guard_clear(struct msi_ec_dev *ec)
+{
+	int result = 0;
+
+	mutex_lock(&ec->arbiter->lock);
+	if (ec->guard->incident.reason != GUARD_NONE) {
+		ec->guard->incident.reason = GUARD_NONE;
+		ec->arbiter->fallback = FALSE;
+		result = arbiter_apply(ec, JOURNAL_GUARD);
+	}
+	mutex_unlock(&ec->arbiter->lock);
+
+	return result;
+}
+
+static void guard_work_fn(struct work_struct *work)
+{
+	struct msi_ec_dev *ec = worker_ec(work);
+	struct ec_worker *worker = &ec->workers[WORKER_FAN_GUARD];
+	unsigned int interval = READ_ONCE(worker->interval_ms);
+	struct msi_ec_snapshot *snap;
+	enum guard_reason reason;
+	u64 now = ktime_get_ns();
+	int fans = ec->has_dgpu ? FAN_COUNT : 1;
+	int fan;
+
+	if (!interval)
+		return;
+	if (READ_ONCE(ec->fans->cal_running)) {
+		ec->guard->count = 0;
+		goto requeue;
+	}
+	if (ec_budget_defer(ec))
+		goto requeue;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (snap && snapshot_read(ec, snap, TRUE) == 0) {
+		for (fan = 0; fan < fans; fan++)
+			guard_record(ec, snap, fan, now);
+		ec->guard->head = (ec->guard->head + 1) % GUARD_WINDOW;
+		ec->guard->count = min(ec->guard->count + 1, GUARD_WINDOW);
+
+		for (fan = 0; fan < fans && ec->guard->count == GUARD_WINDOW;
+		     fan++) {
+			reason = guard_check(ec, snap, fan);
+			if (reason == GUARD_NONE)
+				continue;
+			guard_engage(ec, reason, fan,
+				     snap->regs[guard_fans[fan].temperature]);
+			/* A new incident needs a full window of new samples */
+			ec->guard->count = 0;
+			break;
+		}
+	}
+	kfree(snap);
+
+requeue:
+	queue_delayed_work(system_freezable_wq, &worker->work,
+			   msecs_to_jiffies(interval));
+}
+
+static void guard_start(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_FAN_GUARD];
+
+	mutex_lock(&worker->lock);
+	INIT_DELAYED_WORK(&worker->work, guard_work_fn);
+	ec->guard->count = 0;
+	worker->ready = TRUE;
+	queue_delayed_work(system_freezable_wq, &worker->work, 0);
+	mutex_unlock(&worker->lock);
+}
+
+static void guard_stop(struct msi_ec_dev *ec)
+{
+	struct ec_worker *worker = &ec->workers[WORKER_FAN_GUARD];
+	int result;
+
+	mutex_lock(&worker->lock);
+	worker->ready = FALSE;
+	mutex_unlock(&worker->lock);
+	cancel_delayed_work_sync(&worker->work);
+
+	result = guard_clear(ec);
+	if (result < 0)
+		pr_err("msi-ec: fan guard: failed to release the fallback "
+		       "(error code %i)",
+		       result);
+}
+
+static ssize_t guard_state_show(struct device *device,
+				struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	ssize_t len;
+
+	mutex_lock(&ec->arbiter->lock);
+	if (ec->guard->incident.reason == GUARD_NONE)
+		len = sprintf(buf, "ok\n");
+	else
+		len = sprintf(buf, "engaged %s %s %u\n",
+			      guard_reason_names[ec->guard->incident.reason],
+			      guard_fans[ec->guard->incident.fan].name,
+			      ec->guard->incident.temperature);
+	mutex_unlock(&ec->arbiter->lock);
+
+	return len;
+}
+
+static ssize_t guard_state_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int result;
+
+	if (!streq(buf, "clear"))
+		return -EINVAL;
+
+	result = guard_clear(ec);
+	if (result < 0)
+		return result;
+
+	sysfs_notify(&dev->kobj, "fan_guard", "state");
+	return count;
+}
+
+static ssize_t guard_incidents_show(struct device *device,
+				    struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	int len = 0;
+	int i;
+
+	for (i = GUARD_NONE + 1; i < GUARD_REASONS; i++)
+		len += sysfs_emit_at(buf, len, "%s %lld\n",
+				     guard_reason_names[i],
+				     atomic64_read(&ec->guard->incidents[i]));
+	return len;
+}
+
+static ssize_t guard_runaway_rate_show(struct device *device,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+
+	return sprintf(buf, "%u\n", READ_ONCE(ec->guard->runaway_rate));
+}
+
+static ssize_t guard_runaway_rate_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	unsigned int value;
+	int result;
+
+	result = kstrtouint(buf, 10, &value);
+	if (result < 0)
+		return result;
+	if (value < 1 || value > 600)
+		return -EINVAL;
+
+	WRITE_ONCE(ec->guard->runaway_rate, value);
+	return count;
+}
+
+static struct device_attribute dev_attr_guard_state =
+	__ATTR(state, 0644, guard_state_show, guard_state_store);
+static struct device_attribute dev_attr_guard_incidents =
+	__ATTR(incidents, 0444, guard_incidents_show, NULL);
+static struct device_attribute dev_attr_guard_runaway_rate =
+	__ATTR(runaway_rate, 0644, guard_runaway_rate_show,
+	       guard_runaway_rate_store);
+
+static struct attribute *msi_guard_attrs[] = {
+	&dev_attr_guard_state.attr,
+	&dev_attr_guard_incidents.attr,
+	&dev_attr_guard_runaway_rate.attr,
+	NULL,
+};
+
+static const struct attribute_group msi_guard_group = {
+	.name = "fan_guard",
+	.attrs = msi_guard_attrs,
+};
+
+// ============================================================ //
+// Fan calibration
+// ============================================================ //
+
+/*
+ * The calibration switches to the advanced fan mode and flattens the fan
+ * curves to one level after the other, from 0 to 150 percent. At every
+ * level it waits for the RPM to settle (CAL_WINDOW readings within
+ * CAL_TOLERANCE_RPM of each other) and records their average; a level that
+ * doesn't settle within CAL_LEVEL_TIMEOUT_MS is recorded anyway and counted
+ * as unsettled. Afterwards, and on abort or failure, the curves and the fan
+ * mode are restored. Changing the fan mode while it runs fails it.
+ *
+ * The low levels barely cool, so the calibration doesn't start with the CPU
+ * (or the dGPU) at cal_max_temperature or above, and aborts once either
+ * reaches it.
+ */
+
+#define CAL_SPINUP_MS 2000
+#define CAL_POLL_MS 500
+#define CAL_LEVEL_TIMEOUT_MS 20000
+#define CAL_WINDOW 4
+#define CAL_TOLERANCE_RPM 50
+
+static const u8 cal_temperature_addrs[FAN_COUNT] = {
+	[FAN_CPU] = MSI_EC_CPU_REALTIME_TEMPERATURE_ADDRESS,
+	[FAN_GPU] = MSI_EC_GPU_REALTIME_TEMPERATURE_ADDRESS,
+};
+
+#define FAN_MODE_BITS                                                          \
+	(BIT(MSI_EC_FAN_MODE_SILENT_BIT) | BIT(MSI_EC_FAN_MODE_BASIC_BIT) |    \
+	 BIT(MSI_EC_FAN_MODE_ADVANCED_BIT))
+
+enum cal_state {
+	CAL_IDLE,
+	CAL_RUNNING,
+	CAL_DONE,
+	CAL_FAILED,
+	CAL_ABORTED,
+};
+
+static const u8 cal_curve_addrs[FAN_COUNT] = {
+	[FAN_CPU] = MSI_EC_CPU_FAN_CURVE_SPEED_ADDRESS,
+	[FAN_GPU] = MSI_EC_GPU_FAN_CURVE_SPEED_ADDRESS,
+};
+
+/* Under the device's cal_lock */
+struct ec_cal {
+	enum cal_state state;
+	int error; /* CAL_FAILED */
+	u8 hot; /* CAL_ABORTED by the temperature limit, 0 otherwise */
+	int fans; /* FAN_CPU only, or both with a dGPU */
+	int level;
+	unsigned long level_start;
+	unsigned int samples;
+	unsigned int unsettled;
+	u16 window[FAN_COUNT][CAL_WINDOW];
+	u16 rpm[FAN_COUNT][FAN_CAL_LEVELS];
+	u8 saved_fan_mode;
+	u8 saved_curves[FAN_COUNT][MSI_EC_FAN_CURVE_LENGTH];
+};
+
+static int cal_set_level(struct msi_ec_dev *ec, int level)
+{
+	int result;
+	int fan, i;
+
+	for (fan = 0; fan < ec->cal->fans; fan++) {
+		for (i = 0; i < MSI_EC_FAN_CURVE_LENGTH; i++) {
+			result = ec_write_byte(ec, cal_curve_addrs[fan] + i,
+					       level * FAN_CAL_STEP);
+			if (result < 0)
+				return result;
+		}
+	}
+
+	ec->cal->level = level;
+	ec->cal->level_start = jiffies;
+	ec->cal->samples = 0;
+	return 0;
+}
+
+/* Puts the curves and the fan mode back; called with cal_lock held */
+static void cal_restore(struct msi_ec_dev *ec)
+{
+	int result;
+	int fan, i;
+
+	for (fan = 0; fan < ec->cal->fans; fan++) {
+		for (i = 0; i < MSI_EC_FAN_CURVE_LENGTH; i++)
+			ec_write_byte(ec, cal_curve_addrs[fan] + i,
+				      ec->cal->saved_curves[fan][i]);
+	}
+
+	result = ec_update_bits(ec, MSI_EC_FAN_MODE_ADDRESS, FAN_MODE_BITS,
+				ec->cal->saved_fan_mode);
+	journal_write(ec, JOURNAL_CALIBRATION, MSI_EC_FAN_MODE_ADDRESS, result);
+}
+
+/* Ends a running calibration; called with cal_lock held */
+static void cal_finish(struct msi_ec_dev *ec, enum cal_state state,
+		       int error)
+{
+	int fan, i;
+
+	cal_restore(ec);
+	ec->cal->state = state;
+	ec->cal->error = error;
+	WRITE_ONCE(ec->fans->cal_running, FALSE);
+	if (state != CAL_DONE)
+		return;
+
+	/* Noise at the top must not make the table decrease */
+	for (fan = 0; fan < FAN_COUNT; fan++) {
+		for (i = 1; i < FAN_CAL_LEVELS; i++)
+			ec->cal->rpm[fan][i] = max(ec->cal->rpm[fan][i],
+					      ec->cal->rpm[fan][i - 1]);
+	}
+
+	spin_lock(&ec->fans->lock);
+	memcpy(ec->fans->rpm, ec->cal->rpm, sizeof(ec->fans->rpm));
+	WRITE_ONCE(ec->fans->valid, TRUE);
+	spin_unlock(&ec->fans->lock);
+
+	pr_info("msi-ec: %s: fan calibration done (%u levels unsettled)\n",
+		dev_name(&ec->pdev->dev), ec->cal->unsettled);
+}
+
+static bool cal_settled(struct msi_ec_dev *ec, int fan)
+{
+	u16 low = U16_MAX, high = 0;
+	int i;
+
+	for (i = 0; i < CAL_WINDOW; i++) {
+		low = min(low, ec->cal->window[fan][i]);
+		high = max(high, ec->cal->window[fan][i]);
+	}
+
+	return high - low <= CAL_TOLERANCE_RPM;
+}
+
+static u16 cal_average(struct msi_ec_dev *ec, int fan)
+{
+	unsigned int count = min_t(unsigned int, ec->cal->samples, CAL_WINDOW);
+	unsigned int sum = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		sum += ec->cal->window[fan][i];
+
+	return count ? sum / count : 0;
+}
+
+/* Reads the hottest of the calibrated chips into temperature */
+static int cal_read_temperature(struct msi_ec_dev *ec, u8 *temperature)
+{
+	u8 value;
+	int result;
+	int fan;
+
+	*temperature = 0;
+	for (fan = 0; fan < ec->cal->fans; fan++) {
+		result = msi_ec_read(ec, cal_temperature_addrs[fan], &value);
+		if (result < 0)
+			return result;
+		*temperature = max(*temperature, value);
+	}
+	return 0;
+}
+
+static void cal_work_fn(struct work_struct *work)
+{
+	struct msi_ec_dev *ec = container_of(to_delayed_work(work),
+					     struct msi_ec_dev, cal_work);
+	unsigned int delay = CAL_POLL_MS;
+	bool settled = TRUE;
+	u8 temperature;
+	u8 rdata[2];
+	u8 fan_mode;
+	int result;
+	int fan;
+
+	mutex_lock(&ec->cal_lock);
+	if (ec->cal->state != CAL_RUNNING)
+		goto out;
+
+	result = cal_read_temperature(ec, &temperature);
+	if (result == 0 && temperature >= READ_ONCE(ec->cal_max_temperature)) {
+		pr_warn("msi-ec: %s: fan calibration aborted at %u C\n",
+			dev_name(&ec->pdev->dev), temperature);
+		ec->cal->hot = temperature;
+		cal_finish(ec, CAL_ABORTED, 0);
+		goto out;
+	}
+
+	if (result == 0)
+		result = msi_ec_read(ec, MSI_EC_FAN_MODE_ADDRESS, &fan_mode);
+	if (result == 0 && !is_bit_set(MSI_EC_FAN_MODE_ADVANCED_BIT, fan_mode))
+		result = -EBUSY;
+
+	for (fan = 0; fan < ec->cal->fans && result == 0; fan++) {
+		/* Bypasses the cache: every reading has to be new */
+		result = ec_read_seq(ec, fan_rpm_addrs[fan], rdata, 2);
+		if (result < 0)
+			break;
+		ec->cal->window[fan][ec->cal->samples % CAL_WINDOW] =
+			rdata[0] | (rdata[1] << 8);
+	}
+	if (result < 0) {
+		cal_finish(ec, CAL_FAILED, result);
+		goto out;
+	}
+
+	ec->cal->samples++;
+	for (fan = 0; fan < ec->cal->fans; fan++)
+		settled = settled && ec->cal->samples >= CAL_WINDOW &&
+			  cal_settled(ec, fan);
+
+	if (settled || time_after(jiffies, ec->cal->level_start +
+				  msecs_to_jiffies(CAL_LEVEL_TIMEOUT_MS))) {
+		if (!settled)
+			ec->cal->unsettled++;
+		for (fan = 0; fan < ec->cal->fans; fan++)
+			ec->cal->rpm[fan][ec->cal->level] = cal_average(ec, fan);
+
+		if (ec->cal->level + 1 == FAN_CAL_LEVELS) {
+			cal_finish(ec, CAL_DONE, 0);
+			goto out;
+		}
+		result = cal_set_level(ec, ec->cal->level + 1);
+		if (result < 0) {
+			cal_finish(ec, CAL_FAILED, result);
+			goto out;
+		}
+		delay = CAL_SPINUP_MS;
+	}
+
+	queue_delayed_work(system_freezable_wq, &ec->cal_work,
+			   msecs_to_jiffies(delay));
+out:
+	mutex_unlock(&ec->cal_lock);
+}
+
+static int cal_start(struct msi_ec_dev *ec)
+{
+	u8 temperature;
+	int result = 0;
+	int fan, i;
+
+	mutex_lock(&ec->cal_lock);
+	if (ec->cal->state == CAL_RUNNING) {
+		result = -EBUSY;
+		goto out;
+	}
+
+	memset(ec->cal, 0, sizeof(*ec->cal));
+	ec->cal->fans = ec->has_dgpu ? FAN_COUNT : 1;
+
+	result = cal_read_temperature(ec, &temperature);
+	if (result < 0)
+		goto out;
+	if (temperature >= READ_ONCE(ec->cal_max_temperature)) {
+		result = -EAGAIN;
+		goto out;
+	}
+
+	result = msi_ec_read(ec, MSI_EC_FAN_MODE_ADDRESS,
+			     &ec->cal->saved_fan_mode);
+	for (fan = 0; fan < ec->cal->fans && result == 0; fan++) {
+		for (i = 0; i < MSI_EC_FAN_CURVE_LENGTH && result == 0; i++)
+			result = msi_ec_read(ec, cal_curve_addrs[fan] + i,
+					     &ec->cal->saved_curves[fan][i]);
+	}
+	if (result < 0)
+		goto out;
+	ec->cal->saved_fan_mode &= FAN_MODE_BITS;
+
+	ec->cal->state = CAL_RUNNING;
+	WRITE_ONCE(ec->fans->cal_running, TRUE);
+	result = ec_update_bits(ec, MSI_EC_FAN_MODE_ADDRESS, FAN_MODE_BITS,
+				BIT(MSI_EC_FAN_MODE_ADVANCED_BIT));
+	journal_write(ec, JOURNAL_CALIBRATION, MSI_EC_FAN_MODE_ADDRESS, result);
+	if (result == 0)
+		result = cal_set_level(ec, 0);
+	if (result < 0) {
+		cal_finish(ec, CAL_FAILED, result);
+		goto out;
+	}
+
+	queue_delayed_work(system_freezable_wq, &ec->cal_work,
+			   msecs_to_jiffies(CAL_SPINUP_MS));
+out:
+	mutex_unlock(&ec->cal_lock);
+	return result;
+}
+
+/* Aborts a running calibration and restores the fans */
+static void cal_stop(struct msi_ec_dev *ec)
+{
+	bool running;
+
+	mutex_lock(&ec->cal_lock);
+	running = ec->cal->state == CAL_RUNNING;
+	if (running)
+		ec->cal->state = CAL_ABORTED;
+	mutex_unlock(&ec->cal_lock);
+
+	cancel_delayed_work_sync(&ec->cal_work);
+
+	if (running) {
+		mutex_lock(&ec->cal_lock);
+		cal_restore(ec);
+		WRITE_ONCE(ec->fans->cal_running, FALSE);
+		mutex_unlock(&ec->cal_lock);
+	}
+}
+
+static ssize_t cal_state_show(struct device *device,
+			      struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	ssize_t len;
+
+	mutex_lock(&ec->cal_lock);
+	switch (ec->cal->state) {
+	case CAL_RUNNING:
+		len = sprintf(buf, "running %i\n",
+			      ec->cal->level * FAN_CAL_STEP);
+		break;
+	case CAL_DONE:
+		len = sprintf(buf, "done %u\n", ec->cal->unsettled);
+		break;
+	case CAL_FAILED:
+		len = sprintf(buf, "failed %i\n", ec->cal->error);
+		break;
+	case CAL_ABORTED:
+		if (ec->cal->hot)
+			len = sprintf(buf, "aborted %u\n", ec->cal->hot);
+		else
+			len = sprintf(buf, "aborted\n");
+		break;
+	default:
+		len = sprintf(buf, "idle\n");
+		break;
+	}
+	mutex_unlock(&ec->cal_lock);
+
+	return len;
+}
+
+static ssize_t cal_state_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int result;
+
+	if (streq(buf, "start")) {
+		result = cal_start(ec);
+		if (result < 0)
+			return result;
+	} else if (streq(buf, "abort")) {
+		cal_stop(ec);
+	} else {
+		return -EINVAL;
+	}
+
+	return count;
+}
+
+static ssize_t cal_table_show(struct device *device,
+			      struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	int len = 0;
+	int i;
+
+	/* One "percent cpu_rpm [gpu_rpm]" line per level */
+	spin_lock(&ec->fans->lock);
+	for (i = 0; ec->fans->valid && i < FAN_CAL_LEVELS; i++) {
+		len += sysfs_emit_at(buf, len, "%i %u", i * FAN_CAL_STEP,
+				     ec->fans->rpm[FAN_CPU][i]);
+		if (ec->has_dgpu)
+			len += sysfs_emit_at(buf, len, " %u",
+					     ec->fans->rpm[FAN_GPU][i]);
+		len += sysfs_emit_at(buf, len, "\n");
+	}
+	spin_unlock(&ec->fans->lock);
+
+	return len;
+}
+
+/* Takes a saved table back, or "clear" to report the raw registers again */
+static ssize_t cal_table_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	u16 rpm[FAN_COUNT][FAN_CAL_LEVELS];
+	const char *line = buf;
+	const char *end;
+	unsigned int cpu, gpu;
+	char text[32];
+	int percent;
+	int fields;
+	int i;
+
+	if (streq(buf, "clear")) {
+		WRITE_ONCE(ec->fans->valid, FALSE);
+		return count;
+	}
+
+	memset(rpm, 0, sizeof(rpm));
+	for (i = 0; i < FAN_CAL_LEVELS; i++) {
+		if (!line)
+			return -EINVAL;
+		end = strchrnul(line, '\n');
+		if (end - line >= sizeof(text))
+			return -EINVAL;
+		memcpy(text, line, end - line);
+		text[end - line] = '\0';
+
+		gpu = 0;
+		fields = sscanf(text, "%d %u %u", &percent, &cpu, &gpu);
+		if (fields < 2 || percent != i * FAN_CAL_STEP ||
+		    cpu > U16_MAX || gpu > U16_MAX)
+			return -EINVAL;
+		rpm[FAN_CPU][i] = cpu;
+		rpm[FAN_GPU][i] = gpu;
+		if (i && (rpm[FAN_CPU][i] < rpm[FAN_CPU][i - 1] ||
+			  rpm[FAN_GPU][i] < rpm[FAN_GPU][i - 1]))
+			return -EINVAL;
+
+		line = *end ? end + 1 : NULL;
+	}
+
+	spin_lock(&ec->fans->lock);
+	memcpy(ec->fans->rpm, rpm, sizeof(ec->fans->rpm));
+	WRITE_ONCE(ec->fans->valid, TRUE);
+	spin_unlock(&ec->fans->lock);
+
+	return count;
+}
+
+static ssize_t cal_max_temperature_show(struct device *device,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+
+	return sprintf(buf, "%u\n", READ_ONCE(ec->cal_max_temperature));
+}
+
+static ssize_t cal_max_temperature_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	unsigned int value;
+	int result;
+
+	result = kstrtouint(buf, 10, &value);
+	if (result < 0)
+		return result;
+	if (value < 40 || value > 100)
+		return -EINVAL;
+
+	WRITE_ONCE(ec->cal_max_temperature, value);
+	return count;
+}
+
+static struct device_attribute dev_attr_cal_state =
+	__ATTR(state, 0644, cal_state_show, cal_state_store);
+static struct device_attribute dev_attr_cal_table =
+	__ATTR(table, 0644, cal_table_show, cal_table_store);
+static struct device_attribute dev_attr_cal_max_temperature =
+	__ATTR(max_temperature, 0644, cal_max_temperature_show,
+	       cal_max_temperature_store);
+
+static struct attribute *msi_cal_attrs[] = {
+	&dev_attr_cal_state.attr,
+	&dev_attr_cal_table.attr,
+	&dev_attr_cal_max_temperature.attr,
+	NULL,
+};
+
+static const struct attribute_group msi_cal_group = {
+	.name = "fan_calibration",
+	.attrs = msi_cal_attrs,
+};
+
+// ============================================================ //
+// Live configuration
+// ============================================================ //
+
+/*
+ * The config attribute reads and writes the runtime configuration as
+ * "key value" lines, so a saved copy can be written back as is. A write only
+ * needs the keys it changes; it is validated as a whole and either applied
+ * completely or rejected. The register map and the cache lifetime are
+ * published as one new struct msi_ec_config. The sampling periods are those
+ * of the device's workers; the module parameters of the same names set them
+ * for every bound device and are the defaults of devices bound later.
+ */
+
+/* Optional groups that can be enabled and disabled without reloading */
+static const struct {
+	const char *name;
+	const struct attribute_group *group;
+	void (*start)(struct msi_ec_dev *ec);
+	void (*stop)(struct msi_ec_dev *ec);
+} config_features[] = {
+	{ "feedforward", &msi_ff_group, NULL, ff_exit },
+	{ "energy", &msi_energy_group, energy_start, energy_stop },
+	{ "policy", &msi_policy_group, policy_start, policy_stop },
+	{ "flight_recorder", &msi_fr_group, fr_start, fr_stop },
+	{ "fan_guard", &msi_guard_group, guard_start, guard_stop },
+	{ "fan_calibration", &msi_cal_group, NULL, cal_stop },
+};
+
+static unsigned int sample_interval_ms;
+static unsigned int energy_interval_ms;
+static unsigned int policy_interval_ms;
+static unsigned int flight_recorder_interval_ms;
+static unsigned int fan_guard_interval_ms;
+static unsigned int watch_interval_ms;
+
+/* Indexed by worker; value is the module parameter */
+static const struct {
+	const char *name;
+	unsigned int *value;
+} config_intervals[WORKERS] = {
+	[WORKER_SAMPLER] = { "sample_interval_ms", &sample_interval_ms },
+	[WORKER_ENERGY] = { "energy_interval_ms", &energy_interval_ms },
+	[WORKER_POLICY] = { "policy_interval_ms", &policy_interval_ms },
+	[WORKER_FLIGHT_RECORDER] = { "flight_recorder_interval_ms",
+				     &flight_recorder_interval_ms },
+	[WORKER_FAN_GUARD] = { "fan_guard_interval_ms",
+			       &fan_guard_interval_ms },
+	[WORKER_WATCH] = { "watch_interval_ms", &watch_interval_ms },
+};
+
+static int config_init(struct msi_ec_dev *ec)
+{
+	struct msi_ec_config *cfg;
+
+	cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!cfg)
+		return -ENOMEM;
+
+	cfg->features = BIT(ARRAY_SIZE(config_features)) - 1;
+	cfg->fan_speed_min = MSI_EC_CPU_REALTIME_FAN_SPEED_BASE_MIN;
+	cfg->fan_speed_max = MSI_EC_CPU_REALTIME_FAN_SPEED_BASE_MAX;
+	memcpy(cfg->preset_regs, MSI_EC_PRESET_MEMORY_TABLE,
+	       sizeof(cfg->preset_regs));
+	memcpy(cfg->preset_values, MSI_EC_PRESET_VALUE_TABLE,
+	       sizeof(cfg->preset_values));
+
+	RCU_INIT_POINTER(ec->cfg, cfg);
+	return 0;
+}
+
+static void config_exit(struct msi_ec_dev *ec)
+{
+	kfree(rcu_dereference_protected(ec->cfg, TRUE));
+	RCU_INIT_POINTER(ec->cfg, NULL);
+}
+
+static int config_set_feature(struct msi_ec_dev *ec, int index, bool enable)
+{
+	struct kobject *kobj = &ec->pdev->dev.kobj;
+	int result;
+
+	if (!enable) {
+		config_features[index].stop(ec);
+		sysfs_remove_group(kobj, config_features[index].group);
+		return 0;
+	}
+
+	result = sysfs_create_group(kobj, config_features[index].group);
+	if (result < 0)
+		return result;
+	if (config_features[index].start)
+		config_features[index].start(ec);
+
+	return 0;
+}
+
+/* Switches from the features in old to those in new, or back on failure */
+static int config_set_features(struct msi_ec_dev *ec, unsigned long old,
+			       unsigned long new)
+{
+	int result = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(config_features); i++) {
+		if (test_bit(i, &old) == test_bit(i, &new))
+			continue;
+		result = config_set_feature(ec, i, test_bit(i, &new));
+		if (result < 0)
+			break;
+	}
+
+	if (result < 0) {
+		while (i--) {
+			if (test_bit(i, &old) != test_bit(i, &new))
+				config_set_feature(ec, i, test_bit(i, &old));
+		}
+	}
+
+	return result;
+}
+
+static void config_set_interval(struct msi_ec_dev *ec, int index,
+				unsigned int value)
+{
+	struct ec_worker *worker = &ec->workers[index];
+
+	mutex_lock(&worker->lock);
+	WRITE_ONCE(worker->interval_ms, value);
+	if (worker->ready)
+		mod_delayed_work(system_freezable_wq, &worker->work, 0);
+	mutex_unlock(&worker->lock);
+}
+
+/* Sets the period of every bound device and the default of new ones */
+static int config_interval_param_set(const char *val,
+				     const struct kernel_param *kp)
+{
+	struct msi_ec_dev *ec;
+	unsigned int value;
+	int result;
+	int i;
+
+	result = kstrtouint(val, 0, &value);
+	if (result < 0)
+		return result;
+
+	for (i = 0; i < WORKERS; i++) {
+		if (config_intervals[i].value == kp->arg)
+			break;
+	}
+
+	mutex_lock(&msi_ec_devs_lock);
+	WRITE_ONCE(*config_intervals[i].value, value);
+	list_for_each_entry(ec, &msi_ec_devs, node)
+		config_set_interval(ec, i, value);
+	mutex_unlock(&msi_ec_devs_lock);
+
+	return 0;
+}
+
+static const struct kernel_param_ops config_interval_ops = {
+	.set = config_interval_param_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(sample_interval_ms, &config_interval_ops, &sample_interval_ms,
+		0644);
+MODULE_PARM_DESC(sample_interval_ms,
+		 "Telemetry sampling period in milliseconds (0 = disabled)");
+module_param_cb(energy_interval_ms, &config_interval_ops, &energy_interval_ms,
+		0644);
+MODULE_PARM_DESC(energy_interval_ms,
+		 "Battery energy accounting period in milliseconds (0 = disabled)");
+module_param_cb(policy_interval_ms, &config_interval_ops, &policy_interval_ms,
+		0644);
+MODULE_PARM_DESC(policy_interval_ms,
+		 "Policy hook period in milliseconds (0 = disabled)");
+module_param_cb(flight_recorder_interval_ms, &config_interval_ops,
+		&flight_recorder_interval_ms, 0644);
+MODULE_PARM_DESC(flight_recorder_interval_ms,
+		 "Flight recorder sampling period in milliseconds (0 = disabled)");
+module_param_cb(fan_guard_interval_ms, &config_interval_ops,
+		&fan_guard_interval_ms, 0644);
+MODULE_PARM_DESC(fan_guard_interval_ms,
+		 "Fan stall and thermal runaway detection period in milliseconds (0 = disabled)");
+module_param_cb(watch_interval_ms, &config_interval_ops, &watch_interval_ms,
+		0644);
+MODULE_PARM_DESC(watch_interval_ms,
+		 "Period in milliseconds of the check for external EC writes (0 = disabled)");
+
+/* Parses exactly count comma separated bytes */
+static int config_parse_bytes(char *value, u8 *bytes, int count)
+{
+	char *token;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		token = strsep(&value, ",");
+		if (!token || kstrtou8(token, 0, &bytes[i]) < 0)
+			return -EINVAL;
+	}
+
+	return value ? -EINVAL : 0;
+}
+
+static int config_parse_features(char *value, unsigned long *features)
+{
+	char *token;
+	int i;
+
+	*features = 0;
+	if (strcmp(value, "none") == 0)
+		return 0;
+
+	while ((token = strsep(&value, ","))) {
+		for (i = 0; i < ARRAY_SIZE(config_features); i++) {
+			if (strcmp(token, config_features[i].name) == 0)
+				break;
+		}
+		if (i == ARRAY_SIZE(config_features))
+			return -EINVAL;
+		__set_bit(i, features);
+	}
+
+	return 0;
+}
+
+static int config_parse(struct msi_ec_config *cfg, unsigned int *intervals,
+			const char *key, char *value)
+{
+	int i;
+
+	if (strcmp(key, "cache_ms") == 0)
+		return kstrtouint(value, 10, &cfg->cache_ms);
+	if (strcmp(key, "features") == 0)
+		return config_parse_features(value, &cfg->features);
+	if (strcmp(key, "fan_speed_min") == 0)
+		return kstrtou8(value, 0, &cfg->fan_speed_min);
+	if (strcmp(key, "fan_speed_max") == 0)
+		return kstrtou8(value, 0, &cfg->fan_speed_max);
+	if (strcmp(key, "preset_registers") == 0)
+		return config_parse_bytes(value, cfg->preset_regs,
+					  ARRAY_SIZE(cfg->preset_regs));
+
+	for (i = 0; i < ARRAY_SIZE(config_intervals); i++) {
+		if (strcmp(key, config_intervals[i].name) == 0)
+			return kstrtouint(value, 10, &intervals[i]);
+	}
+
+	/* preset_<name> holds the values of the preset registers */
+	for (i = 0; i < ARRAY_SIZE(cfg->preset_values); i++) {
+		if (strncmp(key, "preset_", 7) == 0 &&
+		    strcmp(key + 7, preset_name(i)) == 0)
+			return config_parse_bytes(value, cfg->preset_values[i],
+						  ARRAY_SIZE(cfg->preset_regs));
+	}
+
+	return -EINVAL;
+}
+
+static int config_format_bytes(char *buf, int len, const char *prefix,
+			       const char *name, const u8 *bytes, int count)
+{
+	int i;
+
+	len += sysfs_emit_at(buf, len, "%s%s ", prefix, name);
+	for (i = 0; i < count; i++)
+		len += sysfs_emit_at(buf, len, "%s0x%02x", i ? "," : "",
+				     bytes[i]);
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+static ssize_t config_show(struct device *device,
+			   struct device_attribute *attr, char *buf)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(device);
+	struct msi_ec_config cfg;
+	const char *separator = " ";
+	int len = 0;
+	int i;
+
+	config_get(ec, &cfg);
+
+	len += sysfs_emit_at(buf, len, "cache_ms %u\n", cfg.cache_ms);
+	for (i = 0; i < ARRAY_SIZE(config_intervals); i++)
+		len += sysfs_emit_at(buf, len, "%s %u\n",
+				     config_intervals[i].name,
+				     READ_ONCE(ec->workers[i].interval_ms));
+
+	len += sysfs_emit_at(buf, len, "features");
+	for (i = 0; i < ARRAY_SIZE(config_features); i++) {
+		if (!test_bit(i, &cfg.features))
+			continue;
+		len += sysfs_emit_at(buf, len, "%s%s", separator,
+				     config_features[i].name);
+		separator = ",";
+	}
+	len += sysfs_emit_at(buf, len, "%s\n", cfg.features ? "" : " none");
+
+	len += sysfs_emit_at(buf, len, "fan_speed_min 0x%02x\n",
+			     cfg.fan_speed_min);
+	len += sysfs_emit_at(buf, len, "fan_speed_max 0x%02x\n",
+			     cfg.fan_speed_max);
+	len = config_format_bytes(buf, len, "", "preset_registers",
+				  cfg.preset_regs, ARRAY_SIZE(cfg.preset_regs));
+	for (i = 0; i < ARRAY_SIZE(cfg.preset_values); i++)
+		len = config_format_bytes(buf, len, "preset_", preset_name(i),
+					  cfg.preset_values[i],
+					  ARRAY_SIZE(cfg.preset_regs));
+
+	return len;
+}
+
+static ssize_t config_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	unsigned int intervals[ARRAY_SIZE(config_intervals)];
+	struct msi_ec_config *old, *cfg;
+	char *text, *next, *line, *key;
+	int result = 0;
+	int i;
+
+	text = kstrndup(buf, count, GFP_KERNEL);
+	cfg = kmalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!text || !cfg) {
+		result = -ENOMEM;
+		goto out;
+	}
 
-	if (rdata < MSI_EC_CPU_REALTIME_FAN_SPEED_BASE_MIN ||
-	    rdata > MSI_EC_CPU_REALTIME_FAN_SPEED_BASE_MAX)
-		return -EINVAL;
+	mutex_lock(&ec->config_lock);
+	old = rcu_dereference_protected(ec->cfg,
+					lockdep_is_held(&ec->config_lock));
+	*cfg = *old;
+	for (i = 0; i < ARRAY_SIZE(config_intervals); i++)
+		intervals[i] = READ_ONCE(ec->workers[i].interval_ms);
+
+	next = text;
+	while ((line = strsep(&next, "\n"))) {
+		line = strim(line);
+		if (!*line || *line == '#')
+			continue;
+		key = strsep(&line, " \t");
+		if (!line) {
+			result = -EINVAL;
+			break;
+		}
+		result = config_parse(cfg, intervals, key, skip_spaces(line));
+		if (result < 0)
+			break;
+	}
 
-	return sprintf(buf, "%i\n",
-		       100 * (rdata - MSI_EC_CPU_REALTIME_FAN_SPEED_BASE_MIN) /
-			       (MSI_EC_CPU_REALTIME_FAN_SPEED_BASE_MAX -
-				MSI_EC_CPU_REALTIME_FAN_SPEED_BASE_MIN));
-}
+	if (result == 0 && cfg->fan_speed_min >= cfg->fan_speed_max)
+		result = -EINVAL;
+	if (result == 0)
+		result = config_set_features(ec, old->features, cfg->features);
+	if (result < 0) {
+		mutex_unlock(&ec->config_lock);
+		goto out;
+	}
 
+	rcu_assign_pointer(ec->cfg, cfg);
+	kfree_rcu(old, rcu);
+	cfg = NULL;
 
+	for (i = 0; i < ARRAY_SIZE(config_intervals); i++) {
+		if (intervals[i] != READ_ONCE(ec->workers[i].interval_ms))
+			config_set_interval(ec, i, intervals[i]);
+	}
+	mutex_unlock(&ec->config_lock);
 
-static struct device_attribute dev_attr_cpu_realtime_temperature = {
-	.attr = {
-		.name = "realtime_temperature",
-		.mode = 0444,
-	},
-	.show = cpu_realtime_temperature_show,
-};
+out:
+	kfree(cfg);
+	kfree(text);
+	return result < 0 ? result : count;
+}
 
-static struct device_attribute dev_attr_cpu_realtime_fan_speed = {
-	.attr = {
-		.name = "realtime_fan_speed",
-		.mode = 0444,
-	},
-	.show = cpu_realtime_fan_speed_show,
-};
+static DEVICE_ATTR_RW(config);
 
-static struct attribute *msi_cpu_attrs[] = {
-	&dev_attr_cpu_realtime_temperature.attr,
-	&dev_attr_cpu_realtime_fan_speed.attr,
+static struct attribute *msi_config_attrs[] = {
+	&dev_attr_config.attr,
 	NULL,
 };
 
-static const struct attribute_group msi_cpu_group = {
-	.name = "cpu",
-	.attrs = msi_cpu_attrs,
+/* Unnamed: config sits next to the root attributes */
+static const struct attribute_group msi_config_group = {
+	.attrs = msi_config_attrs,
 };
 
 // ============================================================ //
-// Sysfs platform device attributes (gpu)
+// Power management
 // ============================================================ //
 
-static ssize_t gpu_realtime_temperature_show(struct device *device,
-					     struct device_attribute *attr,
-					     char *buf)
-{
-	u8 rdata;
-	int result;
-
-	result = ec_read(MSI_EC_GPU_REALTIME_TEMPERATURE_ADDRESS, &rdata);
-	if (result < 0)
-		return result;
-
-	return sprintf(buf, "%i\n", rdata);
-}
+/*
+ * The workers run on a freezable workqueue, but their timers would still
+ * wake the platform from suspend-to-idle. prepare pauses the running ones,
+ * waits for running batches and closes the EC gate; complete reopens it and
+ * restarts what prepare paused. EC accesses in between are rejected and
+ * counted.
+ *
+ * A paused worker has its ready flag cleared, so neither an interval change
+ * nor an ACPI notification can queue it again before complete. Workers that
+ * were never started are left alone: their work items may not even be
+ * initialised.
+ */
 
-static ssize_t gpu_realtime_fan_speed_show(struct device *device,
-					   struct device_attribute *attr,
-					   char *buf)
+static int msi_ec_pm_prepare(struct device *dev)
 {
-	u8 rdata;
-	int result;
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int i;
 
-	result = ec_read(MSI_EC_GPU_REALTIME_FAN_SPEED_ADDRESS, &rdata);
-	if (result < 0)
-		return result;
+	/* A calibration would be off after the resume anyway */
+	cal_stop(ec);
 
-	return sprintf(buf, "%i\n", rdata);
-}
+	for (i = 0; i < WORKERS; i++) {
+		struct ec_worker *worker = &ec->workers[i];
 
-static struct device_attribute dev_attr_gpu_realtime_temperature = {
-	.attr = {
-		.name = "realtime_temperature",
-		.mode = 0444,
-	},
-	.show = gpu_realtime_temperature_show,
-};
+		mutex_lock(&worker->lock);
+		if (worker->ready) {
+			WRITE_ONCE(worker->ready, FALSE);
+			set_bit(i, ec->pm_paused);
+		}
+		mutex_unlock(&worker->lock);
 
-static struct device_attribute dev_attr_gpu_realtime_fan_speed = {
-	.attr = {
-		.name = "realtime_fan_speed",
-		.mode = 0444,
-	},
-	.show = gpu_realtime_fan_speed_show,
-};
+		if (test_bit(i, ec->pm_paused))
+			cancel_delayed_work_sync(&worker->work);
+	}
 
-static struct attribute *msi_gpu_attrs[] = {
-	&dev_attr_gpu_realtime_temperature.attr,
-	&dev_attr_gpu_realtime_fan_speed.attr,
-	NULL,
-};
+	mutex_lock(&ec->ff->lock);
+	ec->pm_ff_paused = ec->ff->mode != FF_MODE_OFF;
+	if (ec->pm_ff_paused)
+		cancel_delayed_work_sync(&ec->ff->work);
+	mutex_unlock(&ec->ff->lock);
 
-static const struct attribute_group msi_gpu_group = {
-	.name = "gpu",
-	.attrs = msi_gpu_attrs,
-};
+	flush_workqueue(ec->batch_wq);
 
-static const struct attribute_group *msi_platform_groups[] = {
-	&msi_root_group,
-	&msi_cpu_group,
-	&msi_gpu_group,
-	NULL,
-};
+	down_write(&ec->pm_sem);
+	WRITE_ONCE(ec->suspended, TRUE);
+	up_write(&ec->pm_sem);
 
-static int msi_platform_probe(struct platform_device *pdev)
-{
-	int result;
-	result = sysfs_create_groups(&pdev->dev.kobj, msi_platform_groups);
-	if (result < 0)
-		return result;
 	return 0;
 }
 
-static int msi_platform_remove(struct platform_device *pdev)
+static void msi_ec_pm_complete(struct device *dev)
 {
-	sysfs_remove_groups(&pdev->dev.kobj, msi_platform_groups);
-	return 0;
-}
+	struct msi_ec_dev *ec = dev_get_drvdata(dev);
+	int i;
+
+	down_write(&ec->pm_sem);
+	WRITE_ONCE(ec->suspended, FALSE);
+	up_write(&ec->pm_sem);
+
+	/* The EC kept running; nothing cached before the suspend is valid */
+	spin_lock(&ec->cache.lock);
+	bitmap_zero(ec->cache.valid, MSI_EC_RAM_SIZE);
+	spin_unlock(&ec->cache.lock);
+
+	/* The suspended time is neither battery drain nor CPU load */
+	ec->energy->last.valid = FALSE;
+	ec->ff->state.last_wall_us = 0;
+	/* Nor do temperatures from before it say anything about the fans */
+	ec->guard->count = 0;
+
+	for (i = 0; i < WORKERS; i++) {
+		struct ec_worker *worker = &ec->workers[i];
+
+		if (!test_and_clear_bit(i, ec->pm_paused))
+			continue;
+
+		mutex_lock(&worker->lock);
+		WRITE_ONCE(worker->ready, TRUE);
+		if (READ_ONCE(worker->interval_ms))
+			queue_delayed_work(system_freezable_wq,
+					   &worker->work, 0);
+		mutex_unlock(&worker->lock);
+	}
 
-static struct platform_device *msi_platform_device;
+	mutex_lock(&ec->ff->lock);
+	if (ec->pm_ff_paused && ec->ff->mode != FF_MODE_OFF)
+		queue_delayed_work(system_freezable_wq, &ec->ff->work, 0);
+	ec->pm_ff_paused = FALSE;
+	mutex_unlock(&ec->ff->lock);
+}
 
-static struct platform_driver msi_platform_driver = {
-	.driver = {
-		.name = MSI_DRIVER_NAME,
-	},
-	.probe = msi_platform_probe,
-	.remove = msi_platform_remove,
+static const struct dev_pm_ops msi_ec_pm_ops = {
+	.prepare = msi_ec_pm_prepare,
+	.complete = msi_ec_pm_complete,
 };
 
 // ============================================================ //
@@ -757,9 +6621,12 @@ static struct platform_driver msi_platform_driver = {
 static int micmute_led_sysfs_set(struct led_classdev *led_cdev,
 				 enum led_brightness brightness)
 {
-	int result = ec_write_bit(MSI_EC_KBD_LED_MICMUTE_ADDRESS,
+	struct msi_ec_dev *ec = container_of(led_cdev, struct msi_ec_dev,
+					     micmute_led);
+	int result = ec_write_bit(ec, MSI_EC_KBD_LED_MICMUTE_ADDRESS,
 				  MSI_EC_KBD_LED_MICMUTE_BIT,
 				  brightness);
+	journal_write(ec, JOURNAL_LED, MSI_EC_KBD_LED_MICMUTE_ADDRESS, result);
 	if (result < 0)
 		return result;
 	return 0;
@@ -768,9 +6635,12 @@ static int micmute_led_sysfs_set(struct led_classdev *led_cdev,
 static int mute_led_sysfs_set(struct led_classdev *led_cdev,
 			      enum led_brightness brightness)
 {
-	int result = ec_write_bit(MSI_EC_KBD_LED_MUTE_ADDRESS,
+	struct msi_ec_dev *ec = container_of(led_cdev, struct msi_ec_dev,
+					     mute_led);
+	int result = ec_write_bit(ec, MSI_EC_KBD_LED_MUTE_ADDRESS,
 				  MSI_EC_KBD_LED_MUTE_BIT,
 				  brightness);
+	journal_write(ec, JOURNAL_LED, MSI_EC_KBD_LED_MUTE_ADDRESS, result);
 	if (result < 0)
 		return result;
 	return 0;
@@ -778,8 +6648,10 @@ static int mute_led_sysfs_set(struct led_classdev *led_cdev,
 
 static enum led_brightness kbd_bl_sysfs_get(struct led_classdev *led_cdev)
 {
+	struct msi_ec_dev *ec = container_of(led_cdev, struct msi_ec_dev,
+					     kbd_led);
 	u8 rdata;
-	int result = ec_read(MSI_EC_KBD_BL_ADDRESS, &rdata);
+	int result = ec_read_cached(ec, MSI_EC_KBD_BL_ADDRESS, &rdata);
 	if (result < 0)
 		return 0;
 	return rdata & MSI_EC_KBD_BL_STATE_MASK;
@@ -788,28 +6660,52 @@ static enum led_brightness kbd_bl_sysfs_get(struct led_classdev *led_cdev)
 static int kbd_bl_sysfs_set(struct led_classdev *led_cdev,
 			    enum led_brightness brightness)
 {
+	struct msi_ec_dev *ec = container_of(led_cdev, struct msi_ec_dev,
+					     kbd_led);
 	u8 wdata;
+	int result;
 	if (brightness > 3)
 		return -1;
 	wdata = MSI_EC_KBD_BL_STATE[brightness];
-	return ec_write(MSI_EC_KBD_BL_ADDRESS, wdata);
+	result = ec_write_byte(ec, MSI_EC_KBD_BL_ADDRESS, wdata);
+	journal_write(ec, JOURNAL_LED, MSI_EC_KBD_BL_ADDRESS, result);
+	return result;
+}
+
+static enum led_brightness fnlock_led_get(struct led_classdev *led_cdev)
+{
+	struct msi_ec_dev *ec = container_of(led_cdev, struct msi_ec_dev,
+					     fnlock_led);
+	u8 rdata;
+	int result = ec_read_cached(ec, MSI_EC_FN_LOCK_ADDRESS, &rdata);
+	if (result < 0)
+		return 0;
+	return is_bit_set(MSI_EC_FN_LOCK_BIT, rdata);
+}
+
+/* The firmware owns the Fn-lock state, the LED only reflects it */
+static int fnlock_led_set(struct led_classdev *led_cdev,
+			  enum led_brightness brightness)
+{
+	return -EPERM;
 }
 
-static struct led_classdev micmute_led_cdev = {
+/* Templates, copied into every struct msi_ec_dev */
+static const struct led_classdev micmute_led_cdev = {
 	.name = "platform::micmute",
 	.max_brightness = 1,
 	.brightness_set_blocking = &micmute_led_sysfs_set,
 	.default_trigger = "audio-micmute",
 };
 
-static struct led_classdev mute_led_cdev = {
+static const struct led_classdev mute_led_cdev = {
 	.name = "platform::mute",
 	.max_brightness = 1,
 	.brightness_set_blocking = &mute_led_sysfs_set,
 	.default_trigger = "audio-mute",
 };
 
-static struct led_classdev msiacpi_led_kbdlight = {
+static const struct led_classdev msiacpi_led_kbdlight = {
 	.name = "msiacpi::kbd_backlight",
 	.max_brightness = 3,
 	.flags = LED_BRIGHT_HW_CHANGED & LED_RETAIN_AT_SHUTDOWN,
@@ -817,10 +6713,353 @@ static struct led_classdev msiacpi_led_kbdlight = {
 	.brightness_get = &kbd_bl_sysfs_get,
 };
 
+static const struct led_classdev fnlock_led_cdev = {
+	.name = "platform::fnlock",
+	.max_brightness = 1,
+	.flags = LED_BRIGHT_HW_CHANGED,
+	.brightness_set_blocking = &fnlock_led_set,
+	.brightness_get = &fnlock_led_get,
+};
+
+/*
+ * The LEDs of the laptop keep their names; those of a simulated EC take
+ * the name of its device, like "msi-ec-sim.0::mute".
+ */
+static int msi_ec_led_name(struct msi_ec_dev *ec, struct led_classdev *led)
+{
+	struct device *dev = &ec->pdev->dev;
+
+	if (ec->ops == &ec_acpi_ops)
+		return 0;
+
+	led->name = devm_kasprintf(dev, GFP_KERNEL, "%s%s", dev_name(dev),
+				   strstr(led->name, "::"));
+	return led->name ? 0 : -ENOMEM;
+}
+
+/* Registers the LEDs of ec; they are unregistered when the device unbinds */
+static int msi_ec_leds_register(struct msi_ec_dev *ec)
+{
+	struct device *dev = &ec->pdev->dev;
+	int result;
+
+	ec->micmute_led = micmute_led_cdev;
+	ec->mute_led = mute_led_cdev;
+	ec->kbd_led = msiacpi_led_kbdlight;
+	ec->fnlock_led = fnlock_led_cdev;
+
+	if (msi_ec_led_name(ec, &ec->micmute_led) ||
+	    msi_ec_led_name(ec, &ec->mute_led) ||
+	    msi_ec_led_name(ec, &ec->kbd_led) ||
+	    msi_ec_led_name(ec, &ec->fnlock_led))
+		return -ENOMEM;
+
+	result = devm_led_classdev_register(dev, &ec->micmute_led);
+	if (result < 0)
+		return result;
+	result = devm_led_classdev_register(dev, &ec->mute_led);
+	if (result < 0)
+		return result;
+	result = devm_led_classdev_register(dev, &ec->kbd_led);
+	if (result < 0)
+		return result;
+	return devm_led_classdev_register(dev, &ec->fnlock_led);
+}
+
+// ============================================================ //
+// Device lifetime
+// ============================================================ //
+
+/*
+ * The state of a device lives as long as its binding or an open file of
+ * its miscdev, whichever is last. After the unbind the EC gate stays
+ * closed, so those files only get -ENODEV.
+ */
+
+static void msi_ec_free(struct kref *ref)
+{
+	struct msi_ec_dev *ec = container_of(ref, struct msi_ec_dev, ref);
+
+	if (ec->batch_wq)
+		destroy_workqueue(ec->batch_wq);
+	config_exit(ec);
+	kfree(ec->cal);
+	kfree(ec->guard);
+	kfree(ec->fr);
+	kfree(ec->energy);
+	kfree(ec->ff);
+	kfree(ec->arbiter);
+	kfree(ec->sampler);
+	kfree(ec->journal);
+	kfree(ec->fans);
+	kfree(ec);
+}
+
+static struct msi_ec_dev *msi_ec_create(struct platform_device *pdev)
+{
+	const struct platform_device_id *id = platform_get_device_id(pdev);
+	struct msi_ec_dev *ec;
+	int result;
+	int i;
+
+	ec = kzalloc(sizeof(*ec), GFP_KERNEL);
+	if (!ec)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&ec->ref);
+	INIT_LIST_HEAD(&ec->node);
+	ec->pdev = pdev;
+	ec->ops = (const struct msi_ec_ops *)id->driver_data;
+
+	spin_lock_init(&ec->budget.lock);
+	init_rwsem(&ec->pm_sem);
+	mutex_init(&ec->config_lock);
+	ec_locks_init(ec);
+	spin_lock_init(&ec->cache.lock);
+	spin_lock_init(&ec->watch_shadow.lock);
+	mutex_init(&ec->paths_lock);
+	ec->path_single = &ec_paths[EC_PATH_READ];
+	ec->path_block = &ec_paths[EC_PATH_READ];
+	for (i = 0; i < WORKERS; i++) {
+		ec->workers[i].ec = ec;
+		mutex_init(&ec->workers[i].lock);
+	}
+	mutex_init(&ec->cal_lock);
+	INIT_DELAYED_WORK(&ec->cal_work, cal_work_fn);
+	ec->cal_max_temperature = 80;
+
+	ec->fans = kzalloc(sizeof(*ec->fans), GFP_KERNEL);
+	ec->journal = kzalloc(sizeof(*ec->journal), GFP_KERNEL);
+	ec->sampler = kzalloc(sizeof(*ec->sampler), GFP_KERNEL);
+	ec->arbiter = kzalloc(sizeof(*ec->arbiter), GFP_KERNEL);
+	ec->ff = kzalloc(sizeof(*ec->ff), GFP_KERNEL);
+	ec->energy = kzalloc(sizeof(*ec->energy), GFP_KERNEL);
+	ec->fr = kzalloc(sizeof(*ec->fr), GFP_KERNEL);
+	ec->guard = kzalloc(sizeof(*ec->guard), GFP_KERNEL);
+	ec->cal = kzalloc(sizeof(*ec->cal), GFP_KERNEL);
+	if (!ec->fans || !ec->journal || !ec->sampler || !ec->arbiter ||
+	    !ec->ff || !ec->energy || !ec->fr || !ec->guard || !ec->cal) {
+		result = -ENOMEM;
+		goto err;
+	}
+
+	spin_lock_init(&ec->fans->lock);
+	journal_setup(ec->journal);
+	arbiter_init(ec);
+	ff_init(ec);
+	fr_init(ec);
+	ec->guard->runaway_rate = 30;
+
+	result = config_init(ec);
+	if (result < 0)
+		goto err;
+
+	ec->batch_wq = alloc_ordered_workqueue("msi-ec-batch/%s", 0,
+					       dev_name(&pdev->dev));
+	if (!ec->batch_wq) {
+		result = -ENOMEM;
+		goto err;
+	}
+
+	if (ec->ops->setup) {
+		result = ec->ops->setup(ec);
+		if (result < 0)
+			goto err;
+	}
+
+	/* From here on, the module parameters reach the device */
+	mutex_lock(&msi_ec_devs_lock);
+	for (i = 0; i < WORKERS; i++)
+		ec->workers[i].interval_ms = *config_intervals[i].value;
+	ec_budget_reset(ec);
+	list_add_tail(&ec->node, &msi_ec_devs);
+	mutex_unlock(&msi_ec_devs_lock);
+
+	return ec;
+
+err:
+	kref_put(&ec->ref, msi_ec_free);
+	return ERR_PTR(result);
+}
+
+/* Runs after the remove callback, once the LEDs are unregistered */
+static void msi_ec_release(void *data)
+{
+	struct msi_ec_dev *ec = data;
+
+	mutex_lock(&msi_ec_devs_lock);
+	list_del(&ec->node);
+	mutex_unlock(&msi_ec_devs_lock);
+
+	/* Waits for accesses in flight, later ones fail */
+	down_write(&ec->pm_sem);
+	WRITE_ONCE(ec->unbound, TRUE);
+	up_write(&ec->pm_sem);
+
+	kref_put(&ec->ref, msi_ec_free);
+}
+
+static int msi_platform_probe(struct platform_device *pdev)
+{
+	struct msi_ec_config cfg;
+	struct msi_ec_dev *ec;
+	int result;
+
+	ec = msi_ec_create(pdev);
+	if (IS_ERR(ec))
+		return PTR_ERR(ec);
+
+	/* Added before the LEDs, so it runs after they are unregistered */
+	result = devm_add_action_or_reset(&pdev->dev, msi_ec_release, ec);
+	if (result < 0)
+		return result;
+	platform_set_drvdata(pdev, ec);
+
+	ec_paths_benchmark(ec);
+
+	result = msi_ec_leds_register(ec);
+	if (result < 0)
+		return result;
+
+	// Enable backlight by default, the kernel doesn't properly retain its state despite flag for some reason
+	ec_write_byte(ec, MSI_EC_KBD_BL_ADDRESS, MSI_EC_KBD_BL_STATE[2]);
+
+	result = sysfs_create_groups(&pdev->dev.kobj, msi_platform_groups);
+	if (result < 0)
+		return result;
+	if (ec->has_dgpu) {
+		result = sysfs_create_group(&pdev->dev.kobj, &msi_gpu_group);
+		if (result < 0)
+			goto err_groups;
+	}
+
+	/* Creates and starts the optional groups */
+	config_get(ec, &cfg);
+	result = config_set_features(ec, 0, cfg.features);
+	if (result < 0)
+		goto err_gpu;
+
+	ec->miscdev.minor = MISC_DYNAMIC_MINOR;
+	ec->miscdev.name = dev_name(&pdev->dev);
+	ec->miscdev.fops = &msi_ec_fops;
+	ec->miscdev.parent = &pdev->dev;
+	result = misc_register(&ec->miscdev);
+	if (result < 0)
+		goto err_features;
+
+	sampler_start(ec);
+	watch_start(ec);
+	journal_init(ec);
+
+	result = sysfs_create_group(&pdev->dev.kobj, &msi_config_group);
+	if (result < 0)
+		goto err_sampler;
+	return 0;
+
+err_sampler:
+	journal_exit(ec);
+	watch_stop(ec);
+	sampler_stop(ec);
+	misc_deregister(&ec->miscdev);
+	arbiter_exit(ec);
+err_features:
+	config_set_features(ec, cfg.features, 0);
+err_gpu:
+	if (ec->has_dgpu)
+		sysfs_remove_group(&pdev->dev.kobj, &msi_gpu_group);
+err_groups:
+	sysfs_remove_groups(&pdev->dev.kobj, msi_platform_groups);
+	return result;
+}
+
+static int msi_platform_remove(struct platform_device *pdev)
+{
+	struct msi_ec_dev *ec = platform_get_drvdata(pdev);
+	struct msi_ec_config cfg;
+
+	/* Waits for config writes in progress, later ones cannot start */
+	sysfs_remove_group(&pdev->dev.kobj, &msi_config_group);
+	config_get(ec, &cfg);
+	config_set_features(ec, cfg.features, 0);
+	journal_exit(ec);
+	watch_stop(ec);
+	sampler_stop(ec);
+	misc_deregister(&ec->miscdev);
+	arbiter_exit(ec);
+	if (ec->has_dgpu)
+		sysfs_remove_group(&pdev->dev.kobj, &msi_gpu_group);
+	sysfs_remove_groups(&pdev->dev.kobj, msi_platform_groups);
+	return 0;
+}
+
+/* The EC behind each device name */
+static const struct platform_device_id msi_platform_ids[] = {
+	{ MSI_DRIVER_NAME, (kernel_ulong_t)&ec_acpi_ops },
+	{ MSI_EC_SIM_NAME, (kernel_ulong_t)&ec_sim_ops },
+	{ }
+};
+
+static struct platform_driver msi_platform_driver = {
+	.driver = {
+		.name = MSI_DRIVER_NAME,
+		.pm = &msi_ec_pm_ops,
+	},
+	.id_table = msi_platform_ids,
+	.probe = msi_platform_probe,
+	.remove = msi_platform_remove,
+};
+
 // ============================================================ //
 // Module load/unload
 // ============================================================ //
 
+static struct platform_device *msi_platform_device;
+
+/*
+ * Simulated ECs are bound next to the EC of the laptop, e.g. to measure
+ * how the driver scales with the number of devices. Their EC RAM starts
+ * as the MSI_EC_SIM_FIRMWARE image, if there is one.
+ */
+static unsigned int sim_ecs;
+module_param(sim_ecs, uint, 0444);
+MODULE_PARM_DESC(sim_ecs, "Number of simulated ECs to create");
+
+static struct platform_device **sim_devices;
+
+static void msi_ec_sim_remove(void)
+{
+	unsigned int i;
+
+	for (i = 0; sim_devices && i < sim_ecs; i++)
+		platform_device_unregister(sim_devices[i]);
+	kfree(sim_devices);
+	sim_devices = NULL;
+}
+
+static int msi_ec_sim_add(void)
+{
+	struct platform_device *pdev;
+	unsigned int i;
+
+	if (!sim_ecs)
+		return 0;
+
+	sim_devices = kcalloc(sim_ecs, sizeof(*sim_devices), GFP_KERNEL);
+	if (!sim_devices)
+		return -ENOMEM;
+
+	for (i = 0; i < sim_ecs; i++) {
+		pdev = platform_device_register_simple(MSI_EC_SIM_NAME, i,
+						       NULL, 0);
+		if (IS_ERR(pdev)) {
+			msi_ec_sim_remove();
+			return PTR_ERR(pdev);
+		}
+		sim_devices[i] = pdev;
+	}
+	return 0;
+}
+
 static int __init msi_ec_init(void)
 {
 	int result;
@@ -831,9 +7070,8 @@ static int __init msi_ec_init(void)
 	}
 
 	result = platform_driver_register(&msi_platform_driver);
-	if (result < 0) {
+	if (result < 0)
 		return result;
-	}
 
 	msi_platform_device = platform_device_alloc(MSI_DRIVER_NAME, -1);
 	if (msi_platform_device == NULL) {
@@ -848,12 +7086,12 @@ static int __init msi_ec_init(void)
 		return result;
 	}
 
-	led_classdev_register(&msi_platform_device->dev, &micmute_led_cdev);
-	led_classdev_register(&msi_platform_device->dev, &mute_led_cdev);
-	led_classdev_register(&msi_platform_device->dev, &msiacpi_led_kbdlight);
-
-	// Enable backlight by default, the kernel doesn't properly retain its state despite flag for some reason
-	ec_write(MSI_EC_KBD_BL_ADDRESS, MSI_EC_KBD_BL_STATE[2]);
+	result = msi_ec_sim_add();
+	if (result < 0) {
+		platform_device_del(msi_platform_device);
+		platform_driver_unregister(&msi_platform_driver);
+		return result;
+	}
 
 	pr_info("msi-ec: module_init\n");
 	return 0;
@@ -861,10 +7099,7 @@ static int __init msi_ec_init(void)
 
 static void __exit msi_ec_exit(void)
 {
-	led_classdev_unregister(&mute_led_cdev);
-	led_classdev_unregister(&micmute_led_cdev);
-	led_classdev_unregister(&msiacpi_led_kbdlight);
-
+	msi_ec_sim_remove();
 	platform_driver_unregister(&msi_platform_driver);
 	platform_device_del(msi_platform_device);
 
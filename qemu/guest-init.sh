@@ -0,0 +1,158 @@
+#!/bin/sh
+# guest-init.sh - /init of the test initramfs, driven by run-tests.py.
+#
+# Runs the msi-ec smoke tests in the guest. Lines starting with "@@ " ask
+# the harness on the host for something (the model's transaction counter,
+# poking a register, ...); its answer comes back on the console. Every test
+# prints PASS or FAIL, and "@@ done <failures>" ends the run.
+
+/bin/busybox --install -s /bin
+mount -t proc proc /proc
+mount -t sysfs sysfs /sys
+mount -t devtmpfs devtmpfs /dev
+mount -t debugfs debugfs /sys/kernel/debug
+# The initramfs has no /dev/console node of its own
+exec 0</dev/console 1>/dev/console 2>&1
+stty -echo
+
+DEV=/sys/devices/platform/msi-ec
+PARAMS=/sys/module/msi_ec/parameters
+failures=0
+
+# Prints the answer, so the request goes to the console directly
+host() {
+	echo "@@ $*" >/dev/console
+	read -r reply
+	echo "$reply"
+}
+
+pass() {
+	echo "PASS $1"
+}
+
+fail() {
+	echo "FAIL $1: $2"
+	failures=$((failures + 1))
+}
+
+ec_stat() {
+	sed -n "s/^$1 //p" $DEV/ec_stats
+}
+
+test_probe() {
+	if ! insmod /msi-ec.ko; then
+		fail probe "insmod failed"
+		return 1
+	fi
+	if [ ! -d $DEV ]; then
+		fail probe "$DEV is missing"
+		return 1
+	fi
+
+	fw=$(cat $DEV/fw_version)
+	if [ "$fw" != "14JKIMS1.109" ]; then
+		fail probe "fw_version is '$fw'"
+		return 1
+	fi
+	pass probe
+}
+
+# An uncached sysfs read reaches the model through the ACPI EC driver
+test_sysfs_read() {
+	host poke 0x68=77 >/dev/null
+	before=$(host transactions)
+	temperature=$(cat $DEV/cpu/realtime_temperature)
+	after=$(host transactions)
+
+	if [ "$temperature" != 77 ]; then
+		fail sysfs_read "realtime_temperature is '$temperature'"
+	elif [ $((after - before)) -lt 1 ]; then
+		fail sysfs_read "no EC transaction ($before -> $after)"
+	else
+		pass sysfs_read
+	fi
+}
+
+# A register changed behind the driver's back counts as an external change,
+# even when a sysfs read fetched the new value before the watcher ran
+test_external_change() {
+	printf 'watch_interval_ms 1000\ncache_ms 1\n' >$DEV/config
+	sleep 3
+	before=$(ec_stat external_changes)
+	host poke 0x98=0x80 >/dev/null
+	boost=$(cat $DEV/cooler_boost)
+	sleep 3
+	after=$(ec_stat external_changes)
+	printf 'watch_interval_ms 0\ncache_ms 0\n' >$DEV/config
+
+	if [ "$boost" != on ]; then
+		fail external_change "cooler_boost is '$boost'"
+	elif [ "$after" -le "$before" ]; then
+		fail external_change "external_changes stayed at $before"
+	else
+		pass external_change
+	fi
+}
+
+# The Fn-lock LED is told about a hotkey even when a read of fn_lock fetched
+# the new state before the watcher ran
+test_fn_lock_notify() {
+	led=/sys/class/leds/platform::fnlock
+	printf 'watch_interval_ms 1000\ncache_ms 1\n' >$DEV/config
+	sleep 3
+	host poke 0xd9=0x03 >/dev/null
+	state=$(cat $DEV/fn_lock)
+	sleep 3
+	changed=$(cat $led/brightness_hw_changed 2>/dev/null)
+	printf 'watch_interval_ms 0\ncache_ms 0\n' >$DEV/config
+
+	if [ "$state" != on ]; then
+		fail fn_lock_notify "fn_lock is '$state'"
+	elif [ "$changed" != 1 ]; then
+		fail fn_lock_notify "brightness_hw_changed is '$changed'"
+	else
+		pass fn_lock_notify
+	fi
+}
+
+# Nothing reaches the EC between the driver's prepare and complete, however
+# busy the workers were, and they carry on after the resume. pm_test holds
+# the system with the devices suspended for pm_test_delay seconds, and the
+# harness samples the transaction counter inside that hold.
+test_suspend() {
+	if [ ! -e /sys/power/pm_test ]; then
+		fail suspend "no /sys/power/pm_test (PM_DEBUG)"
+		return
+	fi
+	printf 'sample_interval_ms 100\nwatch_interval_ms 100\n' >$DEV/config
+	sleep 1
+	echo devices >/sys/power/pm_test
+	host suspend-window >/dev/null
+	echo freeze >/sys/power/state
+	delta=$(host suspend-delta)
+	echo none >/sys/power/pm_test
+	before=$(host transactions)
+	sleep 1
+	after=$(host transactions)
+	printf 'sample_interval_ms 0\nwatch_interval_ms 0\n' >$DEV/config
+
+	if [ "$delta" = unknown ]; then
+		fail suspend "the harness saw no suspend"
+	elif [ "$delta" != 0 ]; then
+		fail suspend "$delta EC transactions while suspended"
+	elif [ $((after - before)) -lt 1 ]; then
+		fail suspend "no EC transaction after the resume"
+	else
+		pass suspend
+	fi
+}
+
+if test_probe; then
+	test_sysfs_read
+	test_external_change
+	test_fn_lock_notify
+	test_suspend
+fi
+
+host done $failures >/dev/null
+poweroff -f
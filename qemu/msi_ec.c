@@ -0,0 +1,408 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * msi_ec.c - QEMU model of the embedded controller of MSI Modern laptops.
+ *
+ * An ISA device implementing the ACPI EC host interface on ports 0x62 (data)
+ * and 0x66 (command/status): read, write, burst enable/disable and query.
+ * Together with msi-ec-ssdt.asl, which declares the EC, an AC adapter and a
+ * battery backed by EC registers, the guest kernel drives it through its
+ * regular ACPI EC driver, and msi-ec runs unmodified on top.
+ *
+ * Properties:
+ *   dump=FILE          256 byte EC RAM image to start from (the layout of
+ *                      msi_modern_15_a11m_ec.hexpat); zeroed otherwise
+ *   latency-us=N       time the EC takes to consume each byte written to it
+ *   burst-latency-us=N the same while in burst mode
+ *   gpe=N              GPE0 bit raised for the EC SCI, 0 - 7 (default 7,
+ *                      which the q35 machine leaves unused); must match
+ *                      _GPE in the SSDT
+ *
+ * Like a real EC, the model raises its GPE when it consumed a byte, when it
+ * has a byte for the host, and when an event is pending (SCI_EVT), so the
+ * guest's EC driver runs interrupt driven and picks up query events right
+ * away. The GPE is wired through the ICH9 LPC ACPI registers, so this needs
+ * -M q35. Elsewhere the guest polls and only notices events on its next
+ * transaction. At runtime (QMP or HMP):
+ *   qom-set /machine/peripheral/ID query 0x50      queue query event _Q50
+ *   qom-set /machine/peripheral/ID poke 0x68=80    set a register
+ *   qom-get /machine/peripheral/ID transactions    commands handled so far
+ *
+ * The file is built as part of QEMU 10.1, see the Makefile next to it.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "hw/acpi/acpi.h"
+#include "hw/isa/isa.h"
+#include "hw/qdev-properties.h"
+#include "hw/southbridge/ich9.h"
+#include "migration/vmstate.h"
+#include "qom/object.h"
+
+#define TYPE_MSI_EC "msi-ec"
+OBJECT_DECLARE_SIMPLE_TYPE(MSIECState, MSI_EC)
+
+#define MSI_EC_RAM_SIZE 256
+#define MSI_EC_DATA_PORT 0x62
+#define MSI_EC_CMD_PORT 0x66
+#define MSI_EC_QUERY_MAX 8
+#define MSI_EC_GPE_MAX 7 /* acpi_update_sci() only looks at GPE0 bits 0 - 7 */
+
+/* Status register (ACPI spec, 12.2.1) */
+#define EC_STATUS_OBF 0x01
+#define EC_STATUS_IBF 0x02
+#define EC_STATUS_CMD 0x08
+#define EC_STATUS_BURST 0x10
+#define EC_STATUS_SCI_EVT 0x20
+
+/* Commands (ACPI spec, 12.3) */
+#define EC_CMD_READ 0x80
+#define EC_CMD_WRITE 0x81
+#define EC_CMD_BURST_ENABLE 0x82
+#define EC_CMD_BURST_DISABLE 0x83
+#define EC_CMD_QUERY 0x84
+#define EC_BURST_ACK 0x90
+
+/* What the EC expects next on the data port */
+enum {
+	EC_STATE_IDLE,
+	EC_STATE_READ_ADDR,
+	EC_STATE_WRITE_ADDR,
+	EC_STATE_WRITE_DATA,
+};
+
+struct MSIECState {
+	ISADevice parent_obj;
+
+	MemoryRegion data_io;
+	MemoryRegion cmd_io;
+	QEMUTimer *timer;
+	ICH9LPCState *lpc; /* NULL: no GPE, the guest polls */
+
+	uint8_t ram[MSI_EC_RAM_SIZE];
+	uint8_t status;
+	uint8_t state;
+	uint8_t addr;
+	uint8_t output;
+	uint8_t input; /* latched while IBF is set */
+	bool input_is_cmd;
+	uint8_t queries[MSI_EC_QUERY_MAX];
+	uint8_t query_count;
+	uint64_t transactions;
+
+	char *dump;
+	uint32_t latency_us;
+	uint32_t burst_latency_us;
+	uint8_t gpe;
+};
+
+/* Sets the GPE status bit; the SCI stays up until the guest clears it */
+static void msi_ec_raise_sci(MSIECState *s)
+{
+	ACPIREGS *regs;
+
+	if (!s->lpc)
+		return;
+
+	regs = &s->lpc->pm.acpi_regs;
+	regs->gpe.sts[0] |= 1 << s->gpe;
+	acpi_update_sci(regs, s->lpc->pm.irq);
+}
+
+static void msi_ec_output(MSIECState *s, uint8_t value)
+{
+	s->output = value;
+	s->status |= EC_STATUS_OBF;
+	msi_ec_raise_sci(s);
+}
+
+static void msi_ec_command(MSIECState *s, uint8_t cmd)
+{
+	s->transactions++;
+	s->state = EC_STATE_IDLE;
+
+	switch (cmd) {
+	case EC_CMD_READ:
+		s->state = EC_STATE_READ_ADDR;
+		break;
+	case EC_CMD_WRITE:
+		s->state = EC_STATE_WRITE_ADDR;
+		break;
+	case EC_CMD_BURST_ENABLE:
+		s->status |= EC_STATUS_BURST;
+		msi_ec_output(s, EC_BURST_ACK);
+		break;
+	case EC_CMD_BURST_DISABLE:
+		s->status &= ~EC_STATUS_BURST;
+		break;
+	case EC_CMD_QUERY:
+		if (!s->query_count) {
+			msi_ec_output(s, 0);
+			break;
+		}
+		msi_ec_output(s, s->queries[0]);
+		s->query_count--;
+		memmove(s->queries, s->queries + 1, s->query_count);
+		if (!s->query_count)
+			s->status &= ~EC_STATUS_SCI_EVT;
+		break;
+	default:
+		break;
+	}
+}
+
+static void msi_ec_data(MSIECState *s, uint8_t value)
+{
+	switch (s->state) {
+	case EC_STATE_READ_ADDR:
+		msi_ec_output(s, s->ram[value]);
+		s->state = EC_STATE_IDLE;
+		break;
+	case EC_STATE_WRITE_ADDR:
+		s->addr = value;
+		s->state = EC_STATE_WRITE_DATA;
+		break;
+	case EC_STATE_WRITE_DATA:
+		s->ram[s->addr] = value;
+		s->state = EC_STATE_IDLE;
+		break;
+	default:
+		break;
+	}
+}
+
+/* The EC consumes the byte the host wrote and clears IBF */
+static void msi_ec_consume(MSIECState *s)
+{
+	if (!(s->status & EC_STATUS_IBF))
+		return;
+
+	s->status &= ~EC_STATUS_IBF;
+	if (s->input_is_cmd)
+		msi_ec_command(s, s->input);
+	else
+		msi_ec_data(s, s->input);
+	msi_ec_raise_sci(s);
+}
+
+static void msi_ec_timer_cb(void *opaque)
+{
+	msi_ec_consume(opaque);
+}
+
+static void msi_ec_input(MSIECState *s, uint8_t value, bool is_cmd)
+{
+	uint32_t latency = s->status & EC_STATUS_BURST ? s->burst_latency_us :
+							 s->latency_us;
+
+	/* A byte written while IBF is set overwrites the previous one */
+	s->input = value;
+	s->input_is_cmd = is_cmd;
+	s->status |= EC_STATUS_IBF;
+	if (is_cmd)
+		s->status |= EC_STATUS_CMD;
+	else
+		s->status &= ~EC_STATUS_CMD;
+
+	if (!latency) {
+		msi_ec_consume(s);
+		return;
+	}
+	timer_mod(s->timer, qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) + latency);
+}
+
+static uint64_t msi_ec_data_read(void *opaque, hwaddr addr, unsigned size)
+{
+	MSIECState *s = opaque;
+
+	s->status &= ~EC_STATUS_OBF;
+	return s->output;
+}
+
+static void msi_ec_data_write(void *opaque, hwaddr addr, uint64_t value,
+			      unsigned size)
+{
+	msi_ec_input(opaque, value, false);
+}
+
+static uint64_t msi_ec_cmd_read(void *opaque, hwaddr addr, unsigned size)
+{
+	MSIECState *s = opaque;
+
+	return s->status;
+}
+
+static void msi_ec_cmd_write(void *opaque, hwaddr addr, uint64_t value,
+			     unsigned size)
+{
+	msi_ec_input(opaque, value, true);
+}
+
+static const MemoryRegionOps msi_ec_data_ops = {
+	.read = msi_ec_data_read,
+	.write = msi_ec_data_write,
+	.endianness = DEVICE_LITTLE_ENDIAN,
+	.impl = { .min_access_size = 1, .max_access_size = 1 },
+};
+
+static const MemoryRegionOps msi_ec_cmd_ops = {
+	.read = msi_ec_cmd_read,
+	.write = msi_ec_cmd_write,
+	.endianness = DEVICE_LITTLE_ENDIAN,
+	.impl = { .min_access_size = 1, .max_access_size = 1 },
+};
+
+static void msi_ec_set_query(Object *obj, Visitor *v, const char *name,
+			     void *opaque, Error **errp)
+{
+	MSIECState *s = MSI_EC(obj);
+	uint8_t query;
+
+	if (!visit_type_uint8(v, name, &query, errp))
+		return;
+	if (!query) {
+		error_setg(errp, "query 0 means no event");
+		return;
+	}
+	if (s->query_count == MSI_EC_QUERY_MAX) {
+		error_setg(errp, "too many pending queries");
+		return;
+	}
+
+	s->queries[s->query_count++] = query;
+	s->status |= EC_STATUS_SCI_EVT;
+	msi_ec_raise_sci(s);
+}
+
+/* "ADDR=VALUE", both in any base strtoul() accepts */
+static void msi_ec_set_poke(Object *obj, const char *str, Error **errp)
+{
+	MSIECState *s = MSI_EC(obj);
+	unsigned int addr, value;
+	const char *end;
+
+	if (qemu_strtoui(str, &end, 0, &addr) < 0 || *end != '=' ||
+	    qemu_strtoui(end + 1, NULL, 0, &value) < 0 ||
+	    addr >= MSI_EC_RAM_SIZE || value > 0xff) {
+		error_setg(errp, "expected ADDR=VALUE, got '%s'", str);
+		return;
+	}
+
+	s->ram[addr] = value;
+}
+
+static void msi_ec_realize(DeviceState *dev, Error **errp)
+{
+	MSIECState *s = MSI_EC(dev);
+	ISADevice *isa = ISA_DEVICE(dev);
+	g_autofree char *contents = NULL;
+	gsize len;
+
+	if (s->dump) {
+		if (!g_file_get_contents(s->dump, &contents, &len, NULL)) {
+			error_setg(errp, "cannot read EC dump '%s'", s->dump);
+			return;
+		}
+		if (len != MSI_EC_RAM_SIZE) {
+			error_setg(errp, "EC dump '%s' has %zu bytes, expected %d",
+				   s->dump, (size_t)len, MSI_EC_RAM_SIZE);
+			return;
+		}
+		memcpy(s->ram, contents, MSI_EC_RAM_SIZE);
+	}
+
+	if (s->gpe > MSI_EC_GPE_MAX) {
+		error_setg(errp, "gpe must be 0 - %d", MSI_EC_GPE_MAX);
+		return;
+	}
+	s->lpc = (ICH9LPCState *)object_resolve_path_type(
+		"", TYPE_ICH9_LPC_DEVICE, NULL);
+	if (!s->lpc)
+		warn_report("msi-ec: no ICH9 LPC, the guest has to poll for events");
+
+	memory_region_init_io(&s->data_io, OBJECT(dev), &msi_ec_data_ops, s,
+			      "msi-ec-data", 1);
+	memory_region_init_io(&s->cmd_io, OBJECT(dev), &msi_ec_cmd_ops, s,
+			      "msi-ec-cmd", 1);
+	isa_register_ioport(isa, &s->data_io, MSI_EC_DATA_PORT);
+	isa_register_ioport(isa, &s->cmd_io, MSI_EC_CMD_PORT);
+
+	s->timer = timer_new_us(QEMU_CLOCK_VIRTUAL, msi_ec_timer_cb, s);
+}
+
+static void msi_ec_unrealize(DeviceState *dev)
+{
+	MSIECState *s = MSI_EC(dev);
+
+	timer_free(s->timer);
+}
+
+static void msi_ec_instance_init(Object *obj)
+{
+	MSIECState *s = MSI_EC(obj);
+
+	object_property_add(obj, "query", "uint8", NULL, msi_ec_set_query,
+			    NULL, NULL);
+	object_property_add_str(obj, "poke", NULL, msi_ec_set_poke);
+	object_property_add_uint64_ptr(obj, "transactions", &s->transactions,
+				       OBJ_PROP_FLAG_READ);
+}
+
+static const Property msi_ec_properties[] = {
+	DEFINE_PROP_STRING("dump", MSIECState, dump),
+	DEFINE_PROP_UINT32("latency-us", MSIECState, latency_us, 0),
+	DEFINE_PROP_UINT32("burst-latency-us", MSIECState, burst_latency_us, 0),
+	DEFINE_PROP_UINT8("gpe", MSIECState, gpe, MSI_EC_GPE_MAX),
+};
+
+static const VMStateDescription vmstate_msi_ec = {
+	.name = TYPE_MSI_EC,
+	.version_id = 1,
+	.minimum_version_id = 1,
+	.fields = (const VMStateField[]){
+		VMSTATE_UINT8_ARRAY(ram, MSIECState, MSI_EC_RAM_SIZE),
+		VMSTATE_UINT8(status, MSIECState),
+		VMSTATE_UINT8(state, MSIECState),
+		VMSTATE_UINT8(addr, MSIECState),
+		VMSTATE_UINT8(output, MSIECState),
+		VMSTATE_UINT8(input, MSIECState),
+		VMSTATE_BOOL(input_is_cmd, MSIECState),
+		VMSTATE_UINT8_ARRAY(queries, MSIECState, MSI_EC_QUERY_MAX),
+		VMSTATE_UINT8(query_count, MSIECState),
+		VMSTATE_TIMER_PTR(timer, MSIECState),
+		VMSTATE_END_OF_LIST(),
+	},
+};
+
+static void msi_ec_class_init(ObjectClass *klass, const void *data)
+{
+	DeviceClass *dc = DEVICE_CLASS(klass);
+
+	dc->desc = "MSI laptop embedded controller (ACPI EC interface)";
+	dc->realize = msi_ec_realize;
+	dc->unrealize = msi_ec_unrealize;
+	dc->vmsd = &vmstate_msi_ec;
+	device_class_set_props(dc, msi_ec_properties);
+	set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+}
+
+static const TypeInfo msi_ec_info = {
+	.name = TYPE_MSI_EC,
+	.parent = TYPE_ISA_DEVICE,
+	.instance_size = sizeof(MSIECState),
+	.instance_init = msi_ec_instance_init,
+	.class_init = msi_ec_class_init,
+};
+
+static void msi_ec_register_types(void)
+{
+	type_register_static(&msi_ec_info);
+}
+
+type_init(msi_ec_register_types)
@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-or-later
+"""
+run-tests.py - boots a guest on the msi-ec model and runs the smoke tests.
+
+The guest's /init (guest-init.sh) talks to this script over the serial
+console: a line "@@ <request>" asks for something only the host can do,
+and the answer goes back on the console. Requests:
+
+  transactions      the model's EC command counter (qom-get)
+  poke ADDR=VALUE   sets a register behind the guest's back (qom-set)
+  query N           queues EC query event _QN (qom-set)
+  suspend-window    samples the transaction counter twice while the next
+                    pm_test suspend holds the devices suspended
+  suspend-delta     the difference of those samples, or "unknown"
+  done FAILURES     the tests have finished
+
+The exit status is 0 when every test passed.
+"""
+
+import argparse
+import json
+import os
+import re
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+DEVICE = "/machine/peripheral/ec"
+REQUEST = re.compile(r"@@ (\S+)\s*(.*)")
+# Printed by the kernel when pm_test starts its pm_test_delay (5 s) hold
+SUSPEND_HOLD = "suspend debug: Waiting for"
+SUSPEND_SAMPLE_S = 3
+
+
+class QMP:
+    def __init__(self, path, timeout):
+        deadline = time.monotonic() + timeout
+        while True:
+            try:
+                self.sock = socket.socket(socket.AF_UNIX)
+                self.sock.connect(path)
+                break
+            except OSError:
+                self.sock.close()
+                if time.monotonic() > deadline:
+                    raise
+                time.sleep(0.1)
+        self.file = self.sock.makefile("rw")
+        self.receive()  # greeting
+        self.command("qmp_capabilities")
+
+    def receive(self):
+        while True:
+            message = json.loads(self.file.readline())
+            if "event" not in message:
+                return message
+
+    def command(self, name, **arguments):
+        self.file.write(json.dumps({"execute": name,
+                                    "arguments": arguments}) + "\n")
+        self.file.flush()
+        reply = self.receive()
+        if "error" in reply:
+            raise RuntimeError(f"{name}: {reply['error']['desc']}")
+        return reply["return"]
+
+
+def transactions(qmp):
+    return qmp.command("qom-get", path=DEVICE, property="transactions")
+
+
+def answer(qmp, request, argument, window):
+    if request == "transactions":
+        return str(transactions(qmp))
+    if request == "poke":
+        qmp.command("qom-set", path=DEVICE, property="poke", value=argument)
+        return "ok"
+    if request == "query":
+        qmp.command("qom-set", path=DEVICE, property="query",
+                    value=int(argument, 0))
+        return "ok"
+    if request == "suspend-window":
+        window.clear()
+        window["armed"] = True
+        return "ok"
+    if request == "suspend-delta":
+        if "after" not in window:
+            return "unknown"
+        return str(window["after"] - window["before"])
+    raise RuntimeError(f"unknown request '{request}'")
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    parser.add_argument("--qemu", default="qemu-system-x86_64")
+    parser.add_argument("--kernel", required=True)
+    parser.add_argument("--initrd", required=True)
+    parser.add_argument("--ssdt", default=os.path.join(here, "msi-ec-ssdt.aml"))
+    parser.add_argument("--dump",
+                        default=os.path.join(here, "modern-15-a11m.bin"))
+    parser.add_argument("--timeout", type=int, default=300)
+    args = parser.parse_args()
+
+    socket_dir = tempfile.mkdtemp(prefix="msi-ec-")
+    qmp_path = os.path.join(socket_dir, "qmp")
+    qemu = subprocess.Popen(
+        [args.qemu, "-M", "q35", "-m", "512M", "-smp", "2",
+         "-display", "none", "-no-reboot", "-serial", "stdio",
+         "-qmp", f"unix:{qmp_path},server=on,wait=off",
+         "-kernel", args.kernel, "-initrd", args.initrd,
+         "-append", "console=ttyS0 loglevel=7 no_console_suspend panic=-1",
+         "-acpitable", f"file={args.ssdt}",
+         "-device", f"msi-ec,id=ec,dump={args.dump},latency-us=50"],
+        stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True,
+        errors="replace")
+
+    # A hung guest prints nothing, so the reader below would wait forever
+    watchdog = threading.Timer(args.timeout, qemu.kill)
+    watchdog.start()
+    failures = None
+    window = {}
+    try:
+        qmp = QMP(qmp_path, 10)
+        for line in qemu.stdout:
+            line = line.rstrip("\r\n")
+            print(line, flush=True)
+
+            if window.get("armed") and SUSPEND_HOLD in line:
+                # The guest is stuck in the hold; its console output waits
+                window["armed"] = False
+                window["before"] = transactions(qmp)
+                time.sleep(SUSPEND_SAMPLE_S)
+                window["after"] = transactions(qmp)
+                continue
+
+            match = REQUEST.search(line)
+            if not match:
+                continue
+            request, argument = match.groups()
+            if request == "done":
+                failures = int(argument)
+                break
+            qemu.stdin.write(answer(qmp, request, argument, window) + "\n")
+            qemu.stdin.flush()
+    finally:
+        watchdog.cancel()
+        qemu.kill()
+        qemu.wait()
+        if os.path.exists(qmp_path):
+            os.unlink(qmp_path)
+        os.rmdir(socket_dir)
+
+    if failures is None:
+        print("run-tests: the guest didn't finish", file=sys.stderr)
+        return 1
+    print(f"run-tests: {failures} failed")
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,303 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * msi-ec-batch.c - submit a batch of EC operations to /dev/msi-ec.
+ *
+ * By default the batch is submitted as an io_uring command (without any
+ * dependency on liburing) and the tool waits for its completion; -s uses the
+ * synchronous ioctl instead. -n submits the batch several times at once to
+ * exercise queued completions.
+ *
+ * Operations:
+ *   r:ADDR             read a register
+ *   w:ADDR=VALUE       write a register (needs CAP_SYS_ADMIN)
+ *   u:ADDR&MASK=VALUE  update the bits in MASK (needs CAP_SYS_ADMIN)
+ *   p:PRESET           apply super_battery, silent, balanced or
+ *                      high_performance
+ *
+ * Usage: msi-ec-batch [-s] [-e] [-n count] op...
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "../msi-ec-ioctl.h"
+
+#define DEVICE "/dev/msi-ec"
+#define MAX_INFLIGHT 64
+
+static const char *const presets[] = {
+	"super_battery", "silent", "balanced", "high_performance",
+};
+
+struct ring {
+	int fd;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+
+static int parse_op(const char *spec, struct msi_ec_op *op)
+{
+	char *end;
+	size_t i;
+
+	memset(op, 0, sizeof(*op));
+	if (strlen(spec) < 3 || spec[1] != ':')
+		return -1;
+
+	switch (spec[0]) {
+	case 'r':
+		op->type = MSI_EC_OP_READ;
+		op->addr = strtoul(spec + 2, &end, 0);
+		return *end ? -1 : 0;
+	case 'w':
+		op->type = MSI_EC_OP_WRITE;
+		op->addr = strtoul(spec + 2, &end, 0);
+		if (*end != '=')
+			return -1;
+		op->value = strtoul(end + 1, &end, 0);
+		return *end ? -1 : 0;
+	case 'u':
+		op->type = MSI_EC_OP_UPDATE_BITS;
+		op->addr = strtoul(spec + 2, &end, 0);
+		if (*end != '&')
+			return -1;
+		op->mask = strtoul(end + 1, &end, 0);
+		if (*end != '=')
+			return -1;
+		op->value = strtoul(end + 1, &end, 0);
+		return *end ? -1 : 0;
+	case 'p':
+		op->type = MSI_EC_OP_PRESET;
+		for (i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+			if (strcmp(spec + 2, presets[i]) == 0) {
+				op->value = i;
+				return 0;
+			}
+		}
+		return -1;
+	default:
+		return -1;
+	}
+}
+
+static void print_ops(const struct msi_ec_op *ops, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		const struct msi_ec_op *op = &ops[i];
+
+		if (op->result < 0)
+			printf("op %u: %s\n", i, strerror(-op->result));
+		else if (op->type == MSI_EC_OP_READ)
+			printf("op %u: 0x%02x = 0x%02x\n", i, op->addr,
+			       op->value);
+		else
+			printf("op %u: ok\n", i);
+	}
+}
+
+static void *map_ring(int fd, size_t size, off_t offset)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static int ring_setup(struct ring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+	char *sq, *cq;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return -errno;
+
+	sq = map_ring(ring->fd, params.sq_off.array +
+			params.sq_entries * sizeof(unsigned int),
+		      IORING_OFF_SQ_RING);
+	cq = map_ring(ring->fd, params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe),
+		      IORING_OFF_CQ_RING);
+	ring->sqes = map_ring(ring->fd,
+			      params.sq_entries * sizeof(struct io_uring_sqe),
+			      IORING_OFF_SQES);
+	if (!sq || !cq || !ring->sqes)
+		return -ENOMEM;
+
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 0;
+}
+
+static void ring_queue(struct ring *ring, int fd,
+		       const struct msi_ec_batch *batch, unsigned long tag)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = fd;
+	sqe->cmd_op = MSI_EC_URING_CMD_BATCH;
+	sqe->user_data = tag;
+	memcpy(sqe->cmd, batch, sizeof(*batch));
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int run_uring(int fd, struct msi_ec_op *ops, unsigned int count,
+		     unsigned int flags, unsigned int repeat)
+{
+	static struct msi_ec_op copies[MAX_INFLIGHT][MSI_EC_BATCH_MAX];
+	struct msi_ec_batch batch;
+	struct io_uring_cqe *cqe;
+	struct ring ring;
+	unsigned int done = 0, head, i;
+	int result = 0;
+
+	memset(&ring, 0, sizeof(ring));
+	if (ring_setup(&ring, MAX_INFLIGHT) < 0) {
+		perror("msi-ec-batch: io_uring_setup");
+		return 1;
+	}
+
+	/* Every submission gets its own copy of the ops for the results */
+	for (i = 0; i < repeat; i++) {
+		memcpy(copies[i], ops, count * sizeof(*ops));
+		batch.ops = (__u64)(unsigned long)copies[i];
+		batch.count = count;
+		batch.flags = flags;
+		ring_queue(&ring, fd, &batch, i);
+	}
+
+	if (syscall(__NR_io_uring_enter, ring.fd, repeat, repeat,
+		    IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+		perror("msi-ec-batch: io_uring_enter");
+		return 1;
+	}
+
+	while (done < repeat) {
+		head = *ring.cq_head;
+		if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			syscall(__NR_io_uring_enter, ring.fd, 0, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+			continue;
+		}
+
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		printf("batch %llu: ", (unsigned long long)cqe->user_data);
+		if (cqe->res < 0) {
+			printf("%s\n", strerror(-cqe->res));
+			result = 1;
+		} else {
+			printf("%d ops executed\n", cqe->res);
+			print_ops(copies[cqe->user_data], count);
+		}
+		__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+		done++;
+	}
+
+	return result;
+}
+
+static int run_sync(int fd, struct msi_ec_op *ops, unsigned int count,
+		    unsigned int flags)
+{
+	struct msi_ec_batch batch = {
+		.ops = (__u64)(unsigned long)ops,
+		.count = count,
+		.flags = flags,
+	};
+	int result;
+
+	result = ioctl(fd, MSI_EC_IOC_BATCH, &batch);
+	if (result < 0) {
+		perror("msi-ec-batch: " DEVICE);
+		return 1;
+	}
+
+	printf("%d ops executed\n", result);
+	print_ops(ops, count);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-s] [-e] [-n count] op...\n"
+		"  op: r:ADDR, w:ADDR=VALUE, u:ADDR&MASK=VALUE, p:PRESET\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	static struct msi_ec_op ops[MSI_EC_BATCH_MAX];
+	unsigned int repeat = 1, flags = 0, count = 0;
+	int sync = 0;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "sen:h")) != -1) {
+		switch (opt) {
+		case 's':
+			sync = 1;
+			break;
+		case 'e':
+			flags |= MSI_EC_BATCH_STOP_ON_ERROR;
+			break;
+		case 'n':
+			repeat = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+
+	if (optind == argc || argc - optind > MSI_EC_BATCH_MAX ||
+	    repeat < 1 || repeat > MAX_INFLIGHT) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	for (; optind < argc; optind++, count++) {
+		if (parse_op(argv[optind], &ops[count]) < 0) {
+			fprintf(stderr, "msi-ec-batch: invalid op %s\n",
+				argv[optind]);
+			return 2;
+		}
+	}
+
+	fd = open(DEVICE, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		fd = open(DEVICE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("msi-ec-batch: " DEVICE);
+		return 1;
+	}
+
+	if (sync)
+		return run_sync(fd, ops, count, flags);
+	return run_uring(fd, ops, count, flags, repeat);
+}
@@ -0,0 +1,332 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * msi-ec-contention.c - write contention benchmark for msi-ec.
+ *
+ * Every target is a sysfs attribute plus the values to cycle through. Each
+ * target is first driven alone and then all targets are driven concurrently,
+ * one thread per target, to compare throughput and latency with the serial
+ * baseline. After the concurrent run every attribute must read back the last
+ * value its thread wrote; a mismatch is a lost update. The original values
+ * are restored on exit.
+ *
+ * Usage: msi-ec-contention [-d sysfs_dir] [-t seconds] [path=v1,v2,...]...
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_SYSFS_DIR "/sys/devices/platform/msi-ec"
+#define DEFAULT_SECONDS 3
+
+#define MAX_TARGETS 16
+#define MAX_VALUES 8
+#define VALUE_SIZE 32
+
+struct target {
+	char path[512];
+	char values[MAX_VALUES][VALUE_SIZE];
+	int value_count;
+	char original[VALUE_SIZE];
+
+	/* Results of the last run */
+	unsigned long ops;
+	unsigned long errors;
+	double max_latency;
+	double total_latency;
+	int last;
+};
+
+/* Different registers: 0x2c, 0x2d, 0x98 and 0x2e */
+static const char *const default_targets[] = {
+	"/sys/class/leds/platform::micmute/brightness=1,0",
+	"/sys/class/leds/platform::mute/brightness=1,0",
+	"%s/cooler_boost=on,off",
+	"%s/webcam=off,on",
+};
+
+static struct target targets[MAX_TARGETS];
+static int target_count;
+static volatile int running;
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void trim(char *value)
+{
+	size_t len = strlen(value);
+
+	while (len && (value[len - 1] == '\n' || value[len - 1] == ' '))
+		value[--len] = '\0';
+}
+
+static int read_value(const char *path, char *value, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, value, size - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+	value[len] = '\0';
+	trim(value);
+	return 0;
+}
+
+static int write_value(int fd, const char *value)
+{
+	if (pwrite(fd, value, strlen(value), 0) < 0)
+		return -errno;
+	return 0;
+}
+
+static int parse_target(const char *spec, const char *dir)
+{
+	struct target *target;
+	char buf[512];
+	char *values, *value, *save;
+
+	if (target_count == MAX_TARGETS) {
+		fprintf(stderr, "msi-ec-contention: too many targets\n");
+		return -1;
+	}
+	target = &targets[target_count];
+	memset(target, 0, sizeof(*target));
+
+	/* Only the built-in targets are relative to the sysfs directory */
+	if (dir)
+		snprintf(buf, sizeof(buf), spec, dir);
+	else
+		snprintf(buf, sizeof(buf), "%s", spec);
+	values = strchr(buf, '=');
+	if (!values) {
+		fprintf(stderr, "msi-ec-contention: missing values in %s\n",
+			spec);
+		return -1;
+	}
+	*values++ = '\0';
+	snprintf(target->path, sizeof(target->path), "%s", buf);
+
+	for (value = strtok_r(values, ",", &save);
+	     value && target->value_count < MAX_VALUES;
+	     value = strtok_r(NULL, ",", &save))
+		snprintf(target->values[target->value_count++], VALUE_SIZE,
+			 "%s", value);
+
+	if (!target->value_count)
+		return -1;
+
+	target_count++;
+	return 0;
+}
+
+static void *drive(void *arg)
+{
+	struct target *target = arg;
+	double start, latency;
+	int fd, i = 0;
+
+	target->ops = 0;
+	target->errors = 0;
+	target->max_latency = 0;
+	target->total_latency = 0;
+	target->last = -1;
+
+	fd = open(target->path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		target->errors++;
+		return NULL;
+	}
+
+	while (running) {
+		start = now_seconds();
+		if (write_value(fd, target->values[i]) < 0) {
+			target->errors++;
+		} else {
+			target->ops++;
+			target->last = i;
+		}
+		latency = now_seconds() - start;
+		target->total_latency += latency;
+		if (latency > target->max_latency)
+			target->max_latency = latency;
+		i = (i + 1) % target->value_count;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static long long read_lock_waits(const char *dir)
+{
+	char path[512];
+	char buf[1024];
+	char *line;
+
+	snprintf(path, sizeof(path), "%s/ec_stats", dir);
+	if (read_value(path, buf, sizeof(buf)) < 0)
+		return -1;
+	line = strstr(buf, "lock_waits ");
+	if (!line)
+		return -1;
+	return strtoll(line + strlen("lock_waits "), NULL, 10);
+}
+
+static void run(struct target *set, int count, unsigned int seconds)
+{
+	pthread_t threads[MAX_TARGETS];
+	int i;
+
+	running = 1;
+	for (i = 0; i < count; i++)
+		pthread_create(&threads[i], NULL, drive, &set[i]);
+	sleep(seconds);
+	running = 0;
+	for (i = 0; i < count; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static void report(const struct target *target, unsigned int seconds)
+{
+	printf("  %-48s %8.1f ops/s  avg %7.3f ms  max %7.3f ms  errors %lu\n",
+	       target->path, (double)target->ops / seconds,
+	       target->ops ? target->total_latency / target->ops * 1e3 : 0,
+	       target->max_latency * 1e3, target->errors);
+}
+
+static int check_lost_updates(void)
+{
+	char value[VALUE_SIZE];
+	int lost = 0;
+	int i;
+
+	for (i = 0; i < target_count; i++) {
+		const struct target *target = &targets[i];
+
+		if (target->last < 0)
+			continue;
+		if (read_value(target->path, value, sizeof(value)) < 0)
+			continue;
+		if (strcmp(value, target->values[target->last]) != 0) {
+			printf("  lost update: %s is %s, expected %s\n",
+			       target->path, value,
+			       target->values[target->last]);
+			lost++;
+		}
+	}
+
+	return lost;
+}
+
+static void restore(void)
+{
+	int fd, i;
+
+	for (i = 0; i < target_count; i++) {
+		if (!targets[i].original[0])
+			continue;
+		fd = open(targets[i].path, O_WRONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		write_value(fd, targets[i].original);
+		close(fd);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-d sysfs_dir] [-t seconds] [path=v1,v2,...]...\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = DEFAULT_SYSFS_DIR;
+	unsigned int seconds = DEFAULT_SECONDS;
+	unsigned long serial_ops = 0, parallel_ops = 0;
+	long long waits_before, waits_after;
+	int lost, result;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "d:t:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+	if (!seconds)
+		seconds = 1;
+
+	if (optind < argc) {
+		for (i = optind; i < argc; i++) {
+			if (parse_target(argv[i], NULL) < 0)
+				return 2;
+		}
+	} else {
+		for (i = 0; i < (int)(sizeof(default_targets) /
+				      sizeof(default_targets[0])); i++)
+			parse_target(default_targets[i], dir);
+	}
+
+	for (i = 0; i < target_count; i++) {
+		result = read_value(targets[i].path, targets[i].original,
+				    sizeof(targets[i].original));
+		if (result < 0) {
+			fprintf(stderr, "msi-ec-contention: reading %s: %s\n",
+				targets[i].path, strerror(-result));
+			return 1;
+		}
+	}
+
+	printf("serial (%u s per target):\n", seconds);
+	for (i = 0; i < target_count; i++) {
+		run(&targets[i], 1, seconds);
+		report(&targets[i], seconds);
+		serial_ops += targets[i].ops;
+	}
+
+	waits_before = read_lock_waits(dir);
+	printf("concurrent (%d threads, %u s):\n", target_count, seconds);
+	run(targets, target_count, seconds);
+	waits_after = read_lock_waits(dir);
+	for (i = 0; i < target_count; i++) {
+		report(&targets[i], seconds);
+		parallel_ops += targets[i].ops;
+	}
+
+	/* The serial figure is the mean rate of a single writer */
+	printf("aggregate: %.1f ops/s concurrent vs %.1f ops/s single writer\n",
+	       (double)parallel_ops / seconds,
+	       (double)serial_ops / seconds / target_count);
+	if (waits_before >= 0 && waits_after >= 0)
+		printf("driver lock waits: %lld\n", waits_after - waits_before);
+
+	lost = check_lost_updates();
+	printf("lost updates: %d\n", lost);
+
+	restore();
+	return lost ? 1 : 0;
+}
@@ -0,0 +1,366 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * msi-ec-exporter.c - node_exporter textfile collector for msi-ec.
+ *
+ * Every scrape reads the driver's snapshot attribute once (a single pass over
+ * the EC RAM) plus the driver's own ec_stats, and writes the metrics to a
+ * temporary file that is renamed over the target, so node_exporter never sees
+ * a partially written file.
+ *
+ * Usage: msi-ec-exporter [-d sysfs_dir] [-o output.prom] [-i interval_s]
+ *   -i 0 (default) performs a single scrape and exits.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_SYSFS_DIR "/sys/devices/platform/msi-ec"
+#define DEFAULT_OUTPUT "/var/lib/node_exporter/textfile_collector/msi_ec.prom"
+
+#define MAX_FIELDS 64
+#define OUTPUT_SIZE 16384
+
+struct field {
+	char key[32];
+	char value[32];
+};
+
+struct fields {
+	struct field items[MAX_FIELDS];
+	int count;
+};
+
+struct output {
+	char data[OUTPUT_SIZE];
+	size_t len;
+};
+
+/* Gauges taken verbatim from the snapshot */
+static const struct {
+	const char *key;
+	const char *metric;
+	const char *labels;
+	const char *help;
+} gauges[] = {
+	{ "cpu_temperature", "msi_ec_temperature_celsius", "sensor=\"cpu\"",
+	  "Realtime temperature reported by the EC." },
+	{ "gpu_temperature", "msi_ec_temperature_celsius", "sensor=\"gpu\"",
+	  "Realtime temperature reported by the EC." },
+	{ "cpu_fan_speed", "msi_ec_fan_speed_percent", "fan=\"cpu\"",
+	  "Realtime fan speed in percent." },
+	{ "gpu_fan_speed", "msi_ec_fan_speed_percent", "fan=\"gpu\"",
+	  "Realtime fan speed in percent." },
+	{ "cpu_fan_rpm", "msi_ec_fan_rpm", "fan=\"cpu\"",
+	  "Realtime fan speed in revolutions per minute." },
+	{ "gpu_fan_rpm", "msi_ec_fan_rpm", "fan=\"gpu\"",
+	  "Realtime fan speed in revolutions per minute." },
+	{ "ac_connected", "msi_ec_ac_connected", "",
+	  "Whether the power adapter is connected." },
+	{ "lid_open", "msi_ec_lid_open", "", "Whether the lid is open." },
+	{ "cooler_boost", "msi_ec_cooler_boost", "",
+	  "Whether cooler boost is enabled." },
+	{ "battery_charge_threshold", "msi_ec_battery_charge_threshold_percent",
+	  "", "Battery charge level at which charging stops." },
+	{ "battery_saving_flags", "msi_ec_battery_saving_flags", "",
+	  "Battery saving flags at 0xEB, as a bit mask." },
+};
+
+/* Mode states exported as one series per state, set to 1 for the active one */
+static const struct {
+	const char *key;
+	const char *metric;
+	const char *label;
+	const char *help;
+	const char *states[8];
+} enums[] = {
+	{ "shift_mode", "msi_ec_shift_mode", "mode", "Active shift mode.",
+	  { "overclock", "balanced", "eco", "off", "unknown" } },
+	{ "fan_mode", "msi_ec_fan_mode", "mode", "Active fan mode.",
+	  { "auto", "silent", "basic", "advanced" } },
+	{ "preset", "msi_ec_preset", "preset", "Active user scenario.",
+	  { "super_battery", "silent", "balanced", "high_performance",
+	    "custom" } },
+};
+
+/* Driver counters and gauges from ec_stats */
+static const struct {
+	const char *key;
+	const char *metric;
+	const char *help;
+	const char *type;
+	double scale;
+} counters[] = {
+	{ "ec_reads", "msi_ec_driver_ec_reads_total",
+	  "EC read transactions issued by the driver.", "counter", 1 },
+	{ "ec_writes", "msi_ec_driver_ec_writes_total",
+	  "EC write transactions issued by the driver.", "counter", 1 },
+	{ "ec_errors", "msi_ec_driver_ec_errors_total",
+	  "Failed EC transactions.", "counter", 1 },
+	{ "ec_busy_ns", "msi_ec_driver_ec_busy_seconds_total",
+	  "Time spent in EC transactions.", "counter", 1e-9 },
+	{ "budget_used_percent", "msi_ec_driver_budget_used_ratio",
+	  "Share of the EC duty cycle budget in use.", "gauge", 0.01 },
+	{ "budget_deferred", "msi_ec_driver_budget_deferred_total",
+	  "Background rounds skipped for lack of EC budget.", "counter", 1 },
+	{ "external_changes", "msi_ec_driver_external_changes_total",
+	  "Cached register ranges found changed by other EC writers.",
+	  "counter", 1 },
+};
+
+static void out_printf(struct output *out, const char *fmt, ...)
+{
+	va_list args;
+	int written;
+
+	if (out->len >= sizeof(out->data))
+		return;
+
+	va_start(args, fmt);
+	written = vsnprintf(out->data + out->len, sizeof(out->data) - out->len,
+			    fmt, args);
+	va_end(args);
+
+	if (written > 0)
+		out->len += written;
+	if (out->len > sizeof(out->data))
+		out->len = sizeof(out->data);
+}
+
+static const char *fields_get(const struct fields *fields, const char *key)
+{
+	int i;
+
+	for (i = 0; i < fields->count; i++) {
+		if (strcmp(fields->items[i].key, key) == 0)
+			return fields->items[i].value;
+	}
+	return NULL;
+}
+
+/* Reads a "key value" file with a single read() and splits it into fields */
+static int read_fields(const char *dir, const char *name,
+		       struct fields *fields)
+{
+	char path[512];
+	char buf[4096];
+	char *line, *save;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+	buf[len] = '\0';
+
+	fields->count = 0;
+	for (line = strtok_r(buf, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		struct field *field;
+
+		if (fields->count == MAX_FIELDS)
+			break;
+		field = &fields->items[fields->count];
+		if (sscanf(line, "%31s %31s", field->key, field->value) == 2)
+			fields->count++;
+	}
+
+	return 0;
+}
+
+static void emit_header(struct output *out, const char *metric,
+			const char *help, const char *type)
+{
+	out_printf(out, "# HELP %s %s\n# TYPE %s %s\n", metric, help, metric,
+		   type);
+}
+
+static void emit_snapshot(struct output *out, const struct fields *snapshot)
+{
+	const char *last = "";
+	const char *value;
+	size_t i, s;
+
+	for (i = 0; i < sizeof(gauges) / sizeof(gauges[0]); i++) {
+		value = fields_get(snapshot, gauges[i].key);
+		if (!value)
+			continue;
+		/* Series sharing a metric name share one header */
+		if (strcmp(last, gauges[i].metric) != 0)
+			emit_header(out, gauges[i].metric, gauges[i].help,
+				    "gauge");
+		last = gauges[i].metric;
+		if (gauges[i].labels[0])
+			out_printf(out, "%s{%s} %s\n", gauges[i].metric,
+				   gauges[i].labels, value);
+		else
+			out_printf(out, "%s %s\n", gauges[i].metric, value);
+	}
+
+	for (i = 0; i < sizeof(enums) / sizeof(enums[0]); i++) {
+		value = fields_get(snapshot, enums[i].key);
+		if (!value)
+			continue;
+		emit_header(out, enums[i].metric, enums[i].help, "gauge");
+		for (s = 0; enums[i].states[s]; s++)
+			out_printf(out, "%s{%s=\"%s\"} %d\n", enums[i].metric,
+				   enums[i].label, enums[i].states[s],
+				   strcmp(value, enums[i].states[s]) == 0);
+	}
+}
+
+static void emit_stats(struct output *out, const struct fields *stats)
+{
+	const char *value;
+	size_t i;
+
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+		value = fields_get(stats, counters[i].key);
+		if (!value)
+			continue;
+		emit_header(out, counters[i].metric, counters[i].help,
+			    counters[i].type);
+		out_printf(out, "%s %.9g\n", counters[i].metric,
+			   strtod(value, NULL) * counters[i].scale);
+	}
+}
+
+/* Writes the output next to the target and renames it into place */
+static int write_atomic(const char *path, const struct output *out)
+{
+	char tmp[512];
+	size_t done = 0;
+	ssize_t written;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	while (done < out->len) {
+		written = write(fd, out->data + done, out->len - done);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		}
+		done += written;
+	}
+
+	if (fsync(fd) < 0)
+		goto fail;
+	if (close(fd) < 0) {
+		fd = -1;
+		goto fail;
+	}
+	if (rename(tmp, path) < 0) {
+		fd = -1;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	written = -errno;
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+	return written;
+}
+
+static double elapsed_seconds(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int scrape(const char *dir, const char *output)
+{
+	static struct fields snapshot, stats;
+	static struct output out;
+	struct timespec start;
+	int result;
+
+	out.len = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	result = read_fields(dir, "snapshot", &snapshot);
+	if (result == 0) {
+		emit_snapshot(&out, &snapshot);
+		if (read_fields(dir, "ec_stats", &stats) == 0)
+			emit_stats(&out, &stats);
+	} else {
+		fprintf(stderr, "msi-ec-exporter: reading %s/snapshot: %s\n",
+			dir, strerror(-result));
+	}
+
+	emit_header(&out, "msi_ec_scrape_success",
+		    "Whether the last scrape of the driver succeeded.",
+		    "gauge");
+	out_printf(&out, "msi_ec_scrape_success %d\n", result == 0);
+	emit_header(&out, "msi_ec_scrape_duration_seconds",
+		    "Time taken by the last scrape.", "gauge");
+	out_printf(&out, "msi_ec_scrape_duration_seconds %.6f\n",
+		   elapsed_seconds(&start));
+
+	result = write_atomic(output, &out);
+	if (result < 0)
+		fprintf(stderr, "msi-ec-exporter: writing %s: %s\n", output,
+			strerror(-result));
+	return result;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-d sysfs_dir] [-o output.prom] [-i interval_s]\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = DEFAULT_SYSFS_DIR;
+	const char *output = DEFAULT_OUTPUT;
+	unsigned int interval = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:o:i:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+
+	if (!interval)
+		return scrape(dir, output) < 0 ? 1 : 0;
+
+	for (;;) {
+		scrape(dir, output);
+		sleep(interval);
+	}
+}
@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * msi-ec-lease.c - run a command under a performance lease.
+ *
+ * The lease is held through an open /dev/msi-ec descriptor for as long as the
+ * command runs. The driver drops it when this process exits for any reason,
+ * so a killed build cannot leave the machine in overclock.
+ *
+ * Usage: msi-ec-lease [-s eco|balanced|overclock] [-f auto|advanced] [-b]
+ *                     command [args...]
+ *        msi-ec-lease -q
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../msi-ec-ioctl.h"
+
+#define DEVICE "/dev/msi-ec"
+
+static const char *const shift_modes[] = {
+	[MSI_EC_LEASE_SHIFT_NONE] = "none",
+	[MSI_EC_LEASE_SHIFT_ECO] = "eco",
+	[MSI_EC_LEASE_SHIFT_BALANCED] = "balanced",
+	[MSI_EC_LEASE_SHIFT_OVERCLOCK] = "overclock",
+};
+
+static const char *const fan_modes[] = {
+	[MSI_EC_LEASE_FAN_NONE] = "none",
+	[MSI_EC_LEASE_FAN_AUTO] = "auto",
+	[MSI_EC_LEASE_FAN_ADVANCED] = "advanced",
+};
+
+static int lookup(const char *const *names, int count, const char *name)
+{
+	int i;
+
+	for (i = 1; i < count; i++) {
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int query(int fd)
+{
+	struct msi_ec_lease_state state;
+
+	if (ioctl(fd, MSI_EC_IOC_GET_LEASES, &state) < 0) {
+		perror("msi-ec-lease: " DEVICE);
+		return 1;
+	}
+
+	printf("leases %u\nshift_mode %s\nfan_mode %s\ncooler_boost %s\n",
+	       state.count, shift_modes[state.floor.shift_mode],
+	       fan_modes[state.floor.fan_mode],
+	       state.floor.flags & MSI_EC_LEASE_COOLER_BOOST ? "on" : "off");
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-s eco|balanced|overclock] [-f auto|advanced] [-b] "
+		"command [args...]\n"
+		"       %s -q\n",
+		name, name);
+}
+
+int main(int argc, char **argv)
+{
+	struct msi_ec_lease lease;
+	int status;
+	int opt, value;
+	int do_query = 0;
+	pid_t child;
+	int fd;
+
+	memset(&lease, 0, sizeof(lease));
+
+	/* "+" stops at the command so its options are passed through */
+	while ((opt = getopt(argc, argv, "+s:f:bqh")) != -1) {
+		switch (opt) {
+		case 's':
+			value = lookup(shift_modes, 4, optarg);
+			if (value < 0) {
+				usage(argv[0]);
+				return 2;
+			}
+			lease.shift_mode = value;
+			break;
+		case 'f':
+			value = lookup(fan_modes, 3, optarg);
+			if (value < 0) {
+				usage(argv[0]);
+				return 2;
+			}
+			lease.fan_mode = value;
+			break;
+		case 'b':
+			lease.flags |= MSI_EC_LEASE_COOLER_BOOST;
+			break;
+		case 'q':
+			do_query = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+
+	if (!do_query && optind == argc) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	/* O_CLOEXEC: the lease belongs to this process, not to the command */
+	fd = open(DEVICE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("msi-ec-lease: " DEVICE);
+		return 1;
+	}
+
+	if (do_query)
+		return query(fd);
+
+	if (ioctl(fd, MSI_EC_IOC_SET_LEASE, &lease) < 0) {
+		perror("msi-ec-lease: setting lease");
+		return 1;
+	}
+
+	child = fork();
+	if (child < 0) {
+		perror("msi-ec-lease: fork");
+		return 1;
+	}
+	if (child == 0) {
+		execvp(argv[optind], argv + optind);
+		fprintf(stderr, "msi-ec-lease: %s: %s\n", argv[optind],
+			strerror(errno));
+		_exit(127);
+	}
+
+	/* Terminal signals reach the command; wait for it either way */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	while (waitpid(child, &status, 0) < 0) {
+		if (errno != EINTR) {
+			perror("msi-ec-lease: waitpid");
+			return 1;
+		}
+	}
+
+	/* Closing the descriptor on exit drops the lease */
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	return 128 + WTERMSIG(status);
+}
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * msi-ec-policy.bpf.c - example policy for the msi-ec policy hook.
+ *
+ * Turns cooler boost on when the hottest of CPU and GPU reaches
+ * boost_temperature and off again below release_temperature, and keeps at
+ * least the balanced shift mode while on AC. The driver calls the hook every
+ * policy_interval_ms and merges the decision with the performance leases.
+ *
+ * Build with "make bpf" (needs clang and the libbpf headers), then load and
+ * attach it with:
+ *   bpftool prog loadall msi-ec-policy.bpf.o /sys/fs/bpf/msi-ec autoattach
+ * Removing /sys/fs/bpf/msi-ec detaches it again.
+ */
+
+#include <linux/types.h>
+
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+
+#include "../msi-ec-ioctl.h"
+
+char LICENSE[] SEC("license") = "GPL";
+
+/* Read-only after loading; a skeleton can set them before */
+const volatile __u8 boost_temperature = 85;
+const volatile __u8 release_temperature = 75;
+
+static __u8 boosting;
+
+SEC("fmod_ret/msi_ec_policy_decide")
+int BPF_PROG(msi_ec_policy, const struct msi_ec_policy_sample *sample,
+	     int ret)
+{
+	__u8 temperature = sample->cpu_temperature;
+	__u8 shift_mode = MSI_EC_LEASE_SHIFT_NONE;
+
+	if (sample->gpu_temperature > temperature)
+		temperature = sample->gpu_temperature;
+
+	/* Hysteresis keeps the fans from toggling around one temperature */
+	if (temperature >= boost_temperature)
+		boosting = 1;
+	else if (temperature < release_temperature)
+		boosting = 0;
+
+	if (sample->ac_connected)
+		shift_mode = MSI_EC_LEASE_SHIFT_BALANCED;
+
+	return MSI_EC_POLICY_DECISION(shift_mode, MSI_EC_LEASE_FAN_NONE,
+				      boosting ? MSI_EC_LEASE_COOLER_BOOST : 0);
+}
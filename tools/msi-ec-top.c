@@ -0,0 +1,426 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * msi-ec-top.c - Terminal monitor for msi-ec.
+ *
+ * The monitor waits for change notifications on the driver's snapshot
+ * attribute instead of re-reading sysfs on a timer. Enable the driver's
+ * sampler for this to work:
+ *
+ *   echo 1000 > /sys/module/msi_ec/parameters/sample_interval_ms
+ *
+ * Without the sampler, the snapshot is re-read every -i seconds, which costs
+ * one pass over the EC RAM per refresh. Only the cells that changed since the
+ * previous frame are redrawn.
+ *
+ * Usage: msi-ec-top [-d sysfs_dir] [-i fallback_interval_s]
+ *   Keys: q quit, r redraw
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_SYSFS_DIR "/sys/devices/platform/msi-ec"
+#define SAMPLER_PARAM "/sys/module/msi_ec/parameters/sample_interval_ms"
+
+#define ROWS 22
+#define COLS 80
+#define MAX_FIELDS 64
+#define STATS_INTERVAL_MS 1000
+
+struct field {
+	char key[32];
+	char value[64];
+};
+
+struct fields {
+	struct field items[MAX_FIELDS];
+	int count;
+};
+
+struct screen {
+	char cur[ROWS][COLS];
+	char prev[ROWS][COLS];
+};
+
+static struct termios saved_termios;
+static volatile sig_atomic_t quit;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+static void term_restore(void)
+{
+	tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+	fputs("\033[?25h\033[?1049l", stdout);
+	fflush(stdout);
+}
+
+static int term_setup(void)
+{
+	struct termios raw;
+
+	if (tcgetattr(STDIN_FILENO, &saved_termios) < 0)
+		return -errno;
+
+	raw = saved_termios;
+	raw.c_lflag &= ~(ICANON | ECHO);
+	raw.c_cc[VMIN] = 0;
+	raw.c_cc[VTIME] = 0;
+	if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) < 0)
+		return -errno;
+
+	atexit(term_restore);
+	fputs("\033[?1049h\033[?25l\033[2J", stdout);
+	return 0;
+}
+
+/* ---- Screen model ---- */
+
+static void screen_invalidate(struct screen *screen)
+{
+	memset(screen->prev, 0, sizeof(screen->prev));
+	fputs("\033[2J", stdout);
+}
+
+static void screen_clear(struct screen *screen)
+{
+	memset(screen->cur, ' ', sizeof(screen->cur));
+}
+
+static void screen_put(struct screen *screen, int row, int col,
+		       const char *fmt, ...)
+{
+	char text[COLS + 1];
+	va_list args;
+	int len;
+
+	if (row < 0 || row >= ROWS || col < 0 || col >= COLS)
+		return;
+
+	va_start(args, fmt);
+	len = vsnprintf(text, sizeof(text), fmt, args);
+	va_end(args);
+
+	if (len < 0)
+		return;
+	if (len > COLS - col)
+		len = COLS - col;
+	memcpy(&screen->cur[row][col], text, len);
+}
+
+/* Emits only the runs of cells that differ from the previous frame */
+static void screen_flush(struct screen *screen)
+{
+	int row, col, end;
+
+	for (row = 0; row < ROWS; row++) {
+		for (col = 0; col < COLS; col = end) {
+			if (screen->cur[row][col] == screen->prev[row][col]) {
+				end = col + 1;
+				continue;
+			}
+			for (end = col; end < COLS; end++) {
+				if (screen->cur[row][end] ==
+				    screen->prev[row][end])
+					break;
+			}
+			printf("\033[%d;%dH%.*s", row + 1, col + 1, end - col,
+			       &screen->cur[row][col]);
+		}
+	}
+
+	memcpy(screen->prev, screen->cur, sizeof(screen->prev));
+	fflush(stdout);
+}
+
+/* ---- Driver attributes ---- */
+
+static const char *fields_get(const struct fields *fields, const char *key)
+{
+	int i;
+
+	for (i = 0; i < fields->count; i++) {
+		if (strcmp(fields->items[i].key, key) == 0)
+			return fields->items[i].value;
+	}
+	return "-";
+}
+
+static long fields_get_long(const struct fields *fields, const char *key)
+{
+	return strtol(fields_get(fields, key), NULL, 10);
+}
+
+/* Re-reads an open "key value" attribute from the start */
+static int read_fields(int fd, struct fields *fields)
+{
+	char buf[4096];
+	char *line, *save;
+	ssize_t len;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0)
+		return -errno;
+	buf[len] = '\0';
+
+	fields->count = 0;
+	for (line = strtok_r(buf, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		struct field *field;
+
+		if (fields->count == MAX_FIELDS)
+			break;
+		field = &fields->items[fields->count];
+		if (sscanf(line, "%31s %63s", field->key, field->value) == 2)
+			fields->count++;
+	}
+
+	return 0;
+}
+
+static int open_attr(const char *dir, const char *name)
+{
+	char path[512];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static void read_line(const char *path, char *buf, size_t size)
+{
+	FILE *file = fopen(path, "re");
+
+	buf[0] = '\0';
+	if (!file)
+		return;
+	if (fgets(buf, size, file))
+		buf[strcspn(buf, "\n")] = '\0';
+	fclose(file);
+}
+
+static long sampler_interval(void)
+{
+	char buf[32];
+
+	read_line(SAMPLER_PARAM, buf, sizeof(buf));
+	return strtol(buf, NULL, 10);
+}
+
+/* ---- Layout ---- */
+
+static void draw_curve(struct screen *screen, int row, const char *label,
+		       const char *values)
+{
+	char copy[64];
+	char *value, *save;
+	int col = 20;
+
+	screen_put(screen, row, 2, "%s", label);
+	snprintf(copy, sizeof(copy), "%s", values);
+	for (value = strtok_r(copy, ",", &save); value;
+	     value = strtok_r(NULL, ",", &save), col += 6)
+		screen_put(screen, row, col, "%5s", value);
+}
+
+static void draw(struct screen *screen, const char *fw,
+		 const struct fields *snap, const struct fields *stats,
+		 long reads_per_s, long interval, const char *source)
+{
+	char stamp[16];
+	time_t now = time(NULL);
+	int i;
+
+	strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+	screen_clear(screen);
+
+	screen_put(screen, 0, 0, "msi-ec-top  fw %s", fw);
+	if (interval > 0)
+		screen_put(screen, 0, 44, "sampler %ld ms", interval);
+	else
+		screen_put(screen, 0, 44, "sampler off (polling)");
+	screen_put(screen, 0, 68, "q quit r redraw");
+
+	screen_put(screen, 2, 0, "Sensors");
+	screen_put(screen, 2, 20, "%10s %10s", "CPU", "GPU");
+	screen_put(screen, 3, 2, "Temperature C");
+	screen_put(screen, 3, 20, "%10s %10s", fields_get(snap, "cpu_temperature"),
+		   fields_get(snap, "gpu_temperature"));
+	screen_put(screen, 4, 2, "Fan speed %%");
+	screen_put(screen, 4, 20, "%10s %10s", fields_get(snap, "cpu_fan_speed"),
+		   fields_get(snap, "gpu_fan_speed"));
+	screen_put(screen, 5, 2, "Fan RPM");
+	screen_put(screen, 5, 20, "%10s %10s", fields_get(snap, "cpu_fan_rpm"),
+		   fields_get(snap, "gpu_fan_rpm"));
+
+	screen_put(screen, 7, 0, "Modes");
+	screen_put(screen, 8, 2, "Shift mode   %-12s Fan mode  %-10s Preset %s",
+		   fields_get(snap, "shift_mode"), fields_get(snap, "fan_mode"),
+		   fields_get(snap, "preset"));
+	screen_put(screen, 9, 2, "Cooler boost %-12s AC        %-10s Lid    %s",
+		   fields_get_long(snap, "cooler_boost") ? "on" : "off",
+		   fields_get_long(snap, "ac_connected") ? "connected" : "battery",
+		   fields_get_long(snap, "lid_open") ? "open" : "closed");
+
+	screen_put(screen, 11, 0, "Fan curves");
+	for (i = 0; i < 7; i++)
+		screen_put(screen, 11, 20 + i * 6, "%5d", i + 1);
+	draw_curve(screen, 12, "CPU temperature C",
+		   fields_get(snap, "cpu_fan_curve_temperatures"));
+	draw_curve(screen, 13, "CPU fan speed %",
+		   fields_get(snap, "cpu_fan_curve_speeds"));
+	draw_curve(screen, 14, "GPU temperature C",
+		   fields_get(snap, "gpu_fan_curve_temperatures"));
+	draw_curve(screen, 15, "GPU fan speed %",
+		   fields_get(snap, "gpu_fan_curve_speeds"));
+
+	screen_put(screen, 17, 0, "Driver EC statistics");
+	screen_put(screen, 18, 2, "reads  %-12s (%ld/s)", fields_get(stats, "ec_reads"),
+		   reads_per_s);
+	screen_put(screen, 18, 40, "writes     %s", fields_get(stats, "ec_writes"));
+	screen_put(screen, 19, 2, "errors %-12s", fields_get(stats, "ec_errors"));
+	screen_put(screen, 19, 40, "busy       %.3f s",
+		   fields_get_long(stats, "ec_busy_ns") / 1e9);
+	screen_put(screen, 20, 40, "cache hits %s", fields_get(stats, "cache_hits"));
+
+	screen_put(screen, 21, 0, "updated %s (%s)", stamp, source);
+	screen_flush(screen);
+}
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int main(int argc, char **argv)
+{
+	static struct screen screen;
+	static struct fields snap, stats;
+	const char *dir = DEFAULT_SYSFS_DIR;
+	long fallback_ms = 2000;
+	long last_snap, last_stats, prev_reads = -1, reads_per_s = 0;
+	const char *source = "initial";
+	char fw[64], path[512];
+	struct pollfd fds[2];
+	int snap_fd, stats_fd;
+	long interval;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:i:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'i':
+			fallback_ms = strtol(optarg, NULL, 10) * 1000;
+			if (fallback_ms <= 0)
+				fallback_ms = 1000;
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: %s [-d sysfs_dir] [-i fallback_interval_s]\n",
+				argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+
+	snap_fd = open_attr(dir, "snapshot");
+	stats_fd = open_attr(dir, "ec_stats");
+	if (snap_fd < 0 || stats_fd < 0) {
+		fprintf(stderr, "msi-ec-top: cannot open %s: %s\n", dir,
+			strerror(errno));
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/fw_version", dir);
+	read_line(path, fw, sizeof(fw));
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	if (term_setup() < 0) {
+		fprintf(stderr, "msi-ec-top: not a terminal\n");
+		return 1;
+	}
+
+	fds[0].fd = snap_fd;
+	fds[0].events = POLLPRI;
+	fds[1].fd = STDIN_FILENO;
+	fds[1].events = POLLIN;
+
+	read_fields(snap_fd, &snap);
+	last_snap = last_stats = now_ms() - STATS_INTERVAL_MS;
+
+	while (!quit) {
+		long now = now_ms();
+		long timeout;
+
+		interval = sampler_interval();
+
+		if (now - last_stats >= STATS_INTERVAL_MS) {
+			read_fields(stats_fd, &stats);
+			if (prev_reads >= 0)
+				reads_per_s = (fields_get_long(&stats, "ec_reads") -
+					       prev_reads) * 1000 /
+					      (now - last_stats);
+			prev_reads = fields_get_long(&stats, "ec_reads");
+			last_stats = now;
+		}
+
+		/* Without the sampler nothing notifies us; poll the EC instead */
+		if (interval <= 0 && now - last_snap >= fallback_ms) {
+			read_fields(snap_fd, &snap);
+			last_snap = now;
+			source = "poll";
+		}
+
+		draw(&screen, fw, &snap, &stats, reads_per_s, interval, source);
+
+		timeout = STATS_INTERVAL_MS - (now_ms() - last_stats);
+		if (interval <= 0 && fallback_ms - (now_ms() - last_snap) < timeout)
+			timeout = fallback_ms - (now_ms() - last_snap);
+		if (timeout < 0)
+			timeout = 0;
+
+		if (poll(fds, 2, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[0].revents & (POLLPRI | POLLERR)) {
+			read_fields(snap_fd, &snap);
+			last_snap = now_ms();
+			source = "notification";
+		}
+
+		if (fds[1].revents & POLLIN) {
+			char key;
+
+			while (read(STDIN_FILENO, &key, 1) == 1) {
+				if (key == 'q')
+					quit = 1;
+				else if (key == 'r')
+					screen_invalidate(&screen);
+			}
+		}
+	}
+
+	close(snap_fd);
+	close(stats_fd);
+	return 0;
+}